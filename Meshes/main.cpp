@@ -9,6 +9,7 @@
 #define _USE_MATH_DEFINES
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #if defined(__APPLE__)
@@ -23,16 +24,616 @@
 #include <GL/freeglut.h>
 #endif
 
+// builds linked against libEGL can render without a window or display server, see --headless
+#if defined(HEADLESS_EGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
+#endif
+#include <sys/stat.h>
+
+// mat4 and vec4 use SSE on x86 and NEON on ARM, plain loops elsewhere
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define MATH_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MATH_NEON 1
+#endif
+
 #include <string>
 #include <vector>
 #include <fstream>
 #include <algorithm>
+#include <chrono>
+#include <map>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <cstdint>
 const unsigned int windowWidth = 512, windowHeight = 512;
 
+const char* meshDirectory = "/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/";
+
 int majorVersion = 3, minorVersion = 0;
 
+// the keys held down as the simulation sees them; only the simulation writes it, from the input queue
+// or a replayed recording
 bool keyboardState[256];
 
+// key presses and releases on their way from GLUT's callbacks to the simulation thread. One thread pushes
+// and one pops, each advancing only its own index, so neither locks nor waits; a full queue drops the event
+class InputQueue
+{
+public:
+    struct Event
+    {
+        unsigned char key;
+        bool down;
+    };
+    
+private:
+    static const unsigned int capacity = 256;
+    Event events[capacity];
+    std::atomic<unsigned int> head, tail;
+    
+public:
+    InputQueue() : head(0), tail(0) {}
+    
+    bool Push(const Event& event)
+    {
+        unsigned int t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) == capacity) return false;
+        events[t % capacity] = event;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    
+    bool Pop(Event& event)
+    {
+        unsigned int h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire)) return false;
+        event = events[h % capacity];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+InputQueue inputQueue;
+
+// key events as the simulation applied them, by the step they were applied before, written to a file as
+// they come: a header, then for each event the steps since the last one and whether the key went down,
+// as one variable-length integer, followed by the key. A walk of a few minutes takes a few hundred bytes
+class InputRecorder
+{
+    FILE* file;
+    unsigned int lastStep;
+    int events;
+    
+public:
+    InputRecorder() : file(NULL), lastStep(0), events(0) {}
+    ~InputRecorder() { Close(); }
+    
+    bool Open(const char* path, int stepsPerSecond)
+    {
+        file = fopen(path, "wb");
+        if(!file) return false;
+        unsigned char header[8] = { 'K', 'E', 'Y', 'S', 1, (unsigned char)stepsPerSecond, (unsigned char)(stepsPerSecond >> 8), 0 };
+        fwrite(header, 1, sizeof(header), file);
+        return true;
+    }
+    
+    void Record(unsigned int step, const InputQueue::Event& event)
+    {
+        if(!file) return;
+        uint64_t v = ((uint64_t)(step - lastStep) << 1) | (event.down ? 1 : 0);
+        lastStep = step;
+        for(; v >= 0x80; v >>= 7) fputc((int)(v & 0x7f) | 0x80, file);
+        fputc((int)v, file);
+        fputc(event.key, file);
+        events++;
+    }
+    
+    void Close()
+    {
+        if(!file) return;
+        fclose(file);
+        file = NULL;
+        printf("Recorded %d key events over %u steps\n", events, lastStep);
+    }
+};
+
+// plays back a file written by InputRecorder, handing each event to the simulation at the step it was
+// recorded at; while it plays, live key presses are ignored
+class InputPlayer
+{
+    struct Record
+    {
+        unsigned int step;
+        InputQueue::Event event;
+    };
+    
+    std::vector<Record> records;
+    int next;
+    bool playing;
+    
+public:
+    InputPlayer() : next(0), playing(false) {}
+    
+    bool Open(const char* path, int stepsPerSecond)
+    {
+        FILE* file = fopen(path, "rb");
+        if(!file) return false;
+        unsigned char header[8];
+        if(fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, "KEYS", 4) != 0 || header[4] != 1)
+        {
+            fclose(file);
+            return false;
+        }
+        int recordedRate = header[5] | (header[6] << 8);
+        if(recordedRate != stepsPerSecond)
+            printf("Replay: recorded at %d steps per second, playing at %d\n", recordedRate, stepsPerSecond);
+        
+        unsigned int step = 0;
+        while(true)
+        {
+            uint64_t v = 0;
+            int c, shift = 0;
+            while((c = fgetc(file)) != EOF && (c & 0x80) && shift < 63)
+            {
+                v |= (uint64_t)(c & 0x7f) << shift;
+                shift += 7;
+            }
+            int key = c == EOF ? EOF : fgetc(file);
+            if(key == EOF) break;
+            v |= (uint64_t)c << shift;
+            
+            step += (unsigned int)(v >> 1);
+            Record record = { step, { (unsigned char)key, (v & 1) != 0 } };
+            records.push_back(record);
+        }
+        fclose(file);
+        playing = true;
+        return true;
+    }
+    
+    bool IsPlaying() { return playing; }
+    
+    // the next event due by the given step, if there is one
+    bool Next(unsigned int step, InputQueue::Event& event)
+    {
+        if(!playing) return false;
+        if(next == (int)records.size())
+        {
+            playing = false;
+            printf("Replay finished at step %u\n", step);
+            return false;
+        }
+        if(records[next].step > step) return false;
+        event = records[next++].event;
+        return true;
+    }
+};
+
+// --record and --replay
+InputRecorder inputRecorder;
+InputPlayer inputPlayer;
+
+// work issued while drawing one frame, reset at the start of every frame
+struct FrameStatistics
+{
+    int glCalls;
+    int drawCalls;
+    int triangles;
+    int programChanges;
+    int textureBinds;
+    int vertexArrayBinds;
+    int capabilityChanges;
+    int skippedStateChanges;
+    int visibleObjects;
+    int culledObjects;
+    int culledShadows;
+    
+    FrameStatistics() { Reset(); }
+    void Reset()
+    {
+        glCalls = 0; drawCalls = 0; triangles = 0;
+        programChanges = 0; textureBinds = 0; vertexArrayBinds = 0; capabilityChanges = 0;
+        skippedStateChanges = 0;
+        visibleObjects = 0; culledObjects = 0; culledShadows = 0;
+    }
+};
+
+FrameStatistics frameStats;
+
+// wraps a GL call made on the drawing path so it shows up in frameStats
+#define GL_COUNT(call) (frameStats.glCalls++, call)
+#define GL_DRAW(call) (frameStats.drawCalls++, GL_COUNT(call))
+
+// --profile: timed scopes on every thread that names them, and GPU timestamps around the passes and
+// draws on the GL thread, written as a Chrome trace (chrome://tracing or Perfetto) and a per-frame CSV.
+// Each thread records into a ring of its own that only the GL thread empties, once per frame; GPU
+// timestamps are read back three frames after they were issued, and dropped rather than waited for if
+// they are still not ready. Switched off, a scope costs one test of a flag
+class Profiler
+{
+    struct Event
+    {
+        const char* name;
+        double start, end;      // microseconds since the profiler started
+    };
+    
+    // written only by its thread, read only by the GL thread
+    struct ThreadEvents
+    {
+        static const unsigned int capacity = 16384;
+        Event events[capacity];
+        std::atomic<unsigned int> head, tail;
+        int id;
+        std::string name;
+        
+        ThreadEvents() : head(0), tail(0), id(0) {}
+    };
+    
+    struct GpuScope
+    {
+        const char* name;
+        unsigned int queries[2];
+    };
+    
+    // the GPU timestamps of one frame, with the GPU and CPU time when its first one was issued
+    struct GpuFrame
+    {
+        std::vector<GpuScope> scopes;
+        std::vector<unsigned int> queries;
+        int used;
+        int64_t gpuStart;
+        double cpuStart;
+        
+        GpuFrame() : used(0), gpuStart(0), cpuStart(0) {}
+    };
+    
+    struct Totals
+    {
+        int calls;
+        double cpu, gpu;
+        
+        Totals() : calls(0), cpu(0), gpu(0) {}
+    };
+    
+    struct NameOrder
+    {
+        bool operator()(const char* a, const char* b) const { return strcmp(a, b) < 0; }
+    };
+    
+    static const int frameLatency = 3;
+    
+    std::atomic<bool> enabled;
+    std::chrono::steady_clock::time_point epoch;
+    FILE* trace;
+    FILE* summary;
+    int frame;
+    std::atomic<int> droppedEvents;
+    int droppedGpuFrames;
+    
+    std::mutex threadsMutex;
+    std::vector<ThreadEvents*> threads;
+    static thread_local ThreadEvents* local;
+    
+    GpuFrame gpuFrames[frameLatency];
+    std::vector<int> openGpuScopes;
+    std::map<const char*, Totals, NameOrder> totals[frameLatency];
+    
+    ThreadEvents* GetThreadEvents()
+    {
+        if(local) return local;
+        local = new ThreadEvents();
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        local->id = (int)threads.size() + 1;
+        threads.push_back(local);
+        return local;
+    }
+    
+    void WriteEvent(const char* name, int thread, double start, double end)
+    {
+        fprintf(trace, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f},\n", name, thread, start, end - start);
+    }
+    
+    // empties every thread's ring into the trace and the totals of the frame being ended
+    void CollectCpuEvents()
+    {
+        std::map<const char*, Totals, NameOrder>& frameTotals = totals[frame % frameLatency];
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        for(int i = 0; i < (int)threads.size(); i++)
+        {
+            ThreadEvents* t = threads[i];
+            unsigned int head = t->head.load(std::memory_order_relaxed), tail = t->tail.load(std::memory_order_acquire);
+            for(; head != tail; head++)
+            {
+                Event& event = t->events[head % ThreadEvents::capacity];
+                WriteEvent(event.name, t->id, event.start, event.end);
+                Totals& total = frameTotals[event.name];
+                total.calls++;
+                total.cpu += (event.end - event.start) / 1000;
+            }
+            t->head.store(head, std::memory_order_release);
+        }
+    }
+    
+    // reads back the GPU timestamps of the frame issued frameLatency frames ago and writes its summary
+    void CollectGpuFrame(int oldFrame, bool wait)
+    {
+        if(oldFrame < 0) return;
+        int slot = oldFrame % frameLatency;
+        GpuFrame& gpu = gpuFrames[slot];
+        std::map<const char*, Totals, NameOrder>& frameTotals = totals[slot];
+        if(gpu.used > 0)
+        {
+            GLint available = 1;
+            if(!wait) glGetQueryObjectiv(gpu.queries[gpu.used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if(available)
+            {
+                for(int i = 0; i < (int)gpu.scopes.size(); i++)
+                {
+                    GLuint64 start, end;
+                    glGetQueryObjectui64v(gpu.scopes[i].queries[0], GL_QUERY_RESULT, &start);
+                    glGetQueryObjectui64v(gpu.scopes[i].queries[1], GL_QUERY_RESULT, &end);
+                    double startMicroseconds = gpu.cpuStart + (double)((int64_t)start - gpu.gpuStart) / 1000;
+                    WriteEvent(gpu.scopes[i].name, 0, startMicroseconds, startMicroseconds + (double)(end - start) / 1000);
+                    frameTotals[gpu.scopes[i].name].gpu += (double)(end - start) / 1e6;
+                }
+            }
+            else droppedGpuFrames++;
+        }
+        gpu.scopes.clear();
+        gpu.used = 0;
+        
+        for(std::map<const char*, Totals, NameOrder>::iterator it = frameTotals.begin(); it != frameTotals.end(); ++it)
+            fprintf(summary, "%d,%s,%d,%.4f,%.4f\n", oldFrame, it->first, it->second.calls, it->second.cpu, it->second.gpu);
+        frameTotals.clear();
+    }
+    
+public:
+    Profiler() : enabled(false), trace(NULL), summary(NULL), frame(0), droppedEvents(0), droppedGpuFrames(0) {}
+    
+    // a profile that onExit never finished still gets its last frames and closing bracket, without the
+    // GPU times still in flight, since the context may be gone by now
+    ~Profiler()
+    {
+        if(enabled) Finish(false);
+        for(int i = 0; i < (int)threads.size(); i++) delete threads[i];
+    }
+    
+    // writes path.json and path.csv; called on the GL thread, which becomes the "render" thread
+    bool Start(const std::string& path)
+    {
+        trace = fopen((path + ".json").c_str(), "w");
+        summary = fopen((path + ".csv").c_str(), "w");
+        if(!trace || !summary) return false;
+        fprintf(trace, "[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"GPU\"}},\n");
+        fprintf(summary, "frame,scope,calls,cpu_ms,gpu_ms\n");
+        epoch = std::chrono::steady_clock::now();
+        enabled = true;
+        NameThread("render");
+        return true;
+    }
+    
+    bool IsEnabled() { return enabled.load(std::memory_order_relaxed); }
+    
+    double Now() { return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count(); }
+    
+    void NameThread(const char* name)
+    {
+        if(!enabled) return;
+        ThreadEvents* t = GetThreadEvents();
+        t->name = name;
+        std::lock_guard<std::mutex> lock(threadsMutex);
+        fprintf(trace, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}},\n", t->id, name, t->id);
+    }
+    
+    void AddCpuEvent(const char* name, double start, double end)
+    {
+        ThreadEvents* t = GetThreadEvents();
+        unsigned int tail = t->tail.load(std::memory_order_relaxed);
+        if(tail - t->head.load(std::memory_order_acquire) == ThreadEvents::capacity)
+        {
+            droppedEvents++;
+            return;
+        }
+        Event& event = t->events[tail % ThreadEvents::capacity];
+        event.name = name;
+        event.start = start;
+        event.end = end;
+        t->tail.store(tail + 1, std::memory_order_release);
+    }
+    
+    // GL thread only; scopes nest, each gets a timestamp where it begins and one where it ends
+    void BeginGpuScope(const char* name)
+    {
+        GpuFrame& gpu = gpuFrames[frame % frameLatency];
+        if(gpu.used + 2 > (int)gpu.queries.size())
+        {
+            size_t n = gpu.queries.size();
+            gpu.queries.resize(std::max((size_t)64, n * 2));
+            glGenQueries((GLsizei)(gpu.queries.size() - n), &gpu.queries[n]);
+        }
+        if(gpu.used == 0)
+        {
+            glGetInteger64v(GL_TIMESTAMP, &gpu.gpuStart);
+            gpu.cpuStart = Now();
+        }
+        GpuScope scope;
+        scope.name = name;
+        scope.queries[0] = gpu.queries[gpu.used++];
+        scope.queries[1] = gpu.queries[gpu.used++];
+        glQueryCounter(scope.queries[0], GL_TIMESTAMP);
+        openGpuScopes.push_back((int)gpu.scopes.size());
+        gpu.scopes.push_back(scope);
+    }
+    
+    void EndGpuScope()
+    {
+        GpuFrame& gpu = gpuFrames[frame % frameLatency];
+        glQueryCounter(gpu.scopes[openGpuScopes.back()].queries[1], GL_TIMESTAMP);
+        openGpuScopes.pop_back();
+    }
+    
+    // called on the GL thread once a frame is presented
+    void EndFrame()
+    {
+        if(!enabled) return;
+        CollectCpuEvents();
+        frame++;
+        CollectGpuFrame(frame - frameLatency, false);
+    }
+    
+    // writes out what is still in flight and closes the files
+    void Finish(bool collectGpu = true)
+    {
+        if(!enabled) return;
+        CollectCpuEvents();
+        frame++;
+        if(!collectGpu)
+            for(int i = 0; i < frameLatency; i++)
+                if(gpuFrames[i].used > 0) { gpuFrames[i].used = 0; droppedGpuFrames++; }
+        for(int i = frameLatency - 1; i >= 0; i--) CollectGpuFrame(frame - 1 - i, true);
+        enabled = false;
+        fprintf(trace, "{\"name\":\"frames\",\"ph\":\"i\",\"s\":\"g\",\"pid\":1,\"tid\":0,\"ts\":%.3f}\n]\n", Now());
+        fclose(trace);
+        fclose(summary);
+        printf("Profiled %d frames, %d events and %d frames of GPU timestamps dropped\n", frame - 1, (int)droppedEvents, droppedGpuFrames);
+    }
+};
+
+thread_local Profiler::ThreadEvents* Profiler::local = NULL;
+
+Profiler profiler;
+
+// times the enclosing block on the CPU, and on the GPU too if asked to; only the GL thread may ask
+class ProfileScope
+{
+    const char* name;
+    double start;
+    bool gpu;
+    
+public:
+    ProfileScope(const char* scopeName, bool onGpu = false) : name(NULL), gpu(false)
+    {
+        if(!profiler.IsEnabled()) return;
+        name = scopeName;
+        gpu = onGpu;
+        if(gpu) profiler.BeginGpuScope(name);
+        start = profiler.Now();
+    }
+    
+    ~ProfileScope()
+    {
+        if(!name) return;
+        profiler.AddCpuEvent(name, start, profiler.Now());
+        if(gpu) profiler.EndGpuScope();
+    }
+};
+
+// shadow of the GL state the drawing path touches, so binding what is already bound costs nothing;
+// code that changes this state behind its back (uploads, setup) is covered by the Reset at the start of every frame
+class GLStateCache
+{
+    enum { maxTextureUnits = 8 };
+    enum : unsigned int { unknown = 0xFFFFFFFF };
+    
+    unsigned int program;
+    unsigned int vertexArray;
+    unsigned int activeUnit;
+    unsigned int textures2D[maxTextureUnits];
+    unsigned int texturesCube[maxTextureUnits];
+    int depthTest, blend;
+    GLenum blendSource, blendDestination;
+    
+    void SetCapability(GLenum capability, int& current, bool enabled)
+    {
+        if(current == (int)enabled) { frameStats.skippedStateChanges++; return; }
+        if(enabled) GL_COUNT(glEnable(capability));
+        else GL_COUNT(glDisable(capability));
+        current = enabled;
+        frameStats.capabilityChanges++;
+    }
+    
+public:
+    GLStateCache() { Reset(); }
+    
+    void Reset()
+    {
+        program = vertexArray = activeUnit = unknown;
+        for(int i = 0; i < maxTextureUnits; i++) textures2D[i] = texturesCube[i] = unknown;
+        depthTest = blend = -1;
+        blendSource = blendDestination = GL_NONE;
+    }
+    
+    void UseProgram(unsigned int id)
+    {
+        if(id == program) { frameStats.skippedStateChanges++; return; }
+        GL_COUNT(glUseProgram(id));
+        program = id;
+        frameStats.programChanges++;
+    }
+    
+    void ActiveTexture(unsigned int unit)
+    {
+        if(unit == activeUnit) { frameStats.skippedStateChanges++; return; }
+        GL_COUNT(glActiveTexture(GL_TEXTURE0 + unit));
+        activeUnit = unit;
+    }
+    
+    // binds to the active unit, like glBindTexture
+    void BindTexture(GLenum target, unsigned int id)
+    {
+        unsigned int* bound = NULL;
+        if(activeUnit < maxTextureUnits)
+        {
+            if(target == GL_TEXTURE_2D) bound = &textures2D[activeUnit];
+            if(target == GL_TEXTURE_CUBE_MAP) bound = &texturesCube[activeUnit];
+        }
+        if(bound && *bound == id) { frameStats.skippedStateChanges++; return; }
+        GL_COUNT(glBindTexture(target, id));
+        if(bound) *bound = id;
+        frameStats.textureBinds++;
+    }
+    
+    void BindVertexArray(unsigned int id)
+    {
+        if(id == vertexArray) { frameStats.skippedStateChanges++; return; }
+        GL_COUNT(glBindVertexArray(id));
+        vertexArray = id;
+        frameStats.vertexArrayBinds++;
+    }
+    
+    void SetDepthTest(bool enabled) { SetCapability(GL_DEPTH_TEST, depthTest, enabled); }
+    void SetBlend(bool enabled) { SetCapability(GL_BLEND, blend, enabled); }
+    
+    void BlendFunc(GLenum source, GLenum destination)
+    {
+        if(source == blendSource && destination == blendDestination) { frameStats.skippedStateChanges++; return; }
+        GL_COUNT(glBlendFunc(source, destination));
+        blendSource = source; blendDestination = destination;
+    }
+};
+
+GLStateCache glState;
+
 void getErrorInfo(unsigned int handle)
 {
     int logLen;
@@ -69,8 +670,8 @@ void checkLinking(unsigned int program)
     }
 }
 
-// row-major matrix 4x4
-struct mat4
+// row-major matrix 4x4, rows are 16-byte aligned so they load straight into SIMD registers
+struct alignas(16) mat4
 {
     float m[4][4];
 public:
@@ -91,9 +692,33 @@ public:
         m[3][0] = m30; m[3][1] = m31; m[3][2] = m32; m[3][3] = m33;
     }
     
-    mat4 operator*(const mat4& right)
+    // each result row is a linear combination of the rows of right, summed in the same order as the scalar loop
+    mat4 operator*(const mat4& right) const
     {
         mat4 result;
+#if defined(MATH_SSE)
+        __m128 r0 = _mm_load_ps(right.m[0]), r1 = _mm_load_ps(right.m[1]);
+        __m128 r2 = _mm_load_ps(right.m[2]), r3 = _mm_load_ps(right.m[3]);
+        for (int i = 0; i < 4; i++)
+        {
+            __m128 row = _mm_mul_ps(_mm_set1_ps(m[i][0]), r0);
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(m[i][1]), r1));
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(m[i][2]), r2));
+            row = _mm_add_ps(row, _mm_mul_ps(_mm_set1_ps(m[i][3]), r3));
+            _mm_store_ps(result.m[i], row);
+        }
+#elif defined(MATH_NEON)
+        float32x4_t r0 = vld1q_f32(right.m[0]), r1 = vld1q_f32(right.m[1]);
+        float32x4_t r2 = vld1q_f32(right.m[2]), r3 = vld1q_f32(right.m[3]);
+        for (int i = 0; i < 4; i++)
+        {
+            float32x4_t row = vmulq_n_f32(r0, m[i][0]);
+            row = vaddq_f32(row, vmulq_n_f32(r1, m[i][1]));
+            row = vaddq_f32(row, vmulq_n_f32(r2, m[i][2]));
+            row = vaddq_f32(row, vmulq_n_f32(r3, m[i][3]));
+            vst1q_f32(result.m[i], row);
+        }
+#else
         for (int i = 0; i < 4; i++)
         {
             for (int j = 0; j < 4; j++)
@@ -102,15 +727,56 @@ public:
                 for (int k = 0; k < 4; k++) result.m[i][j] += m[i][k] * right.m[k][j];
             }
         }
+#endif
         return result;
     }
     
     operator float*() { return &m[0][0]; }
 };
 
+// inverse of a matrix whose last column is (0, 0, 0, 1): the upper 3x3 is inverted by cofactors
+// and the translation row becomes -t * inverse(L)
+mat4 AffineInverse(const mat4& a)
+{
+    float c00 = a.m[1][1] * a.m[2][2] - a.m[1][2] * a.m[2][1];
+    float c01 = a.m[1][2] * a.m[2][0] - a.m[1][0] * a.m[2][2];
+    float c02 = a.m[1][0] * a.m[2][1] - a.m[1][1] * a.m[2][0];
+    float det = a.m[0][0] * c00 + a.m[0][1] * c01 + a.m[0][2] * c02;
+    float s = det != 0 ? 1.0f / det : 0.0f;
+    
+    mat4 inv;
+    inv.m[0][0] = c00 * s;
+    inv.m[0][1] = (a.m[0][2] * a.m[2][1] - a.m[0][1] * a.m[2][2]) * s;
+    inv.m[0][2] = (a.m[0][1] * a.m[1][2] - a.m[0][2] * a.m[1][1]) * s;
+    inv.m[1][0] = c01 * s;
+    inv.m[1][1] = (a.m[0][0] * a.m[2][2] - a.m[0][2] * a.m[2][0]) * s;
+    inv.m[1][2] = (a.m[0][2] * a.m[1][0] - a.m[0][0] * a.m[1][2]) * s;
+    inv.m[2][0] = c02 * s;
+    inv.m[2][1] = (a.m[0][1] * a.m[2][0] - a.m[0][0] * a.m[2][1]) * s;
+    inv.m[2][2] = (a.m[0][0] * a.m[1][1] - a.m[0][1] * a.m[1][0]) * s;
+    
+    for (int j = 0; j < 3; j++)
+        inv.m[3][j] = -(a.m[3][0] * inv.m[0][j] + a.m[3][1] * inv.m[1][j] + a.m[3][2] * inv.m[2][j]);
+    inv.m[3][3] = 1;
+    return inv;
+}
+
+// inverse of a rotation followed by a translation: the rotation is transposed and the translation
+// row becomes -t * transpose(R)
+mat4 RigidInverse(const mat4& a)
+{
+    mat4 inv;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++) inv.m[i][j] = a.m[j][i];
+    for (int j = 0; j < 3; j++)
+        inv.m[3][j] = -(a.m[3][0] * inv.m[0][j] + a.m[3][1] * inv.m[1][j] + a.m[3][2] * inv.m[2][j]);
+    inv.m[3][3] = 1;
+    return inv;
+}
+
 
 // 3D point in homogeneous coordinates
-struct vec4
+struct alignas(16) vec4
 {
     float v[4];
     
@@ -119,14 +785,28 @@ struct vec4
         v[0] = x; v[1] = y; v[2] = z; v[3] = w;
     }
     
-    vec4 operator*(const mat4& mat)
+    vec4 operator*(const mat4& mat) const
     {
         vec4 result;
+#if defined(MATH_SSE)
+        __m128 r = _mm_mul_ps(_mm_set1_ps(v[0]), _mm_load_ps(mat.m[0]));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v[1]), _mm_load_ps(mat.m[1])));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v[2]), _mm_load_ps(mat.m[2])));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(v[3]), _mm_load_ps(mat.m[3])));
+        _mm_store_ps(result.v, r);
+#elif defined(MATH_NEON)
+        float32x4_t r = vmulq_n_f32(vld1q_f32(mat.m[0]), v[0]);
+        r = vaddq_f32(r, vmulq_n_f32(vld1q_f32(mat.m[1]), v[1]));
+        r = vaddq_f32(r, vmulq_n_f32(vld1q_f32(mat.m[2]), v[2]));
+        r = vaddq_f32(r, vmulq_n_f32(vld1q_f32(mat.m[3]), v[3]));
+        vst1q_f32(result.v, r);
+#else
         for (int j = 0; j < 4; j++)
         {
             result.v[j] = 0;
             for (int i = 0; i < 4; i++) result.v[j] += v[i] * mat.m[i][j];
         }
+#endif
         return result;
     }
     
@@ -137,6 +817,109 @@ struct vec4
     }
 };
 
+// out[i] = in[i] * mat for a whole array, with the matrix rows kept in registers
+void TransformPoints(const vec4* in, vec4* out, int count, const mat4& mat)
+{
+#if defined(MATH_SSE)
+    __m128 r0 = _mm_load_ps(mat.m[0]), r1 = _mm_load_ps(mat.m[1]);
+    __m128 r2 = _mm_load_ps(mat.m[2]), r3 = _mm_load_ps(mat.m[3]);
+    for (int i = 0; i < count; i++)
+    {
+        __m128 p = _mm_load_ps(in[i].v);
+        __m128 r = _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0)), r0);
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1)), r1));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2)), r2));
+        r = _mm_add_ps(r, _mm_mul_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(3, 3, 3, 3)), r3));
+        _mm_store_ps(out[i].v, r);
+    }
+#elif defined(MATH_NEON)
+    float32x4_t r0 = vld1q_f32(mat.m[0]), r1 = vld1q_f32(mat.m[1]);
+    float32x4_t r2 = vld1q_f32(mat.m[2]), r3 = vld1q_f32(mat.m[3]);
+    for (int i = 0; i < count; i++)
+    {
+        float32x4_t p = vld1q_f32(in[i].v);
+        float32x4_t r = vmulq_n_f32(r0, vgetq_lane_f32(p, 0));
+        r = vaddq_f32(r, vmulq_n_f32(r1, vgetq_lane_f32(p, 1)));
+        r = vaddq_f32(r, vmulq_n_f32(r2, vgetq_lane_f32(p, 2)));
+        r = vaddq_f32(r, vmulq_n_f32(r3, vgetq_lane_f32(p, 3)));
+        vst1q_f32(out[i].v, r);
+    }
+#else
+    for (int i = 0; i < count; i++) out[i] = in[i] * mat;
+#endif
+}
+
+// out[i] = in[i] * mat, e.g. a batch of model matrices times the view-projection
+void MultiplyMatrices(const mat4* in, mat4* out, int count, const mat4& mat)
+{
+    for (int i = 0; i < count; i++) out[i] = in[i] * mat;
+}
+
+// the six clip planes of a view-projection matrix, stored as one array per plane coefficient so a
+// bounding sphere is tested against four planes per instruction; the two padding planes always pass
+class Frustum
+{
+    alignas(16) float a[8];
+    alignas(16) float b[8];
+    alignas(16) float c[8];
+    alignas(16) float d[8];
+    
+public:
+    Frustum()
+    {
+        for (int i = 0; i < 8; i++) { a[i] = b[i] = c[i] = 0; d[i] = 1; }
+    }
+    
+    // clip = p * VP, so each plane is the w column plus or minus the x, y or z column
+    void Set(const mat4& VP)
+    {
+        for (int i = 0; i < 6; i++)
+        {
+            int axis = i / 2;
+            float sign = i % 2 ? -1.0f : 1.0f;
+            float pa = VP.m[0][3] + sign * VP.m[0][axis];
+            float pb = VP.m[1][3] + sign * VP.m[1][axis];
+            float pc = VP.m[2][3] + sign * VP.m[2][axis];
+            float pd = VP.m[3][3] + sign * VP.m[3][axis];
+            float length = sqrtf(pa * pa + pb * pb + pc * pc);
+            a[i] = pa / length; b[i] = pb / length; c[i] = pc / length; d[i] = pd / length;
+        }
+    }
+    
+    // sphere holds the center in xyz and the radius in w
+    bool IsVisible(const vec4& sphere) const
+    {
+#if defined(MATH_SSE)
+        __m128 x = _mm_set1_ps(sphere.v[0]), y = _mm_set1_ps(sphere.v[1]), z = _mm_set1_ps(sphere.v[2]);
+        __m128 r = _mm_set1_ps(-sphere.v[3]);
+        for (int i = 0; i < 8; i += 4)
+        {
+            __m128 dist = _mm_add_ps(_mm_mul_ps(_mm_load_ps(a + i), x), _mm_mul_ps(_mm_load_ps(b + i), y));
+            dist = _mm_add_ps(dist, _mm_add_ps(_mm_mul_ps(_mm_load_ps(c + i), z), _mm_load_ps(d + i)));
+            if (_mm_movemask_ps(_mm_cmplt_ps(dist, r))) return false;
+        }
+        return true;
+#elif defined(MATH_NEON)
+        float32x4_t r = vdupq_n_f32(-sphere.v[3]);
+        for (int i = 0; i < 8; i += 4)
+        {
+            float32x4_t dist = vmulq_n_f32(vld1q_f32(a + i), sphere.v[0]);
+            dist = vaddq_f32(dist, vmulq_n_f32(vld1q_f32(b + i), sphere.v[1]));
+            dist = vaddq_f32(dist, vmulq_n_f32(vld1q_f32(c + i), sphere.v[2]));
+            dist = vaddq_f32(dist, vld1q_f32(d + i));
+            uint32x4_t outside = vcltq_f32(dist, r);
+            uint32x2_t any = vorr_u32(vget_low_u32(outside), vget_high_u32(outside));
+            if (vget_lane_u32(vpmax_u32(any, any), 0)) return false;
+        }
+        return true;
+#else
+        for (int i = 0; i < 6; i++)
+            if (a[i] * sphere.v[0] + b[i] * sphere.v[1] + c[i] * sphere.v[2] + d[i] < -sphere.v[3]) return false;
+        return true;
+#endif
+    }
+};
+
 // 2D point in Cartesian coordinates
 struct vec2
 {
@@ -187,6 +970,12 @@ vec3 cross(const vec3& a, const vec3& b)
     return vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x );
 }
 
+float dot(const vec3& a, const vec3& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+// general 4x4 inverse in double precision; objects use AffineInverse now, --bench-math keeps this as its baseline
 bool gluInvertMatrix(const double m[16], double invOut[16])
 {
     double inv[16], det;
@@ -317,10 +1106,238 @@ bool gluInvertMatrix(const double m[16], double invOut[16])
     return true;
 }
 
-class Geometry
+// fixed set of worker threads with a task deque each; a worker takes from the back of its own
+// deque and, when that is empty, steals from the front of the others'
+class ThreadPool
 {
-protected:
-    unsigned int vao;
+    struct Worker
+    {
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+    };
+    
+    std::vector<Worker*> workers;
+    std::vector<std::thread> threads;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    int queued;
+    bool stopping;
+    std::atomic<unsigned int> nextWorker;
+    
+    bool TryTake(int index, std::function<void()>& task);
+    void Run(int index);
+    
+public:
+    ThreadPool(int nThreads);
+    ~ThreadPool();
+    
+    int GetThreadCount() { return (int)threads.size(); }
+    
+    void Submit(const std::function<void()>& task);
+};
+
+ThreadPool::ThreadPool(int nThreads) : queued(0), stopping(false), nextWorker(0)
+{
+    for(int i = 0; i < nThreads; i++) workers.push_back(new Worker());
+    for(int i = 0; i < nThreads; i++) threads.push_back(std::thread(&ThreadPool::Run, this, i));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for(size_t i = 0; i < threads.size(); i++) threads[i].join();
+    for(size_t i = 0; i < workers.size(); i++) delete workers[i];
+}
+
+void ThreadPool::Submit(const std::function<void()>& task)
+{
+    Worker* worker = workers[nextWorker++ % workers.size()];
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->tasks.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+bool ThreadPool::TryTake(int index, std::function<void()>& task)
+{
+    for(size_t i = 0; i < workers.size(); i++)
+    {
+        Worker* worker = workers[(index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        if(worker->tasks.empty()) continue;
+        if(i == 0) { task = worker->tasks.back(); worker->tasks.pop_back(); }
+        else { task = worker->tasks.front(); worker->tasks.pop_front(); }
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::Run(int index)
+{
+    profiler.NameThread("loader");
+    for(;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            wake.wait(lock, [this] { return queued > 0 || stopping; });
+            if(queued == 0) return;
+            queued--;
+        }
+        
+        // a queued count was claimed above, so some deque holds a task for this worker
+        std::function<void()> task;
+        while(!TryTake(index, task)) std::this_thread::yield();
+        task();
+    }
+}
+
+// GL work handed back from the workers, run in batches on the thread that owns the context
+class UploadQueue
+{
+    std::mutex mutex;
+    std::deque<std::function<void()>> uploads;
+    
+public:
+    void Push(const std::function<void()>& upload)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        uploads.push_back(upload);
+    }
+    
+    // runs queued uploads until the budget is spent, but always at least one; returns how many ran
+    int Run(double budgetMilliseconds)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int count = 0;
+        for(;;)
+        {
+            std::function<void()> upload;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(uploads.empty()) break;
+                upload = uploads.front();
+                uploads.pop_front();
+            }
+            upload();
+            count++;
+            if(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() >= budgetMilliseconds) break;
+        }
+        return count;
+    }
+};
+
+// splits asset loads into a CPU half run on the pool and a GL half queued back to the context thread;
+// with no workers both halves run immediately on the caller, as loading used to
+class AssetLoader
+{
+    // one ParallelFor call: indices are claimed from next until count, done counts the finished ones
+    struct ParallelBatch
+    {
+        std::function<void(int)> work;
+        int count;
+        std::atomic<int> next, done;
+        std::mutex mutex;
+        std::condition_variable finished;
+        
+        void Run()
+        {
+            for(int i = next++; i < count; i = next++)
+            {
+                work(i);
+                if(++done == count)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    finished.notify_all();
+                }
+            }
+        }
+    };
+    
+    ThreadPool* pool;
+    UploadQueue uploads;
+    std::atomic<int> inFlight;
+    
+public:
+    AssetLoader() : pool(NULL), inFlight(0) {}
+    ~AssetLoader() { delete pool; }
+    
+    void SetWorkerCount(int nWorkers)
+    {
+        Finish();
+        delete pool;
+        pool = nWorkers > 0 ? new ThreadPool(nWorkers) : NULL;
+    }
+    
+    int GetWorkerCount() { return pool ? pool->GetThreadCount() : 0; }
+    
+    void Load(const std::function<void()>& read, const std::function<void()>& upload)
+    {
+        if(!pool)
+        {
+            read();
+            upload();
+            return;
+        }
+        inFlight++;
+        pool->Submit([this, read, upload] {
+            {
+                ProfileScope scope("load");
+                read();
+            }
+            uploads.Push([this, upload] { upload(); inFlight--; });
+        });
+    }
+    
+    // runs work(0) to work(count - 1) and returns when all are done, sharing them with whichever workers
+    // are free; the caller runs them too, so a load may split its own work this way without waiting
+    // on a pool that is busy with other loads
+    void ParallelFor(int count, const std::function<void(int)>& work)
+    {
+        std::shared_ptr<ParallelBatch> batch = std::make_shared<ParallelBatch>();
+        batch->work = work;
+        batch->count = count;
+        batch->next = 0;
+        batch->done = 0;
+        
+        // helpers that start after every index is claimed find nothing to do
+        int nHelpers = pool ? std::min(count, pool->GetThreadCount() + 1) - 1 : 0;
+        for(int i = 0; i < nHelpers; i++) pool->Submit([batch] { batch->Run(); });
+        batch->Run();
+        
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->finished.wait(lock, [&batch] { return batch->done == batch->count; });
+    }
+    
+    // called once per frame on the GL thread
+    int ProcessUploads(double budgetMilliseconds) { return uploads.Run(budgetMilliseconds); }
+    
+    bool IsIdle() { return inFlight == 0; }
+    
+    // blocks until every load is resident; GL thread only
+    void Finish()
+    {
+        while(!IsIdle())
+        {
+            if(uploads.Run(1e30) == 0) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+};
+
+AssetLoader loader;
+
+class Geometry
+{
+protected:
+    unsigned int vao;
     
 public:
     Geometry()
@@ -328,7 +1345,20 @@ public:
         glGenVertexArrays(1, &vao);
     }
     
+    virtual ~Geometry()
+    {
+        glDeleteVertexArrays(1, &vao);
+    }
+    
     virtual void Draw() = 0;
+    
+    // instancing draws through a vertex array of its own that reuses this geometry's buffers;
+    // AttachBuffers sets them up in the bound vertex array and fails while the data is not resident
+    virtual bool AttachBuffers() { return false; }
+    virtual void DrawInstanced(int) { }
+    
+    // model-space bounding sphere; geometry without bounds (still loading, or infinite) is never culled
+    virtual bool GetBoundingSphere(vec3&, float&) { return false; }
 };
 
 class TexturedQuad : public Geometry
@@ -360,15 +1390,18 @@ public:
         glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, NULL);
     }
     
+    ~TexturedQuad()
+    {
+        glDeleteBuffers(3, vbo);
+    }
+    
     void Draw()
     {
-        glEnable(GL_DEPTH_TEST);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        glDisable(GL_BLEND);
-        glDisable(GL_DEPTH_TEST);
+        glState.SetDepthTest(true);
+        glState.SetBlend(true);
+        glState.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glState.BindVertexArray(vao);
+        GL_DRAW(glDrawArrays(GL_TRIANGLE_STRIP, 0, 4));
     }
 };
 
@@ -401,318 +1434,891 @@ public:
         glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, NULL);
     }
     
+    ~InfiniteTexturedQuad()
+    {
+        glDeleteBuffers(3, vbo);
+    }
+    
     void Draw()
     {
-        glEnable(GL_DEPTH_TEST);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 6);
-        glDisable(GL_BLEND);
-        glDisable(GL_DEPTH_TEST);
+        glState.SetDepthTest(true);
+        glState.SetBlend(true);
+        glState.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glState.BindVertexArray(vao);
+        GL_DRAW(glDrawArrays(GL_TRIANGLE_FAN, 0, 6));
     }
 };
 
-class   PolygonalMesh : public Geometry
+// read-only view of a whole file, memory-mapped so the parser can tokenize it in place
+class MappedFile
+{
+    const char* data;
+    size_t size;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+    
+public:
+    MappedFile(const char* filename);
+    ~MappedFile();
+    
+    bool IsOpen() { return data != NULL; }
+    const char* Begin() { return data; }
+    const char* End() { return data + size; }
+    size_t Size() { return size; }
+};
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+MappedFile::MappedFile(const char* filename) : data(NULL), size(0), file(INVALID_HANDLE_VALUE), mapping(NULL)
+{
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) return;
+    LARGE_INTEGER fileSize;
+    if(!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return;
+    mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if(!mapping) return;
+    data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if(data) size = (size_t)fileSize.QuadPart;
+}
+
+MappedFile::~MappedFile()
+{
+    if(data) UnmapViewOfFile(data);
+    if(mapping) CloseHandle(mapping);
+    if(file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+#else
+MappedFile::MappedFile(const char* filename) : data(NULL), size(0)
+{
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return;
+    struct stat info;
+    if(fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        void* view = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(view != MAP_FAILED)
+        {
+            madvise(view, info.st_size, MADV_SEQUENTIAL);
+            data = (const char*)view;
+            size = info.st_size;
+        }
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if(data) munmap((void*)data, size);
+}
+#endif
+
+// hand-written scanners for the OBJ tokenizer; each returns the position after the token,
+// or p itself if there was nothing to read
+inline const char* SkipBlanks(const char* p, const char* end)
+{
+    while(p < end && (*p == ' ' || *p == '\t')) p++;
+    return p;
+}
+
+const char* ScanFloat(const char* p, const char* end, float& out)
+{
+    static const double powersOf10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    
+    const char* start = p;
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+    
+    unsigned long long mantissa = 0;
+    int significantDigits = 0;
+    int exponent = 0;
+    bool anyDigits = false;
+    
+    for(; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        anyDigits = true;
+        if(significantDigits < 19) { mantissa = mantissa * 10 + (*p - '0'); if(mantissa) significantDigits++; }
+        else exponent++;
+    }
+    if(p < end && *p == '.')
+    {
+        for(p++; p < end && *p >= '0' && *p <= '9'; p++)
+        {
+            anyDigits = true;
+            if(significantDigits < 19) { mantissa = mantissa * 10 + (*p - '0'); if(mantissa) significantDigits++; exponent--; }
+        }
+    }
+    if(!anyDigits) return start;
+    
+    if(p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char* q = p + 1;
+        bool negativeExponent = false;
+        if(q < end && (*q == '-' || *q == '+')) negativeExponent = (*q++ == '-');
+        if(q < end && *q >= '0' && *q <= '9')
+        {
+            int e = 0;
+            for(; q < end && *q >= '0' && *q <= '9'; q++) if(e < 10000) e = e * 10 + (*q - '0');
+            exponent += negativeExponent ? -e : e;
+            p = q;
+        }
+    }
+    
+    double value = (double)mantissa;
+    if(exponent < 0) value = exponent >= -22 ? value / powersOf10[-exponent] : value * pow(10.0, exponent);
+    else if(exponent > 0) value = exponent <= 22 ? value * powersOf10[exponent] : value * pow(10.0, exponent);
+    out = (float)(negative ? -value : value);
+    return p;
+}
+
+const char* ScanInt(const char* p, const char* end, int& out)
+{
+    const char* start = p;
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+    if(p == end || *p < '0' || *p > '9') return start;
+    int value = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; p++) value = value * 10 + (*p - '0');
+    out = negative ? -value : value;
+    return p;
+}
+
+// contents of an OBJ file in contiguous arrays, filled in a single pass over the mapped file
+class ObjFile
 {
+public:
     struct  Face
     {
+        // zero-based, -1 where the face leaves the attribute out
         int       positionIndices[4];
         int       normalIndices[4];
         int       texcoordIndices[4];
         bool      isQuad;
     };
     
-    std::vector<std::string*> rows;
-    std::vector<vec3*> positions;
-    std::vector<std::vector<Face*>> submeshFaces;
-    std::vector<vec3*> normals;
-    std::vector<vec2*> texcoords;
+    std::vector<vec3> positions;
+    std::vector<vec3> normals;
+    std::vector<vec2> texcoords;
+    std::vector<Face> faces;
+    std::vector<int> submeshStarts; // index of the first face of every 'g' group
     
-    int nTriangles;
+    bool Load(const char* filename);
+    void Parse(const char* p, const char* end);
     
-public:
-    PolygonalMesh(const char *filename);
-    ~PolygonalMesh();
+    int GetTriangleCount();
     
-    void Draw();
+private:
+    const char* ScanVertexReference(const char* p, const char* end, Face& f, int corner);
 };
 
+bool ObjFile::Load(const char* filename)
+{
+    MappedFile file(filename);
+    if(!file.IsOpen()) return false;
+    Parse(file.Begin(), file.End());
+    return true;
+}
 
+// OBJ indices are one-based, or relative to the end of the list when negative
+static int ResolveObjIndex(int index, size_t count)
+{
+    if(index > 0) return index - 1;
+    if(index < 0) return (int)count + index;
+    return -1;
+}
 
-PolygonalMesh::PolygonalMesh(const char *filename)
+const char* ObjFile::ScanVertexReference(const char* p, const char* end, Face& f, int corner)
 {
-    std::fstream file(filename);
-    if(!file.is_open())
-    {
-        return;
-    }
-    
-    char buffer[256];
-    while(!file.eof())
+    int index = 0;
+    const char* q = ScanInt(p, end, index);
+    if(q == p) return p;
+    f.positionIndices[corner] = ResolveObjIndex(index, positions.size());
+    f.texcoordIndices[corner] = -1;
+    f.normalIndices[corner] = -1;
+    
+    if(q < end && *q == '/')
     {
-        file.getline(buffer,256);
-        rows.push_back(new std::string(buffer));
+        q++;
+        index = 0;
+        q = ScanInt(q, end, index);
+        f.texcoordIndices[corner] = ResolveObjIndex(index, texcoords.size());
+        if(q < end && *q == '/')
+        {
+            q++;
+            index = 0;
+            q = ScanInt(q, end, index);
+            f.normalIndices[corner] = ResolveObjIndex(index, normals.size());
+        }
     }
-    
-    submeshFaces.push_back(std::vector<Face*>());
-    std::vector<Face*>* faces = &submeshFaces.at(submeshFaces.size()-1);
-    
-    for(int i = 0; i < rows.size(); i++)
+    return q;
+}
+
+void ObjFile::Parse(const char* p, const char* end)
+{
+    // a rough guess from the file size saves most of the regrowth on large meshes
+    size_t estimatedRows = (end - p) / 32;
+    positions.reserve(estimatedRows / 4);
+    normals.reserve(estimatedRows / 4);
+    texcoords.reserve(estimatedRows / 4);
+    faces.reserve(estimatedRows / 2);
+    submeshStarts.push_back(0);
+    
+    while(p < end)
     {
-        if(rows[i]->empty() || (*rows[i])[0] == '#')
-        continue;
-        else if((*rows[i])[0] == 'v' && (*rows[i])[1] == ' ')
+        p = SkipBlanks(p, end);
+        if(p + 1 < end && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
         {
-            float tmpx,tmpy,tmpz;
-            sscanf(rows[i]->c_str(), "v %f %f %f" ,&tmpx,&tmpy,&tmpz);
-            positions.push_back(new vec3(tmpx,tmpy,tmpz));
+            vec3 v;
+            p = SkipBlanks(p + 2, end); p = ScanFloat(p, end, v.x);
+            p = SkipBlanks(p, end);     p = ScanFloat(p, end, v.y);
+            p = SkipBlanks(p, end);     p = ScanFloat(p, end, v.z);
+            positions.push_back(v);
         }
-        else if((*rows[i])[0] == 'v' && (*rows[i])[1] == 'n')
+        else if(p + 2 < end && p[0] == 'v' && p[1] == 'n')
         {
-            float tmpx,tmpy,tmpz;
-            sscanf(rows[i]->c_str(), "vn %f %f %f" ,&tmpx,&tmpy,&tmpz);
-            normals.push_back(new vec3(tmpx,tmpy,tmpz));
+            vec3 n;
+            p = SkipBlanks(p + 2, end); p = ScanFloat(p, end, n.x);
+            p = SkipBlanks(p, end);     p = ScanFloat(p, end, n.y);
+            p = SkipBlanks(p, end);     p = ScanFloat(p, end, n.z);
+            normals.push_back(n);
         }
-        else if((*rows[i])[0] == 'v' && (*rows[i])[1] == 't')
+        else if(p + 2 < end && p[0] == 'v' && p[1] == 't')
         {
-            float tmpx,tmpy;
-            sscanf(rows[i]->c_str(), "vt %f %f" ,&tmpx,&tmpy);
-            texcoords.push_back(new vec2(tmpx,tmpy));
+            vec2 t;
+            p = SkipBlanks(p + 2, end); p = ScanFloat(p, end, t.x);
+            p = SkipBlanks(p, end);     p = ScanFloat(p, end, t.y);
+            texcoords.push_back(t);
         }
-        else if((*rows[i])[0] == 'f')
+        else if(p + 1 < end && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
         {
-            if(count(rows[i]->begin(),rows[i]->end(), ' ') == 3)
+            Face f;
+            int corners = 0;
+            p = SkipBlanks(p + 1, end);
+            while(corners < 4 && p < end && *p != '\n' && *p != '\r')
             {
-                Face* f = new Face();
-                f->isQuad = false;
-                sscanf(rows[i]->c_str(), "f %d/%d/%d %d/%d/%d %d/%d/%d",
-                       &f->positionIndices[0], &f->texcoordIndices[0], &f->normalIndices[0],
-                       &f->positionIndices[1], &f->texcoordIndices[1], &f->normalIndices[1],
-                       &f->positionIndices[2], &f->texcoordIndices[2], &f->normalIndices[2]);
-                faces->push_back(f);
+                const char* q = ScanVertexReference(p, end, f, corners);
+                if(q == p) break;
+                corners++;
+                p = SkipBlanks(q, end);
             }
-            else
+            if(corners >= 3)
             {
-                Face* f = new Face();
-                f->isQuad = true;
-                sscanf(rows[i]->c_str(), "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d",
-                       &f->positionIndices[0], &f->texcoordIndices[0], &f->normalIndices[0],
-                       &f->positionIndices[1], &f->texcoordIndices[1], &f->normalIndices[1],
-                       &f->positionIndices[2], &f->texcoordIndices[2], &f->normalIndices[2],
-                       &f->positionIndices[3], &f->texcoordIndices[3], &f->normalIndices[3]);
-                faces->push_back(f);
+                f.isQuad = corners == 4;
+                faces.push_back(f);
             }
         }
-        else if((*rows[i])[0] == 'g')
+        else if(p < end && p[0] == 'g' && (p + 1 == end || p[1] == ' ' || p[1] == '\t' || p[1] == '\r' || p[1] == '\n'))
         {
-            if(faces->size() > 0)
-            {
-                submeshFaces.push_back(std::vector<Face*>());
-                faces = &submeshFaces.at(submeshFaces.size()-1);
-            }
+            if(faces.size() > (size_t)submeshStarts.back()) submeshStarts.push_back((int)faces.size());
         }
-    }
-    
-    int numberOfTriangles = 0;
-    for(int iSubmesh=0; iSubmesh<submeshFaces.size(); iSubmesh++)
-    {
-        std::vector<Face*>& faces = submeshFaces.at(iSubmesh);
         
-        for(int i=0;i<faces.size();i++)
-        {
-            if(faces[i]->isQuad) numberOfTriangles += 2;
-            else numberOfTriangles += 1;
-        }
+        // comments, unsupported statements and whatever is left of the current row
+        const char* newline = (const char*)memchr(p, '\n', end - p);
+        p = newline ? newline + 1 : end;
     }
+}
+
+int ObjFile::GetTriangleCount()
+{
+    int numberOfTriangles = 0;
+    for(size_t i = 0; i < faces.size(); i++) numberOfTriangles += faces[i].isQuad ? 2 : 1;
+    return numberOfTriangles;
+}
+
+// first index and index count of one 'g' group in a triangle list
+struct SubmeshRange
+{
+    unsigned int firstIndex;
+    unsigned int indexCount;
+};
+
+// interleaved vertices with every distinct (position, texcoord, normal) corner stored once,
+// and the triangle list indexing them
+struct IndexedMesh
+{
+    static const int vertexStride = 8;      // floats: position, texcoord, normal
+    
+    std::vector<float> vertices;
+    std::vector<unsigned int> indices;      // 3 per triangle
+    std::vector<SubmeshRange> submeshes;
+    vec3 boundsMin, boundsMax;
+    
+    void Build(ObjFile& obj);
+    
+    int GetVertexCount() { return (int)vertices.size() / vertexStride; }
+    int GetIndexCount() { return (int)indices.size(); }
+    bool NeedsLongIndices() { return GetVertexCount() > 65536; }
+    int GetIndexSize() { return NeedsLongIndices() ? sizeof(unsigned int) : sizeof(unsigned short); }
+    
+    // index buffer contents in the width GetIndexSize() reports
+    void GetIndexData(std::vector<unsigned char>& data);
+    
+private:
+    bool SameVertex(unsigned int vertex, const float attributes[vertexStride]);
+};
+
+bool IndexedMesh::SameVertex(unsigned int vertex, const float attributes[vertexStride])
+{
+    return memcmp(&vertices[vertex * vertexStride], attributes, vertexStride * sizeof(float)) == 0;
+}
+
+void IndexedMesh::Build(ObjFile& obj)
+{
+    // corners are deduplicated on their attribute values rather than their OBJ indices, since
+    // exporters often repeat identical texcoords and normals under fresh indices
+    const unsigned int empty = 0xffffffff;
     
-    nTriangles = numberOfTriangles;
+    int nCorners = obj.GetTriangleCount() * 3;
+    unsigned int capacity = 16;
+    while(capacity < (unsigned int)nCorners * 2) capacity *= 2;
+    std::vector<unsigned int> table(capacity, empty);
     
-    float *vertexCoords = new float[numberOfTriangles * 9];
-    float *vertexTexCoords = new float[numberOfTriangles * 6];
-    float *vertexNormalCoords = new float[numberOfTriangles * 9];
+    vertices.reserve(nCorners * vertexStride);
+    indices.reserve(nCorners);
+    boundsMin = vec3(0, 0, 0);
+    boundsMax = vec3(0, 0, 0);
     
+    // quads are split into the (0, 1, 2) and (1, 2, 3) triangles
+    static const int triangleCorners[2][3] = {{0, 1, 2}, {1, 2, 3}};
     
-    int triangleIndex = 0;
-    for(int iSubmesh=0; iSubmesh<submeshFaces.size(); iSubmesh++)
+    size_t nextSubmesh = 0;
+    for(size_t i = 0; i < obj.faces.size(); i++)
     {
-        std::vector<Face*>& faces = submeshFaces.at(iSubmesh);
+        ObjFile::Face& face = obj.faces[i];
         
-        for(int i=0;i<faces.size();i++)
+        if(nextSubmesh < obj.submeshStarts.size() && obj.submeshStarts[nextSubmesh] == (int)i)
         {
-            if(faces[i]->isQuad)
-            {
-                vertexTexCoords[triangleIndex * 6] =     texcoords[faces[i]->texcoordIndices[0]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 1] = 1-texcoords[faces[i]->texcoordIndices[0]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 2] = texcoords[faces[i]->texcoordIndices[1]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 3] = 1-texcoords[faces[i]->texcoordIndices[1]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 4] = texcoords[faces[i]->texcoordIndices[2]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 5] = 1-texcoords[faces[i]->texcoordIndices[2]-1]->y;
-                
-                
-                vertexCoords[triangleIndex * 9] =     positions[faces[i]->positionIndices[0]-1]->x;
-                vertexCoords[triangleIndex * 9 + 1] = positions[faces[i]->positionIndices[0]-1]->y;
-                vertexCoords[triangleIndex * 9 + 2] = positions[faces[i]->positionIndices[0]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 3] = positions[faces[i]->positionIndices[1]-1]->x;
-                vertexCoords[triangleIndex * 9 + 4] = positions[faces[i]->positionIndices[1]-1]->y;
-                vertexCoords[triangleIndex * 9 + 5] = positions[faces[i]->positionIndices[1]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 6] = positions[faces[i]->positionIndices[2]-1]->x;
-                vertexCoords[triangleIndex * 9 + 7] = positions[faces[i]->positionIndices[2]-1]->y;
-                vertexCoords[triangleIndex * 9 + 8] = positions[faces[i]->positionIndices[2]-1]->z;
-                
-                
-                vertexNormalCoords[triangleIndex * 9] =     normals[faces[i]->normalIndices[0]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 1] = normals[faces[i]->normalIndices[0]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 2] = normals[faces[i]->normalIndices[0]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 3] = normals[faces[i]->normalIndices[1]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 4] = normals[faces[i]->normalIndices[1]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 5] = normals[faces[i]->normalIndices[1]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 6] = normals[faces[i]->normalIndices[2]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 7] = normals[faces[i]->normalIndices[2]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 8] = normals[faces[i]->normalIndices[2]-1]->z;
-                
-                triangleIndex++;
-                
-                
-                vertexTexCoords[triangleIndex * 6] =     texcoords[faces[i]->texcoordIndices[1]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 1] = 1-texcoords[faces[i]->texcoordIndices[1]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 2] = texcoords[faces[i]->texcoordIndices[2]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 3] = 1-texcoords[faces[i]->texcoordIndices[2]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 4] = texcoords[faces[i]->texcoordIndices[3]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 5] = 1-texcoords[faces[i]->texcoordIndices[3]-1]->y;
-                
-                
-                vertexCoords[triangleIndex * 9] =     positions[faces[i]->positionIndices[1]-1]->x;
-                vertexCoords[triangleIndex * 9 + 1] = positions[faces[i]->positionIndices[1]-1]->y;
-                vertexCoords[triangleIndex * 9 + 2] = positions[faces[i]->positionIndices[1]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 3] = positions[faces[i]->positionIndices[2]-1]->x;
-                vertexCoords[triangleIndex * 9 + 4] = positions[faces[i]->positionIndices[2]-1]->y;
-                vertexCoords[triangleIndex * 9 + 5] = positions[faces[i]->positionIndices[2]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 6] = positions[faces[i]->positionIndices[3]-1]->x;
-                vertexCoords[triangleIndex * 9 + 7] = positions[faces[i]->positionIndices[3]-1]->y;
-                vertexCoords[triangleIndex * 9 + 8] = positions[faces[i]->positionIndices[3]-1]->z;
-                
-                
-                vertexNormalCoords[triangleIndex * 9] =     normals[faces[i]->normalIndices[1]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 1] = normals[faces[i]->normalIndices[1]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 2] = normals[faces[i]->normalIndices[1]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 3] = normals[faces[i]->normalIndices[2]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 4] = normals[faces[i]->normalIndices[2]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 5] = normals[faces[i]->normalIndices[2]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 6] = normals[faces[i]->normalIndices[3]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 7] = normals[faces[i]->normalIndices[3]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 8] = normals[faces[i]->normalIndices[3]-1]->z;
-                
-                triangleIndex++;
-            }
-            else
+            SubmeshRange range = {(unsigned int)indices.size(), 0};
+            submeshes.push_back(range);
+            nextSubmesh++;
+        }
+        
+        for(int t = 0; t < (face.isQuad ? 2 : 1); t++)
+        {
+            for(int c = 0; c < 3; c++)
             {
-                vertexTexCoords[triangleIndex * 6] =     texcoords[faces[i]->texcoordIndices[0]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 1] = 1-texcoords[faces[i]->texcoordIndices[0]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 2] = texcoords[faces[i]->texcoordIndices[1]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 3] = 1-texcoords[faces[i]->texcoordIndices[1]-1]->y;
-                
-                vertexTexCoords[triangleIndex * 6 + 4] = texcoords[faces[i]->texcoordIndices[2]-1]->x;
-                vertexTexCoords[triangleIndex * 6 + 5] = 1-texcoords[faces[i]->texcoordIndices[2]-1]->y;
-                
-                vertexCoords[triangleIndex * 9] =     positions[faces[i]->positionIndices[0]-1]->x;
-                vertexCoords[triangleIndex * 9 + 1] = positions[faces[i]->positionIndices[0]-1]->y;
-                vertexCoords[triangleIndex * 9 + 2] = positions[faces[i]->positionIndices[0]-1]->z;
-                
-                vertexCoords[triangleIndex * 9 + 3] = positions[faces[i]->positionIndices[1]-1]->x;
-                vertexCoords[triangleIndex * 9 + 4] = positions[faces[i]->positionIndices[1]-1]->y;
-                vertexCoords[triangleIndex * 9 + 5] = positions[faces[i]->positionIndices[1]-1]->z;
+                int corner = triangleCorners[t][c];
+                int pi = face.positionIndices[corner];
+                int ti = face.texcoordIndices[corner];
+                int ni = face.normalIndices[corner];
                 
-                vertexCoords[triangleIndex * 9 + 6] = positions[faces[i]->positionIndices[2]-1]->x;
-                vertexCoords[triangleIndex * 9 + 7] = positions[faces[i]->positionIndices[2]-1]->y;
-                vertexCoords[triangleIndex * 9 + 8] = positions[faces[i]->positionIndices[2]-1]->z;
+                vec3 position = (pi >= 0 && pi < (int)obj.positions.size()) ? obj.positions[pi] : vec3();
+                vec2 texcoord = (ti >= 0 && ti < (int)obj.texcoords.size()) ? obj.texcoords[ti] : vec2();
+                vec3 normal = (ni >= 0 && ni < (int)obj.normals.size()) ? obj.normals[ni] : vec3(0, 1, 0);
                 
+                float attributes[vertexStride] = {position.x, position.y, position.z, texcoord.x, 1-texcoord.y, normal.x, normal.y, normal.z};
                 
-                vertexNormalCoords[triangleIndex * 9] =     normals[faces[i]->normalIndices[0]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 1] = normals[faces[i]->normalIndices[0]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 2] = normals[faces[i]->normalIndices[0]-1]->z;
-                
-                vertexNormalCoords[triangleIndex * 9 + 3] = normals[faces[i]->normalIndices[1]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 4] = normals[faces[i]->normalIndices[1]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 5] = normals[faces[i]->normalIndices[1]-1]->z;
+                unsigned int hash = 2166136261u;
+                for(int k = 0; k < vertexStride; k++)
+                {
+                    unsigned int bits;
+                    memcpy(&bits, &attributes[k], sizeof(bits));
+                    hash = (hash ^ bits) * 16777619u;
+                }
                 
-                vertexNormalCoords[triangleIndex * 9 + 6] = normals[faces[i]->normalIndices[2]-1]->x;
-                vertexNormalCoords[triangleIndex * 9 + 7] = normals[faces[i]->normalIndices[2]-1]->y;
-                vertexNormalCoords[triangleIndex * 9 + 8] = normals[faces[i]->normalIndices[2]-1]->z;
+                unsigned int slot = (hash ^ (hash >> 15)) & (capacity - 1);
+                while(table[slot] != empty && !SameVertex(table[slot], attributes))
+                    slot = (slot + 1) & (capacity - 1);
                 
-                triangleIndex++;
+                if(table[slot] == empty)
+                {
+                    if(vertices.empty()) boundsMin = boundsMax = position;
+                    boundsMin = vec3(std::min(boundsMin.x, position.x), std::min(boundsMin.y, position.y), std::min(boundsMin.z, position.z));
+                    boundsMax = vec3(std::max(boundsMax.x, position.x), std::max(boundsMax.y, position.y), std::max(boundsMax.z, position.z));
+                    
+                    table[slot] = GetVertexCount();
+                    vertices.insert(vertices.end(), attributes, attributes + vertexStride);
+                }
+                indices.push_back(table[slot]);
             }
         }
+        
+        submeshes.back().indexCount = (unsigned int)indices.size() - submeshes.back().firstIndex;
     }
+}
+
+void IndexedMesh::GetIndexData(std::vector<unsigned char>& data)
+{
+    data.resize(indices.size() * GetIndexSize());
+    if(NeedsLongIndices())
+    {
+        if(!indices.empty()) memcpy(&data[0], indices.data(), data.size());
+        return;
+    }
+    unsigned short* shortIndices = (unsigned short*)data.data();
+    for(size_t i = 0; i < indices.size(); i++) shortIndices[i] = (unsigned short)indices[i];
+}
+
+// size, modification time and content hash of a source asset, used to tell whether a cache is stale
+struct SourceFileStamp
+{
+    long long size;
+    long long modified;
+    unsigned long long hash;
     
-    glBindVertexArray(vao);
-    
-    unsigned int vbo[3];
-    glGenBuffers(3, &vbo[0]);
-    
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-    glBufferData(GL_ARRAY_BUFFER, nTriangles * 9 * sizeof(float), vertexCoords, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    bool Read(const char* filename)
+    {
+        struct stat info;
+        if(stat(filename, &info) != 0) return false;
+        size = info.st_size;
+        modified = info.st_mtime;
+        
+        // 64-bit FNV-1a over the whole file
+        hash = 14695981039346656037ull;
+        MappedFile file(filename);
+        for(const char* p = file.Begin(); p && p < file.End(); p++)
+            hash = (hash ^ (unsigned char)*p) * 1099511628211ull;
+        return true;
+    }
     
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-    glBufferData(GL_ARRAY_BUFFER, nTriangles * 6 * sizeof(float), vertexTexCoords, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+    bool operator==(const SourceFileStamp& s) const { return size == s.size && modified == s.modified && hash == s.hash; }
+};
+
+// header of a .meshcache file, followed by interleaved vertices, indices and submesh ranges;
+// every section starts on a 16 byte boundary so it can be handed to glBufferData straight from the mapping
+struct MeshCacheHeader
+{
+    char magic[4];
+    unsigned int version;
+    long long sourceSize;
+    long long sourceModified;
+    unsigned long long sourceHash;
+    unsigned int vertexCount;
+    unsigned int vertexStride;      // bytes
+    unsigned int indexCount;
+    unsigned int indexSize;         // 2 or 4 bytes
+    unsigned int submeshCount;
+    unsigned int reserved;
+    float boundsMin[3];
+    float boundsMax[3];
+    unsigned long long vertexOffset;
+    unsigned long long indexOffset;
+    unsigned long long submeshOffset;
+};
+
+class MeshCache
+{
+    static const unsigned int currentVersion = 1;
     
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
-    glBufferData(GL_ARRAY_BUFFER, nTriangles * 9 * sizeof(float), vertexNormalCoords, GL_STATIC_DRAW);
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    MappedFile file;
+    const MeshCacheHeader* header;
+    
+public:
+    static std::string GetPath(const char* sourceFilename) { return std::string(sourceFilename) + ".meshcache"; }
+    
+    // maps the cache and keeps it only if it was written by this version for exactly this source
+    MeshCache(const std::string& path, const SourceFileStamp& source);
     
-    delete vertexCoords;
-    delete vertexTexCoords;
-    delete vertexNormalCoords;
+    bool IsValid() { return header != NULL; }
+    const MeshCacheHeader& GetHeader() { return *header; }
+    const void* GetVertices() { return file.Begin() + header->vertexOffset; }
+    const void* GetIndices() { return file.Begin() + header->indexOffset; }
+    const SubmeshRange* GetSubmeshes() { return (const SubmeshRange*)(file.Begin() + header->submeshOffset); }
+    
+    static bool Write(const std::string& path, const SourceFileStamp& source, IndexedMesh& mesh);
+};
+
+MeshCache::MeshCache(const std::string& path, const SourceFileStamp& source) : file(path.c_str()), header(NULL)
+{
+    if(!file.IsOpen() || file.Size() < sizeof(MeshCacheHeader)) return;
+    const MeshCacheHeader* h = (const MeshCacheHeader*)file.Begin();
+    
+    if(memcmp(h->magic, "MSHC", 4) != 0 || h->version != currentVersion) return;
+    if(h->sourceSize != source.size || h->sourceModified != source.modified || h->sourceHash != source.hash) return;
+    if(h->vertexStride != IndexedMesh::vertexStride * sizeof(float) || (h->indexSize != 2 && h->indexSize != 4)) return;
+    if(h->vertexOffset + (unsigned long long)h->vertexCount * h->vertexStride > file.Size() ||
+       h->indexOffset + (unsigned long long)h->indexCount * h->indexSize > file.Size() ||
+       h->submeshOffset + (unsigned long long)h->submeshCount * sizeof(SubmeshRange) > file.Size()) return;
+    
+    header = h;
+}
+
+bool MeshCache::Write(const std::string& path, const SourceFileStamp& source, IndexedMesh& mesh)
+{
+    std::vector<unsigned char> indexData;
+    mesh.GetIndexData(indexData);
+    
+    MeshCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "MSHC", 4);
+    h.version = currentVersion;
+    h.sourceSize = source.size;
+    h.sourceModified = source.modified;
+    h.sourceHash = source.hash;
+    h.vertexCount = mesh.GetVertexCount();
+    h.vertexStride = IndexedMesh::vertexStride * sizeof(float);
+    h.indexCount = mesh.GetIndexCount();
+    h.indexSize = mesh.GetIndexSize();
+    h.submeshCount = (unsigned int)mesh.submeshes.size();
+    h.boundsMin[0] = mesh.boundsMin.x; h.boundsMin[1] = mesh.boundsMin.y; h.boundsMin[2] = mesh.boundsMin.z;
+    h.boundsMax[0] = mesh.boundsMax.x; h.boundsMax[1] = mesh.boundsMax.y; h.boundsMax[2] = mesh.boundsMax.z;
+    
+    size_t vertexBytes = mesh.vertices.size() * sizeof(float);
+    size_t submeshBytes = mesh.submeshes.size() * sizeof(SubmeshRange);
+    h.vertexOffset = (sizeof(MeshCacheHeader) + 15) & ~15ull;
+    h.indexOffset = (h.vertexOffset + vertexBytes + 15) & ~15ull;
+    h.submeshOffset = (h.indexOffset + indexData.size() + 15) & ~15ull;
+    
+    // written under a temporary name so a reader never maps a half-written cache
+    std::string temporaryPath = path + ".tmp";
+    FILE* f = fopen(temporaryPath.c_str(), "wb");
+    if(!f) return false;
+    
+    static const char zeros[16] = {0};
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && fwrite(zeros, 1, h.vertexOffset - sizeof(h), f) == h.vertexOffset - sizeof(h);
+    ok = ok && fwrite(mesh.vertices.data(), 1, vertexBytes, f) == vertexBytes;
+    ok = ok && fwrite(zeros, 1, h.indexOffset - h.vertexOffset - vertexBytes, f) == h.indexOffset - h.vertexOffset - vertexBytes;
+    ok = ok && fwrite(indexData.data(), 1, indexData.size(), f) == indexData.size();
+    ok = ok && fwrite(zeros, 1, h.submeshOffset - h.indexOffset - indexData.size(), f) == h.submeshOffset - h.indexOffset - indexData.size();
+    ok = ok && fwrite(mesh.submeshes.data(), 1, submeshBytes, f) == submeshBytes;
+    ok = (fclose(f) == 0) && ok;
+    
+    remove(path.c_str());
+    if(!ok || rename(temporaryPath.c_str(), path.c_str()) != 0)
+    {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    return true;
 }
 
+// CPU half of a PolygonalMesh load: Read may run on any thread, PolygonalMesh::Upload consumes
+// the result on the GL thread
+struct MeshLoad
+{
+    std::string filename;
+    bool ok;
+    MeshCache* cache;                       // set when the vertices come straight from a valid cache
+    IndexedMesh mesh;                       // otherwise the freshly parsed OBJ
+    std::vector<unsigned char> indexData;
+    double milliseconds;
+    
+    MeshLoad(const std::string& filename) : filename(filename), ok(false), cache(NULL), milliseconds(0) {}
+    ~MeshLoad() { delete cache; }
+    
+    void Read();
+};
 
-void PolygonalMesh::Draw()
+void MeshLoad::Read()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    SourceFileStamp source;
+    if(!source.Read(filename.c_str()))
+    {
+        return;
+    }
+    
+    // a valid cache stays mapped until the upload; otherwise the OBJ is parsed and the cache rewritten
+    std::string cachePath = MeshCache::GetPath(filename.c_str());
+    cache = new MeshCache(cachePath, source);
+    if(!cache->IsValid())
+    {
+        delete cache;
+        cache = NULL;
+        
+        ObjFile obj;
+        if(!obj.Load(filename.c_str()))
+        {
+            return;
+        }
+        
+        mesh.Build(obj);
+        MeshCache::Write(cachePath, source, mesh);
+        mesh.GetIndexData(indexData);
+    }
+    
+    ok = true;
+    milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+class   PolygonalMesh : public Geometry
+{
+    int nTriangles;
+    int nIndices;
+    unsigned int indexType;
+    vec3 boundsMin, boundsMax;
+    vec3 sphereCenter;
+    float sphereRadius;
+    std::vector<SubmeshRange> submeshes;
+    unsigned int vbo[2];
+    size_t bufferBytes;
+    
+    void Upload(const void* vertices, int nVertices, const void* indices, int indexSize);
+    void SetVertexAttributes();
+    
+public:
+    // an empty mesh that draws nothing until Upload gives it data
+    PolygonalMesh();
+    PolygonalMesh(const char *filename);
+    ~PolygonalMesh();
+    
+    void Upload(MeshLoad& load);
+    
+    bool IsLoaded() { return vbo[0] != 0; }
+    size_t GetBufferBytes() { return bufferBytes; }
+    
+    void Draw();
+    
+    bool AttachBuffers();
+    void DrawInstanced(int nInstances);
+    
+    bool GetBoundingSphere(vec3& center, float& radius);
+};
+
+
+
+PolygonalMesh::PolygonalMesh()
+{
+    nTriangles = 0;
+    nIndices = 0;
+    sphereRadius = 0;
+    indexType = GL_UNSIGNED_SHORT;
+    vbo[0] = vbo[1] = 0;
+    bufferBytes = 0;
+}
+
+PolygonalMesh::PolygonalMesh(const char *filename)
+{
+    nTriangles = 0;
+    nIndices = 0;
+    sphereRadius = 0;
+    indexType = GL_UNSIGNED_SHORT;
+    vbo[0] = vbo[1] = 0;
+    bufferBytes = 0;
+    
+    MeshLoad load(filename);
+    load.Read();
+    Upload(load);
+}
+
+void PolygonalMesh::Upload(MeshLoad& load)
+{
+    if(!load.ok)
+    {
+        return;
+    }
+    
+    int nVertices = 0;
+    int indexSize = 0;
+    
+    if(load.cache)
+    {
+        const MeshCacheHeader& h = load.cache->GetHeader();
+        nVertices = h.vertexCount;
+        nIndices = h.indexCount;
+        indexSize = h.indexSize;
+        boundsMin = vec3(h.boundsMin[0], h.boundsMin[1], h.boundsMin[2]);
+        boundsMax = vec3(h.boundsMax[0], h.boundsMax[1], h.boundsMax[2]);
+        submeshes.assign(load.cache->GetSubmeshes(), load.cache->GetSubmeshes() + h.submeshCount);
+        Upload(load.cache->GetVertices(), nVertices, load.cache->GetIndices(), indexSize);
+    }
+    else
+    {
+        nVertices = load.mesh.GetVertexCount();
+        nIndices = load.mesh.GetIndexCount();
+        indexSize = load.mesh.GetIndexSize();
+        boundsMin = load.mesh.boundsMin;
+        boundsMax = load.mesh.boundsMax;
+        submeshes = load.mesh.submeshes;
+        Upload(load.mesh.vertices.data(), nVertices, load.indexData.data(), indexSize);
+    }
+    
+    nTriangles = nIndices / 3;
+    
+    size_t unindexedBytes = (size_t)nIndices * IndexedMesh::vertexStride * sizeof(float);
+    size_t indexedBytes = (size_t)nVertices * IndexedMesh::vertexStride * sizeof(float) + (size_t)nIndices * indexSize;
+    const char* name = strrchr(load.filename.c_str(), '/');
+    printf("%s: %d corners -> %d vertices (%.2fx), %d-bit indices, %.1f KB of buffers saved, %s in %.2f ms\n",
+           name ? name + 1 : load.filename.c_str(), nIndices, nVertices, nVertices ? (float)nIndices / nVertices : 0.0f,
+           indexSize * 8, ((double)unindexedBytes - (double)indexedBytes) / 1024.0,
+           load.cache ? "cached" : "parsed", load.milliseconds);
+}
+
+void PolygonalMesh::Upload(const void* vertices, int nVertices, const void* indices, int indexSize)
 {
-    glEnable(GL_DEPTH_TEST);
+    const int stride = IndexedMesh::vertexStride * sizeof(float);
+    
+    // the sphere is centered on the box and just large enough for the farthest vertex
+    sphereCenter = (boundsMin + boundsMax) * 0.5f;
+    float radiusSquared = 0;
+    for(int i = 0; i < nVertices; i++)
+    {
+        const float* p = (const float*)vertices + (size_t)i * IndexedMesh::vertexStride;
+        vec3 offset = vec3(p[0], p[1], p[2]) - sphereCenter;
+        radiusSquared = std::max(radiusSquared, offset.x * offset.x + offset.y * offset.y + offset.z * offset.z);
+    }
+    sphereRadius = sqrtf(radiusSquared);
+    
     glBindVertexArray(vao);
-    glDrawArrays(GL_TRIANGLES, 0, nTriangles * 3);
-    glDisable(GL_DEPTH_TEST);
+    
+    glGenBuffers(2, &vbo[0]);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+    glBufferData(GL_ARRAY_BUFFER, (size_t)nVertices * stride, vertices, GL_STATIC_DRAW);
+    SetVertexAttributes();
+    
+    indexType = indexSize == 4 ? GL_UNSIGNED_INT : GL_UNSIGNED_SHORT;
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, (size_t)nIndices * indexSize, indices, GL_STATIC_DRAW);
+    
+    bufferBytes = (size_t)nVertices * stride + (size_t)nIndices * indexSize;
+}
+
+// interleaved position, texcoord and normal from the vertex buffer bound to GL_ARRAY_BUFFER
+void PolygonalMesh::SetVertexAttributes()
+{
+    const int stride = IndexedMesh::vertexStride * sizeof(float);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*)0);
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void*)(3 * sizeof(float)));
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void*)(5 * sizeof(float)));
+}
+
+bool PolygonalMesh::AttachBuffers()
+{
+    if(!nIndices) return false;
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+    SetVertexAttributes();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
+    return true;
 }
 
+// expects the vertex array prepared through AttachBuffers to be bound
+void PolygonalMesh::DrawInstanced(int nInstances)
+{
+    frameStats.triangles += nTriangles * nInstances;
+    GL_DRAW(glDrawElementsInstanced(GL_TRIANGLES, nIndices, indexType, NULL, nInstances));
+}
+
+bool PolygonalMesh::GetBoundingSphere(vec3& center, float& radius)
+{
+    if(!nIndices) return false;
+    center = sphereCenter;
+    radius = sphereRadius;
+    return true;
+}
 
 PolygonalMesh::~PolygonalMesh()
 {
-    for(unsigned int i = 0; i < rows.size(); i++) delete rows[i];
-    for(unsigned int i = 0; i < positions.size(); i++) delete positions[i];
-    for(unsigned int i = 0; i < submeshFaces.size(); i++)
-    for(unsigned int j = 0; j < submeshFaces.at(i).size(); j++)
-    delete submeshFaces.at(i).at(j);
-    for(unsigned int i = 0; i < normals.size(); i++) delete normals[i];
-    for(unsigned int i = 0; i < texcoords.size(); i++) delete texcoords[i];
+    if(vbo[0]) glDeleteBuffers(2, vbo);
+}
+
+
+void PolygonalMesh::Draw()
+{
+    if(!nIndices) return;
+    glState.SetDepthTest(true);
+    glState.SetBlend(false);
+    glState.BindVertexArray(vao);
+    frameStats.triangles += nTriangles;
+    GL_DRAW(glDrawElements(GL_TRIANGLES, nIndices, indexType, NULL));
 }
 
+// uniforms the upload methods know about, resolved to locations once when a program links
+enum ShaderUniform
+{
+    uniformM, uniformInvM, uniformMVP,
+    uniformSamplerUnit, uniformEnvironmentMap,
+    uniformKa, uniformKd, uniformKs, uniformShininess,
+    uniformViewDirMatrix, uniformShadowMap,
+    uniformCount
+};
+
+const char* shaderUniformNames[uniformCount] =
+{
+    "M", "InvM", "MVP",
+    "samplerUnit", "environmentMap",
+    "ka", "kd", "ks", "shininess",
+    "viewDirMatrix", "shadowMap"
+};
+
+// the shadow map stays bound to this unit for the whole frame; Link points every program's shadowMap sampler at it
+const int shadowMapUnit = 2;
+// layers of the shadow map's texture array, sized into the Shadow block
+const int maxShadowCascades = 4;
+
+// per-frame data lives in uniform blocks that every program reads from the same binding point
+enum UniformBlockBinding
+{
+    cameraBlockBinding, lightBlockBinding, shadowBlockBinding,
+    uniformBlockCount
+};
+
+const char* uniformBlockNames[uniformBlockCount] = { "Camera", "Light", "Shadow" };
+
+// one active uniform of a linked program as reported by glGetActiveUniform
+struct UniformInfo
+{
+    std::string name;
+    int location;
+    GLenum type;
+    int size;
+};
+
 class Shader
 {
+    int sortId;
+    const void* materialUniforms;
+    
 protected:
     unsigned int shaderProgram;
+    std::vector<UniformInfo> uniforms;
+    int uniformLocations[uniformCount];
+    
+    // links the program and reflects its active uniforms; all name lookups happen here
+    void Link()
+    {
+        glLinkProgram(shaderProgram);
+        checkLinking(shaderProgram);
+        
+        for(int i = 0; i < uniformBlockCount; i++)
+        {
+            unsigned int blockIndex = glGetUniformBlockIndex(shaderProgram, uniformBlockNames[i]);
+            if(blockIndex != GL_INVALID_INDEX) glUniformBlockBinding(shaderProgram, blockIndex, i);
+        }
+        
+        uniforms.clear();
+        for(int i = 0; i < uniformCount; i++) uniformLocations[i] = -1;
+        
+        int nUniforms = 0, maxLength = 0;
+        glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORMS, &nUniforms);
+        glGetProgramiv(shaderProgram, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::vector<char> name(std::max(maxLength, 1));
+        for(int i = 0; i < nUniforms; i++)
+        {
+            UniformInfo info;
+            int length = 0;
+            glGetActiveUniform(shaderProgram, i, (int)name.size(), &length, &info.size, &info.type, name.data());
+            info.name.assign(name.data(), length);
+            // arrays are reported as "name[0]"
+            size_t bracket = info.name.find('[');
+            if(bracket != std::string::npos) info.name.resize(bracket);
+            info.location = glGetUniformLocation(shaderProgram, name.data());
+            // uniforms inside blocks have no location of their own
+            if(info.location < 0) continue;
+            
+            uniforms.push_back(info);
+            for(int j = 0; j < uniformCount; j++)
+                if(info.name == shaderUniformNames[j]) uniformLocations[j] = info.location;
+        }
+        
+        if(uniformLocations[uniformShadowMap] >= 0) glProgramUniform1i(shaderProgram, uniformLocations[uniformShadowMap], shadowMapUnit);
+    }
     
 public:
     Shader()
     {
+        static int shaderCount = 0;
+        sortId = shaderCount++;
+        materialUniforms = NULL;
         shaderProgram = 0;
+        for(int i = 0; i < uniformCount; i++) uniformLocations[i] = -1;
     }
     
     ~Shader()
@@ -722,65 +2328,253 @@ public:
     
     void Run()
     {
-        if(shaderProgram) glUseProgram(shaderProgram);
+        if(shaderProgram) glState.UseProgram(shaderProgram);
+    }
+    
+    // small dense id the render queue sorts programs by
+    int GetSortId() { return sortId; }
+    
+    // a program keeps its uniform values while other programs run, so a material
+    // only needs to upload its constants if another one wrote them since
+    bool HasMaterialUniforms(const void* material) { return materialUniforms == material; }
+    void SetMaterialUniforms(const void* material) { materialUniforms = material; }
+    
+    // location of an arbitrary active uniform, -1 if the program does not use it; meant for setup code
+    int FindUniform(const char* name)
+    {
+        for(int i = 0; i < (int)uniforms.size(); i++)
+            if(uniforms[i].name == name) return uniforms[i].location;
+        return -1;
+    }
+    
+    bool HasUniform(ShaderUniform uniform) { return uniformLocations[uniform] >= 0; }
+    
+    // uniforms the program does not declare (or the compiler removed) are skipped silently
+    void SetUniform(ShaderUniform uniform, const mat4& value)
+    {
+        int location = uniformLocations[uniform];
+        if(location >= 0) GL_COUNT(glUniformMatrix4fv(location, 1, GL_TRUE, &value.m[0][0]));
+    }
+    
+    void SetUniform(ShaderUniform uniform, const vec4& value)
+    {
+        int location = uniformLocations[uniform];
+        if(location >= 0) GL_COUNT(glUniform4fv(location, 1, &value.v[0]));
+    }
+    
+    void SetUniform(ShaderUniform uniform, const vec3& value)
+    {
+        int location = uniformLocations[uniform];
+        if(location >= 0) GL_COUNT(glUniform3fv(location, 1, &value.x));
+    }
+    
+    void SetUniform(ShaderUniform uniform, float value)
+    {
+        int location = uniformLocations[uniform];
+        if(location >= 0) GL_COUNT(glUniform1f(location, value));
+    }
+    
+    void SetUniform(ShaderUniform uniform, int value)
+    {
+        int location = uniformLocations[uniform];
+        if(location >= 0) GL_COUNT(glUniform1i(location, value));
     }
     
-    virtual void UploadM(mat4& M) { }
-    virtual void UploadInvM(mat4& InVM) { }
-    virtual void UploadMVP(mat4& MVP) { }
-    virtual void UploadVP(mat4& VP) { }
+    virtual void UploadM(const mat4& M) { SetUniform(uniformM, M); }
+    virtual void UploadInvM(const mat4& InvM) { SetUniform(uniformInvM, InvM); }
+    virtual void UploadMVP(const mat4& MVP) { SetUniform(uniformMVP, MVP); }
     virtual void UploadColor(vec4& color) { }
     virtual void UploadSamplerID() { }
-    virtual void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) { }
-    virtual void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) { }
-    virtual void UploadEyePosition(vec3 wEye) { }
+    
+    virtual void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess)
+    {
+        SetUniform(uniformKa, ka);
+        SetUniform(uniformKd, kd);
+        SetUniform(uniformKs, ks);
+        SetUniform(uniformShininess, shininess);
+    }
+    
     virtual void UploadSamplerCubeID() { }
-    virtual void UploadViewDirMatrix(mat4& viewDirMatrix) { }
+    virtual void UploadViewDirMatrix(mat4& viewDirMatrix) { SetUniform(uniformViewDirMatrix, viewDirMatrix); }
+};
+
+// GL buffer behind one uniform block, attached to the block's binding point
+class UniformBuffer
+{
+    unsigned int buffer;
+    int binding;
+    int size;
+    
+public:
+    UniformBuffer(int binding, int size) : buffer(0), binding(binding), size(size) {}
+    
+    ~UniformBuffer()
+    {
+        if(buffer) glDeleteBuffers(1, &buffer);
+    }
+    
+    void Update(const void* data)
+    {
+        // created on first use, the blocks below are globals that exist before the GL context
+        if(!buffer)
+        {
+            glGenBuffers(1, &buffer);
+            glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+            glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+            glBindBufferBase(GL_UNIFORM_BUFFER, binding, buffer);
+        }
+        else GL_COUNT(glBindBuffer(GL_UNIFORM_BUFFER, buffer));
+        GL_COUNT(glBufferSubData(GL_UNIFORM_BUFFER, 0, size, data));
+    }
+};
+
+// std140 layout of the Camera block, matrices are row-major like mat4
+struct CameraBlock
+{
+    mat4 viewMatrix;
+    mat4 projectionMatrix;
+    mat4 VP;
+    float worldEyePosition[4];
+};
+
+// std140 layout of the Light block, every vec3 is padded to 16 bytes
+struct LightBlock
+{
+    float La[4];
+    float Le[4];
+    vec4 worldLightPosition;
+};
+
+// std140 layout of the Shadow block: casters are drawn with the light's view and projection of one
+// cascade; receivers rotate into the light's axes per vertex and scale and offset into each cascade's
+// texture coordinates and depth per fragment, padded to 16 bytes
+struct ShadowBlock
+{
+    mat4 lightViewProjection;
+    mat4 lightRotation;
+    float cascadeScales[maxShadowCascades];
+    float cascadeOffsetsU[maxShadowCascades];
+    float cascadeOffsetsV[maxShadowCascades];
+    float cascadeOffsetsW[maxShadowCascades];
+    float normalOffsets[maxShadowCascades];
+    float depthScale;
+    int cascadeCount;
+    int padding[2];
 };
 
+UniformBuffer cameraBlock(cameraBlockBinding, sizeof(CameraBlock));
+UniformBuffer lightBlock(lightBlockBinding, sizeof(LightBlock));
+UniformBuffer shadowBlock(shadowBlockBinding, sizeof(ShadowBlock));
+
+// GLSL declaration of the Shadow block for the shaders that receive shadows, passed to glShaderSource
+// after their other declarations: a block read by both stages of a program must be declared alike
+const char* shadowBlockSource = R"(
+        layout(std140, row_major) uniform Shadow {
+            mat4 lightViewProjection;
+            mat4 lightRotation;
+            vec4 cascadeScales;
+            vec4 cascadeOffsetsU, cascadeOffsetsV, cascadeOffsetsW;
+            vec4 normalOffsets;
+            float depthScale;
+            int cascadeCount;
+        };
+        )";
+
+// GLSL shared by the fragment shaders that receive shadows, passed after the Shadow block;
+// shadowPosition is the homogeneous world position rotated into the light's axes and divided here so
+// that points the ground quad places at infinity interpolate correctly
+const char* shadowSamplingSource = R"(
+        uniform sampler2DArrayShadow shadowMap;
+        
+        float ShadowVisibility(vec4 shadowPosition, vec3 shadowNormal) {
+            // only the sun casts into the map, but most objects are lit by the avatar's spotlight: their
+            // sides turned from the sun would be in their own shadow, so only sides facing it receive
+            float facing = smoothstep(0.0, 0.1, shadowNormal.z);
+            if(facing == 0.0) return 1.0;
+            vec3 position = shadowPosition.xyz / shadowPosition.w;
+            // the first cascade whose map holds the point a few texels from its edge; unused ones hold nothing
+            vec2 texel = 0.5 / vec2(textureSize(shadowMap, 0).xy);
+            vec4 x = abs(position.x * cascadeScales + cascadeOffsetsU - 0.5);
+            vec4 y = abs(position.y * cascadeScales + cascadeOffsetsV - 0.5);
+            vec4 outside = vec4(greaterThan(max(x, y), vec4(0.5 - 6.0 * texel.x)));
+            int cascade = int(outside.x * (1.0 + outside.y * (1.0 + outside.z * (1.0 + outside.w))));
+            if(cascade >= cascadeCount) return 1.0;
+            // pushed off the surface along the normal by the cascade's texel size, so it does not shadow itself
+            position += shadowNormal * normalOffsets[cascade];
+            vec3 coord = vec3(position.xy * cascadeScales[cascade] + vec2(cascadeOffsetsU[cascade], cascadeOffsetsV[cascade]),
+                              position.z * depthScale + cascadeOffsetsW[cascade]);
+            // beyond the far end of its box nothing is known: call it lit
+            if(coord.z >= 1.0) return 1.0;
+            // four bilinear comparisons half a texel off the center weigh the 3x3 texels around it 1-2-1
+            float layer = float(cascade);
+            float visibility = texture(shadowMap, vec4(coord.xy + vec2(-texel.x, -texel.y), layer, coord.z));
+            visibility += texture(shadowMap, vec4(coord.xy + vec2(texel.x, -texel.y), layer, coord.z));
+            visibility += texture(shadowMap, vec4(coord.xy + vec2(-texel.x, texel.y), layer, coord.z));
+            visibility += texture(shadowMap, vec4(coord.xy + vec2(texel.x, texel.y), layer, coord.z));
+            return mix(1.0, visibility * 0.25, facing);
+        }
+        )";
+
 class MeshShader : public Shader
 {
 public:
     MeshShader()
     {
-        const char *vertexSource = R"(
+        // the Shadow block goes between the declarations and main
+        const char *vertexSources[] = { R"(
         #version 410
         precision highp float;
         in vec3 vertexPosition;
         in vec2 vertexTexCoord;
         in vec3 vertexNormal;
         uniform mat4 M, InvM, MVP;
-        uniform vec3 worldEyePosition;
-        uniform vec4 worldLightPosition;
+        layout(std140, row_major) uniform Camera {
+            mat4 viewMatrix, projectionMatrix, VP;
+            vec3 worldEyePosition;
+        };
+        layout(std140) uniform Light {
+            vec3 La, Le;
+            vec4 worldLightPosition;
+        };
         out vec2 texCoord;
         out vec3 worldNormal;
         out vec3 worldView;
         out vec3 worldLight;
-        
+        out vec4 shadowPosition;
+        out vec3 shadowNormal;
+        )", shadowBlockSource, R"(
         void main() {
             texCoord = vertexTexCoord;
             vec4 worldPosition = vec4(vertexPosition, 1) * M;
             worldLight  = worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w;
             worldView = worldEyePosition - worldPosition.xyz;
             worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz;
+            shadowPosition = worldPosition * lightRotation;
+            shadowNormal = (vec4(normalize(worldNormal), 0) * lightRotation).xyz;
             gl_Position = vec4(vertexPosition, 1) * MVP;
         }
-        )";
+        )" };
         
-        const char *fragmentSource = R"(
+        // the Shadow block and the shadow sampling go between the declarations and main
+        const char *fragmentSources[] = { R"(
         #version 410
         precision highp float;
         uniform sampler2D samplerUnit;
         uniform samplerCube environmentMap;
-        uniform vec3 La, Le;
+        layout(std140) uniform Light {
+            vec3 La, Le;
+            vec4 worldLightPosition;
+        };
         uniform vec3 ka, kd, ks;
         uniform float shininess;
         in vec2 texCoord;
         in vec3 worldNormal;
         in vec3 worldView;
         in vec3 worldLight;
+        in vec4 shadowPosition;
+        in vec3 shadowNormal;
         out vec4 fragmentColor;
-        
+        )", shadowBlockSource, shadowSamplingSource, R"(
         void main() {
             vec3 N = normalize(worldNormal);
             vec3 V = normalize(worldView);
@@ -788,22 +2582,23 @@ public:
             vec3 H = normalize(V + L);
             vec3 texel = texture(samplerUnit, texCoord).xyz;
             
-            vec3 color = La * ka + Le * kd * texel * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess);
+            float visibility = ShadowVisibility(shadowPosition, shadowNormal);
+            vec3 color = La * ka + (Le * kd * texel * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess)) * visibility;
             fragmentColor = vec4(color, 1);
         }
-        )";
+        )" };
         
         unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
         if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
         
-        glShaderSource(vertexShader, 1, &vertexSource, NULL);
+        glShaderSource(vertexShader, 3, vertexSources, NULL);
         glCompileShader(vertexShader);
         checkShader(vertexShader, "Vertex shader error");
         
         unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
         if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
         
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+        glShaderSource(fragmentShader, 4, fragmentSources, NULL);
         glCompileShader(fragmentShader);
         checkShader(fragmentShader, "Fragment shader error");
         
@@ -819,88 +2614,23 @@ public:
         
         glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
         
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
+        Link();
     }
     
     void UploadSamplerID()
     {
         int samplerUnit = 0;
-        int location = glGetUniformLocation(shaderProgram, "samplerUnit");
-        glUniform1i(location, samplerUnit);
-        glActiveTexture(GL_TEXTURE0 + samplerUnit);
+        SetUniform(uniformSamplerUnit, samplerUnit);
+        glState.ActiveTexture(samplerUnit);
     }
     
     
     void UploadSamplerCubeID() {
         int samplerCube = 1;
-        int location = glGetUniformLocation(shaderProgram, "environmentMap");
-        glUniform1i(location, samplerCube);
-        glActiveTexture(GL_TEXTURE0 + samplerCube);
+        SetUniform(uniformEnvironmentMap, samplerCube);
+        glState.ActiveTexture(samplerCube);
 
     }
-    
-    void UploadM(mat4& M)
-    {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
-    }
-    
-    void UploadInvM(mat4& InvM)
-    {
-        int location = glGetUniformLocation(shaderProgram, "InvM");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, InvM);
-        else printf("uniform InvM cannot be set\n");
-    }
-    
-    void UploadMVP(mat4& MVP)
-    {
-        int location = glGetUniformLocation(shaderProgram, "MVP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
-        else printf("uniform MVP cannot be set\n");
-    }
-    
-    void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {
-        
-        int location1 = glGetUniformLocation(shaderProgram, "ka");
-        if (location1 >= 0) glUniform3fv(location1, 1, &ka.x);
-        else printf("uniform ka cannot be set\n");
-        
-        int location2 = glGetUniformLocation(shaderProgram, "kd");
-        if (location2 >= 0) glUniform3fv(location2, 1, &kd.x);
-        else printf("uniform kd cannot be set\n");
-        
-        int location3 = glGetUniformLocation(shaderProgram, "ks");
-        if (location3 >= 0) glUniform3fv(location3, 1, &ks.x);
-        else printf("uniform ks cannot be set\n");
-        
-        int location4 = glGetUniformLocation(shaderProgram, "shininess");
-        if (location4 >= 0) glUniform1f(location4, shininess);
-        else printf("uniform shininess cannot be set\n");
-    }
-    
-    void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {
-        
-        int location1 = glGetUniformLocation(shaderProgram, "La");
-        if (location1 >= 0) glUniform3fv(location1, 1, &La.x);
-        else printf("uniform La cannot be set\n");
-        
-        int location2 = glGetUniformLocation(shaderProgram, "Le");
-        if (location2 >= 0) glUniform3fv(location2, 1, &Le.x);
-        else printf("uniform Le cannot be set\n");
-        
-        int location3 = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location3 >= 0) glUniform4fv(location3, 1, &worldLightPosition.v[0]);
-        else printf("uniform world light position cannot be set\n");
-    }
-    
-    void UploadEyePosition(vec3 wEye) {
-        int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
-        if (location >= 0) glUniform3fv(location, 1, &wEye.x);
-        else printf("uniform eye position cannot be set\n");
-    }
-
 };
 
 class ReflectiveShader : public Shader
@@ -915,8 +2645,14 @@ public:
         in vec2 vertexTexCoord;
         in vec3 vertexNormal;
         uniform mat4 M, InvM, MVP;
-        uniform vec3 worldEyePosition;
-        uniform vec4 worldLightPosition;
+        layout(std140, row_major) uniform Camera {
+            mat4 viewMatrix, projectionMatrix, VP;
+            vec3 worldEyePosition;
+        };
+        layout(std140) uniform Light {
+            vec3 La, Le;
+            vec4 worldLightPosition;
+        };
         out vec2 texCoord;
         out vec3 worldNormal;
         out vec3 worldView;
@@ -937,7 +2673,10 @@ public:
         precision highp float;
         uniform sampler2D samplerUnit;
         uniform samplerCube environmentMap;
-        uniform vec3 La, Le;
+        layout(std140) uniform Light {
+            vec3 La, Le;
+            vec4 worldLightPosition;
+        };
         uniform vec3 ka, kd, ks;
         uniform float shininess;
         in vec2 texCoord;
@@ -988,96 +2727,32 @@ public:
         
         glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
         
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
+        Link();
     }
     
     void UploadSamplerID()
     {
         int samplerUnit = 0;
-        int location = glGetUniformLocation(shaderProgram, "samplerUnit");
-        glUniform1i(location, samplerUnit);
-        glActiveTexture(GL_TEXTURE0 + samplerUnit);
+        SetUniform(uniformSamplerUnit, samplerUnit);
+        glState.ActiveTexture(samplerUnit);
     }
     
     
     void UploadSamplerCubeID() {
         int samplerCube = 1;
-        int location = glGetUniformLocation(shaderProgram, "environmentMap");
-        glUniform1i(location, samplerCube);
-        glActiveTexture(GL_TEXTURE0 + samplerCube);
+        SetUniform(uniformEnvironmentMap, samplerCube);
+        glState.ActiveTexture(samplerCube);
         
     }
-    
-    void UploadM(mat4& M)
-    {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
-    }
-    
-    void UploadInvM(mat4& InvM)
+};
+
+class InfiniteQuadShader : public Shader
+{
+public:
+    InfiniteQuadShader()
     {
-        int location = glGetUniformLocation(shaderProgram, "InvM");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, InvM);
-        else printf("uniform InvM cannot be set\n");
-    }
-    
-    void UploadMVP(mat4& MVP)
-    {
-        int location = glGetUniformLocation(shaderProgram, "MVP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
-        else printf("uniform MVP cannot be set\n");
-    }
-    
-    void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {
-        
-        int location1 = glGetUniformLocation(shaderProgram, "ka");
-        if (location1 >= 0) glUniform3fv(location1, 1, &ka.x);
-        else printf("uniform ka cannot be set\n");
-        
-        int location2 = glGetUniformLocation(shaderProgram, "kd");
-        if (location2 >= 0) glUniform3fv(location2, 1, &kd.x);
-        else printf("uniform kd cannot be set\n");
-        
-        int location3 = glGetUniformLocation(shaderProgram, "ks");
-        if (location3 >= 0) glUniform3fv(location3, 1, &ks.x);
-        else printf("uniform ks cannot be set\n");
-        
-        int location4 = glGetUniformLocation(shaderProgram, "shininess");
-        if (location4 >= 0) glUniform1f(location4, shininess);
-        else printf("uniform shininess cannot be set\n");
-    }
-    
-    void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {
-        
-        int location1 = glGetUniformLocation(shaderProgram, "La");
-        if (location1 >= 0) glUniform3fv(location1, 1, &La.x);
-        else printf("uniform La cannot be set\n");
-        
-        int location2 = glGetUniformLocation(shaderProgram, "Le");
-        if (location2 >= 0) glUniform3fv(location2, 1, &Le.x);
-        else printf("uniform Le cannot be set\n");
-        
-        int location3 = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location3 >= 0) glUniform4fv(location3, 1, &worldLightPosition.v[0]);
-        else printf("uniform world light position cannot be set\n");
-    }
-    
-    void UploadEyePosition(vec3 wEye) {
-        int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
-        if (location >= 0) glUniform3fv(location, 1, &wEye.x);
-        else printf("uniform eye position cannot be set\n");
-    }
-    
-};
-
-class InfiniteQuadShader : public Shader
-{
-public:
-    InfiniteQuadShader()
-    {
-        const char *vertexSource = R"(
+        // the Shadow block goes between the declarations and main
+        const char *vertexSources[] = { R"(
         #version 410
         in vec4 vertexPosition;
         in vec2 vertexTexCoord;
@@ -1087,28 +2762,41 @@ public:
         out vec2 texCoord;
         out vec4 worldPosition;
         out vec3 worldNormal;
-        
+        out vec4 shadowPosition;
+        out vec3 shadowNormal;
+        )", shadowBlockSource, R"(
         void main() {
             texCoord = vertexTexCoord;
             worldPosition = vertexPosition * M;
             worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz;
+            shadowPosition = worldPosition * lightRotation;
+            shadowNormal = (vec4(normalize(worldNormal), 0) * lightRotation).xyz;
             gl_Position = vertexPosition * MVP;
         }
-        )";
+        )" };
         
-        const char *fragmentSource = R"(
+        // the Shadow block and the shadow sampling go between the declarations and main
+        const char *fragmentSources[] = { R"(
         #version 410
         precision highp float;
         uniform sampler2D samplerUnit;
-        uniform vec3 La, Le;
+        layout(std140, row_major) uniform Camera {
+            mat4 viewMatrix, projectionMatrix, VP;
+            vec3 worldEyePosition;
+        };
+        layout(std140) uniform Light {
+            vec3 La, Le;
+            vec4 worldLightPosition;
+        };
         uniform vec3 ka, kd, ks;
         uniform float shininess;
-        uniform vec3 worldEyePosition;
-        uniform vec4 worldLightPosition;
         in vec2 texCoord;
         in vec4 worldPosition;
         in vec3 worldNormal;
+        in vec4 shadowPosition;
+        in vec3 shadowNormal;
         out vec4 fragmentColor;
+        )", shadowBlockSource, shadowSamplingSource, R"(
         void main() {
             vec3 N = normalize(worldNormal);
             vec3 V = normalize(worldEyePosition * worldPosition.w - worldPosition.xyz);
@@ -1117,22 +2805,23 @@ public:
             vec2 position = worldPosition.xz / worldPosition.w;
             vec2 tex = position.xy - floor(position.xy);
             vec3 texel = texture(samplerUnit, tex).xyz;
-            vec3 color = La * ka + Le * kd * texel * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess);
+            float visibility = ShadowVisibility(shadowPosition, shadowNormal);
+            vec3 color = La * ka + (Le * kd * texel * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess)) * visibility;
             fragmentColor = vec4(color, 1);
         }
-        )";
+        )" };
         
         unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
         if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
         
-        glShaderSource(vertexShader, 1, &vertexSource, NULL);
+        glShaderSource(vertexShader, 3, vertexSources, NULL);
         glCompileShader(vertexShader);
         checkShader(vertexShader, "Vertex shader error");
         
         unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
         if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
         
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+        glShaderSource(fragmentShader, 4, fragmentSources, NULL);
         glCompileShader(fragmentShader);
         checkShader(fragmentShader, "Fragment shader error");
         
@@ -1148,84 +2837,209 @@ public:
         
         glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
         
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
+        Link();
     }
     
     void UploadSamplerID()
     {
         int samplerUnit = 0;
-        int location = glGetUniformLocation(shaderProgram, "samplerUnit");
-        glUniform1i(location, samplerUnit);
-        glActiveTexture(GL_TEXTURE0 + samplerUnit);
-    }
-    
-    void UploadM(mat4& M)
-    {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
+        SetUniform(uniformSamplerUnit, samplerUnit);
+        glState.ActiveTexture(samplerUnit);
     }
-    
-    void UploadInvM(mat4& InvM)
+};
+
+// depth of a shadow caster as the directional light sees it, for the shadow map
+class ShadowShader : public Shader
+{
+public:
+    ShadowShader()
     {
-        int location = glGetUniformLocation(shaderProgram, "InvM");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, InvM);
-        else printf("uniform InvM cannot be set\n");
+        const char *vertexSource = R"(
+        #version 410
+        precision highp float;
+        
+        in vec3 vertexPosition;
+        in vec2 vertexTexCoord;
+        in vec3 vertexNormal;
+        uniform mat4 M;
+        // the cascade being drawn into; the members the receivers use follow it
+        layout(std140, row_major) uniform Shadow {
+            mat4 lightViewProjection;
+        };
+        
+        void main() {
+            gl_Position = (vec4(vertexPosition, 1) * M) * lightViewProjection;
+        }
+        )";
+        
+        // only depth is written
+        const char *fragmentSource = R"(
+        #version 410
+        precision highp float;
+        
+        void main()
+        {
+        }
+        )";
+        
+        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+        if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+        
+        glShaderSource(vertexShader, 1, &vertexSource, NULL);
+        glCompileShader(vertexShader);
+        checkShader(vertexShader, "Vertex shader error");
+        
+        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
+        
+        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+        glCompileShader(fragmentShader);
+        checkShader(fragmentShader, "Fragment shader error");
+        
+        shaderProgram = glCreateProgram();
+        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+        
+        glAttachShader(shaderProgram, vertexShader);
+        glAttachShader(shaderProgram, fragmentShader);
+        
+        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
+        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+        
+        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+        
+        Link();
     }
-    
-    void UploadMVP(mat4& MVP)
+};
+
+// MeshShader for instanced draws: M and InvM come per instance from attributes 3-6 and 7-10,
+// MVP is formed in the shader from the per-frame VP
+class InstancedMeshShader : public Shader
+{
+public:
+    InstancedMeshShader()
     {
-        int location = glGetUniformLocation(shaderProgram, "MVP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
-        else printf("uniform MVP cannot be set\n");
-    }
-    
-    void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {
+        // the Shadow block goes between the declarations and main
+        const char *vertexSources[] = { R"(
+        #version 410
+        precision highp float;
+        in vec3 vertexPosition;
+        in vec2 vertexTexCoord;
+        in vec3 vertexNormal;
+        // our row-major rows arrive as the columns of these, so they multiply from the other side than M
+        in mat4 instanceM, instanceInvM;
+        layout(std140, row_major) uniform Camera {
+            mat4 viewMatrix, projectionMatrix, VP;
+            vec3 worldEyePosition;
+        };
+        layout(std140) uniform Light {
+            vec3 La, Le;
+            vec4 worldLightPosition;
+        };
+        out vec2 texCoord;
+        out vec3 worldNormal;
+        out vec3 worldView;
+        out vec3 worldLight;
+        out vec4 shadowPosition;
+        out vec3 shadowNormal;
+        )", shadowBlockSource, R"(
+        void main() {
+            texCoord = vertexTexCoord;
+            vec4 worldPosition = instanceM * vec4(vertexPosition, 1);
+            worldLight  = worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w;
+            worldView = worldEyePosition - worldPosition.xyz;
+            worldNormal = (vec4(vertexNormal, 0.0) * instanceInvM).xyz;
+            shadowPosition = worldPosition * lightRotation;
+            shadowNormal = (vec4(normalize(worldNormal), 0) * lightRotation).xyz;
+            gl_Position = worldPosition * VP;
+        }
+        )" };
+        
+        // the Shadow block and the shadow sampling go between the declarations and main
+        const char *fragmentSources[] = { R"(
+        #version 410
+        precision highp float;
+        uniform sampler2D samplerUnit;
+        uniform samplerCube environmentMap;
+        layout(std140) uniform Light {
+            vec3 La, Le;
+            vec4 worldLightPosition;
+        };
+        uniform vec3 ka, kd, ks;
+        uniform float shininess;
+        in vec2 texCoord;
+        in vec3 worldNormal;
+        in vec3 worldView;
+        in vec3 worldLight;
+        in vec4 shadowPosition;
+        in vec3 shadowNormal;
+        out vec4 fragmentColor;
+        )", shadowBlockSource, shadowSamplingSource, R"(
+        void main() {
+            vec3 N = normalize(worldNormal);
+            vec3 V = normalize(worldView);
+            vec3 L = normalize(worldLight);
+            vec3 H = normalize(V + L);
+            vec3 texel = texture(samplerUnit, texCoord).xyz;
+            
+            float visibility = ShadowVisibility(shadowPosition, shadowNormal);
+            vec3 color = La * ka + (Le * kd * texel * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess)) * visibility;
+            fragmentColor = vec4(color, 1);
+        }
+        )" };
         
-        int location1 = glGetUniformLocation(shaderProgram, "ka");
-        if (location1 >= 0) glUniform3fv(location1, 1, &ka.x);
-        else printf("uniform ka cannot be set\n");
+        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
+        if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
+        
+        glShaderSource(vertexShader, 3, vertexSources, NULL);
+        glCompileShader(vertexShader);
+        checkShader(vertexShader, "Vertex shader error");
         
-        int location2 = glGetUniformLocation(shaderProgram, "kd");
-        if (location2 >= 0) glUniform3fv(location2, 1, &kd.x);
-        else printf("uniform kd cannot be set\n");
+        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+        if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
         
-        int location3 = glGetUniformLocation(shaderProgram, "ks");
-        if (location3 >= 0) glUniform3fv(location3, 1, &ks.x);
-        else printf("uniform ks cannot be set\n");
+        glShaderSource(fragmentShader, 4, fragmentSources, NULL);
+        glCompileShader(fragmentShader);
+        checkShader(fragmentShader, "Fragment shader error");
         
-        int location4 = glGetUniformLocation(shaderProgram, "shininess");
-        if (location4 >= 0) glUniform1f(location4, shininess);
-        else printf("uniform shininess cannot be set\n");
-    }
-    
-    void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {
+        shaderProgram = glCreateProgram();
+        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
+        
+        glAttachShader(shaderProgram, vertexShader);
+        glAttachShader(shaderProgram, fragmentShader);
         
-        int location1 = glGetUniformLocation(shaderProgram, "La");
-        if (location1 >= 0) glUniform3fv(location1, 1, &La.x);
-        else printf("uniform La cannot be set\n");
+        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
+        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
+        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+        glBindAttribLocation(shaderProgram, 3, "instanceM");
+        glBindAttribLocation(shaderProgram, 7, "instanceInvM");
         
-        int location2 = glGetUniformLocation(shaderProgram, "Le");
-        if (location2 >= 0) glUniform3fv(location2, 1, &Le.x);
-        else printf("uniform Le cannot be set\n");
+        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
         
-        int location3 = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location3 >= 0) glUniform4fv(location3, 1, &worldLightPosition.v[0]);
-        else printf("uniform world light position cannot be set\n");
+        Link();
     }
     
-    void UploadEyePosition(vec3 wEye) {
-        int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
-        if (location >= 0) glUniform3fv(location, 1, &wEye.x);
-        else printf("uniform eye position cannot be set\n");
+    void UploadSamplerID()
+    {
+        int samplerUnit = 0;
+        SetUniform(uniformSamplerUnit, samplerUnit);
+        glState.ActiveTexture(samplerUnit);
+    }
+    
+    
+    void UploadSamplerCubeID() {
+        int samplerCube = 1;
+        SetUniform(uniformEnvironmentMap, samplerCube);
+        glState.ActiveTexture(samplerCube);
+
     }
 };
 
-class ShadowShader : public Shader
+// ShadowShader for instanced draws, M comes per instance from attributes 3-6
+class InstancedShadowShader : public Shader
 {
 public:
-    ShadowShader()
+    InstancedShadowShader()
     {
         const char *vertexSource = R"(
         #version 410
@@ -1234,28 +3048,24 @@ public:
         in vec3 vertexPosition;
         in vec2 vertexTexCoord;
         in vec3 vertexNormal;
-        uniform mat4 M, VP;
-        uniform vec4 worldLightPosition;
+        in mat4 instanceM;
+        // the cascade being drawn into; the members the receivers use follow it
+        layout(std140, row_major) uniform Shadow {
+            mat4 lightViewProjection;
+        };
         
         void main() {
-            vec4 p = vec4(vertexPosition, 1) * M;
-            vec3 s;
-            s.y = -0.999;
-            s.x = (p.x - worldLightPosition.x) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.x;
-            s.z = (p.z - worldLightPosition.z) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.z;
-            gl_Position = vec4(s, 1) * VP;
+            gl_Position = (instanceM * vec4(vertexPosition, 1)) * lightViewProjection;
         }
         )";
         
+        // only depth is written
         const char *fragmentSource = R"(
         #version 410
         precision highp float;
         
-        out vec4 fragmentColor;
-        
         void main()
         {
-            fragmentColor = vec4(0.0, 0.1, 0.0, 1);
         }
         )";
         
@@ -1282,32 +3092,11 @@ public:
         glBindAttribLocation(shaderProgram, 0, "vertexPosition");
         glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
         glBindAttribLocation(shaderProgram, 2, "vertexNormal");
+        glBindAttribLocation(shaderProgram, 3, "instanceM");
         
         glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
         
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
-    }
-    
-    void UploadM(mat4& M)
-    {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
-    }
-    
-    void UploadVP(mat4& VP)
-    {
-        int location = glGetUniformLocation(shaderProgram, "VP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, VP);
-        else printf("uniform VP cannot be set\n");
-    }
-    
-    void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition)
-    {
-        int location = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
-        else printf("uniform world light position cannot be set\n");
+        Link();
     }
 };
 
@@ -1375,25 +3164,16 @@ public:
         
         glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
         
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
+        Link();
     }
     
     
     void UploadSamplerCubeID() {
         int samplerCube = 1;
-        int location = glGetUniformLocation(shaderProgram, "environmentMap");
-        glUniform1i(location, samplerCube);
-        glActiveTexture(GL_TEXTURE0 + samplerCube);
+        SetUniform(uniformEnvironmentMap, samplerCube);
+        glState.ActiveTexture(samplerCube);
         
     }
-    
-    void UploadViewDirMatrix(mat4& viewDirMatrix) {
-        int location = glGetUniformLocation(shaderProgram, "viewDirMatrix");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, viewDirMatrix);
-        else printf("View direction matrix cannot be set\n");
-    }
-    
 };
 /**
 float snoise(vec3 r) {
@@ -1427,21 +3207,30 @@ class MarbleShader : public Shader
 public:
     MarbleShader()
     {
-        const char *vertexSource = R"(
+        // the Shadow block goes between the declarations and main
+        const char *vertexSources[] = { R"(
 #version 410
         precision highp float;
         in vec3 vertexPosition;
         in vec2 vertexTexCoord;
         in vec3 vertexNormal;
         uniform mat4 M, InvM, MVP;
-        uniform vec3 worldEyePosition;
-        uniform vec4 worldLightPosition;
+        layout(std140, row_major) uniform Camera {
+            mat4 viewMatrix, projectionMatrix, VP;
+            vec3 worldEyePosition;
+        };
+        layout(std140) uniform Light {
+            vec3 La, Le;
+            vec4 worldLightPosition;
+        };
         out vec2 texCoord;
         out vec3 position;
         out vec3 worldNormal;
         out vec3 worldView;
         out vec3 worldLight;
-        
+        out vec4 shadowPosition;
+        out vec3 shadowNormal;
+        )", shadowBlockSource, R"(
         void main() {
             texCoord = vertexTexCoord;
             vec4 worldPosition = vec4(vertexPosition, 1) * M;
@@ -1449,15 +3238,21 @@ public:
             worldLight  = worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w;
             worldView = worldEyePosition - worldPosition.xyz;
             worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz;
+            shadowPosition = worldPosition * lightRotation;
+            shadowNormal = (vec4(normalize(worldNormal), 0) * lightRotation).xyz;
             gl_Position = vec4(vertexPosition, 1) * MVP;
         }
-        )";
+        )" };
         
-        const char *fragmentSource = R"(
+        // the Shadow block and the shadow sampling go between the declarations and main
+        const char *fragmentSources[] = { R"(
 #version 410
         precision highp float;
         uniform samplerCube environmentMap;
-        uniform vec3 La, Le;
+        layout(std140) uniform Light {
+            vec3 La, Le;
+            vec4 worldLightPosition;
+        };
         uniform vec3 ka, kd, ks;
         uniform float shininess;
         in vec2 texCoord;
@@ -1465,8 +3260,10 @@ public:
         in vec3 worldNormal;
         in vec3 worldView;
         in vec3 worldLight;
+        in vec4 shadowPosition;
+        in vec3 shadowNormal;
         out vec4 fragmentColor;
-        
+        )", shadowBlockSource, shadowSamplingSource, R"(
         void main() {
             vec3 N = normalize(worldNormal);
             vec3 V = normalize(worldView);
@@ -1491,22 +3288,23 @@ public:
             w = pow(sin(w)*0.5+0.5, 4);
             vec3 marble = vec3(0, 0, 1) * w + vec3(1, 1, 1) * (1-w);
             
-            vec3 color = La * ka + Le * kd * marble * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess);
+            float visibility = ShadowVisibility(shadowPosition, shadowNormal);
+            vec3 color = La * ka + (Le * kd * marble * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess)) * visibility;
             fragmentColor = vec4(color, 1);
         }
-        )";
+        )" };
         
         unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
         if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
         
-        glShaderSource(vertexShader, 1, &vertexSource, NULL);
+        glShaderSource(vertexShader, 3, vertexSources, NULL);
         glCompileShader(vertexShader);
         checkShader(vertexShader, "Vertex shader error");
         
         unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
         if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
         
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+        glShaderSource(fragmentShader, 4, fragmentSources, NULL);
         glCompileShader(fragmentShader);
         checkShader(fragmentShader, "Fragment shader error");
         
@@ -1522,1236 +3320,5574 @@ public:
         
         glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
         
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
+        Link();
     }
     
     
     void UploadSamplerCubeID() {
         int samplerCube = 1;
-        int location = glGetUniformLocation(shaderProgram, "environmentMap");
-        glUniform1i(location, samplerCube);
-        glActiveTexture(GL_TEXTURE0 + samplerCube);
+        SetUniform(uniformEnvironmentMap, samplerCube);
+        glState.ActiveTexture(samplerCube);
         
     }
-    
-    void UploadM(mat4& M)
+};
+
+extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+
+// --no-mipmaps uploads each texture's full image alone with plain linear filtering, --anisotropy N
+// caps the anisotropic filter (1 turns it off); left at 0 it uses the driver's maximum, except on
+// software rasterizers, where anisotropic sampling costs more than the rest of the frame
+bool mipmapsEnabled = true;
+float maxAnisotropy = 0;
+
+// --no-cooked-textures ignores the .bctex files written by --cook-textures; they are decompressed on
+// the loader threads when the driver has no GL_EXT_texture_compression_s3tc or samples in software
+bool cookedTexturesEnabled = true;
+bool blockCompressionSupported = false;
+
+#ifndef GL_TEXTURE_MAX_ANISOTROPY_EXT
+#define GL_TEXTURE_MAX_ANISOTROPY_EXT 0x84FE
+#define GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT 0x84FF
+#endif
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#endif
+
+// whether the context lists the named extension; core profiles only report them one at a time
+bool HasExtension(const char* name)
+{
+    int nExtensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &nExtensions);
+    for(int i = 0; i < nExtensions; i++)
     {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
+        const char* extension = (const char*)glGetStringi(GL_EXTENSIONS, i);
+        if(extension && strcmp(extension, name) == 0) return true;
     }
+    return false;
+}
+
+// llvmpipe and the like sample in software, where anisotropic filtering and block decompression
+// cost more per frame than they save
+bool IsSoftwareRenderer()
+{
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+    return renderer && (strstr(renderer, "llvmpipe") || strstr(renderer, "softpipe") || strstr(renderer, "Software"));
+}
+
+const int maxMipLevels = 16;
+
+// sRGB decoding is one lookup per channel byte; encoding looks up linear values quantized finely
+// enough that every dark sRGB step still has its own entries
+struct SrgbTables
+{
+    static const int encodeSize = 16384;
     
-    void UploadInvM(mat4& InvM)
-    {
-        int location = glGetUniformLocation(shaderProgram, "InvM");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, InvM);
-        else printf("uniform InvM cannot be set\n");
-    }
+    float toLinear[256];
+    unsigned char fromLinear[encodeSize];
     
-    void UploadMVP(mat4& MVP)
+    SrgbTables()
     {
-        int location = glGetUniformLocation(shaderProgram, "MVP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
-        else printf("uniform MVP cannot be set\n");
-    }
-    
-    void UploadMaterialAttributes(vec3 ka, vec3 kd, vec3 ks, float shininess) {
-        
-        int location1 = glGetUniformLocation(shaderProgram, "ka");
-        if (location1 >= 0) glUniform3fv(location1, 1, &ka.x);
-        else printf("uniform ka cannot be set\n");
-        
-        int location2 = glGetUniformLocation(shaderProgram, "kd");
-        if (location2 >= 0) glUniform3fv(location2, 1, &kd.x);
-        else printf("uniform kd cannot be set\n");
-        
-        int location3 = glGetUniformLocation(shaderProgram, "ks");
-        if (location3 >= 0) glUniform3fv(location3, 1, &ks.x);
-        else printf("uniform ks cannot be set\n");
-        
-        int location4 = glGetUniformLocation(shaderProgram, "shininess");
-        if (location4 >= 0) glUniform1f(location4, shininess);
-        else printf("uniform shininess cannot be set\n");
-    }
-    
-    void UploadLightAttributes(vec3 La, vec3 Le, vec4 worldLightPosition) {
-        
-        int location1 = glGetUniformLocation(shaderProgram, "La");
-        if (location1 >= 0) glUniform3fv(location1, 1, &La.x);
-        else printf("uniform La cannot be set\n");
-        
-        int location2 = glGetUniformLocation(shaderProgram, "Le");
-        if (location2 >= 0) glUniform3fv(location2, 1, &Le.x);
-        else printf("uniform Le cannot be set\n");
-        
-        int location3 = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location3 >= 0) glUniform4fv(location3, 1, &worldLightPosition.v[0]);
-        else printf("uniform world light position cannot be set\n");
+        for(int i = 0; i < 256; i++)
+        {
+            float c = i / 255.0f;
+            toLinear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        }
+        for(int i = 0; i < encodeSize; i++)
+        {
+            float c = i / (float)(encodeSize - 1);
+            float s = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+            fromLinear[i] = (unsigned char)(s * 255.0f + 0.5f);
+        }
     }
     
-    void UploadEyePosition(vec3 wEye) {
-        int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
-        if (location >= 0) glUniform3fv(location, 1, &wEye.x);
-        else printf("uniform eye position cannot be set\n");
-    }
+    static const SrgbTables& Get() { static SrgbTables tables; return tables; }
 };
 
-extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+// runs work(firstRow, lastRow) over bands of rows through the loader's workers, in bands large enough
+// to be worth handing to another thread
+void ForEachRowBand(int rows, int rowPixels, const std::function<void(int, int)>& work)
+{
+    const int pixelsPerBand = 256 * 256;
+    int nBands = std::max(1, std::min(rows, (int)((long long)rows * rowPixels / pixelsPerBand)));
+    if(nBands == 1)
+    {
+        work(0, rows);
+        return;
+    }
+    loader.ParallelFor(nBands, [&](int band) { work(rows * band / nBands, rows * (band + 1) / nBands); });
+}
 
-class Texture
+// the mip filter works on premultiplied linear RGBA floats, so colors average by light and
+// transparent texels do not bleed their color into the edges of cut-outs
+void DecodeLinearRows(const unsigned char* image, int width, int nComponents, float* linear, int firstRow, int lastRow)
 {
-    unsigned int textureId;
-    
-public:
-    Texture(const std::string& inputFileName)
+    const SrgbTables& tables = SrgbTables::Get();
+    for(int y = firstRow; y < lastRow; y++)
     {
-        unsigned char* data;
-        int width; int height; int nComponents = 4;
-        
-        data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
-        
-        if(data == NULL)
+        const unsigned char* in = image + (size_t)y * width * nComponents;
+        float* out = linear + (size_t)y * width * 4;
+        for(int x = 0; x < width; x++, in += nComponents, out += 4)
         {
-            return;
+            float alpha = nComponents == 4 ? in[3] / 255.0f : 1.0f;
+            out[0] = tables.toLinear[in[0]] * alpha;
+            out[1] = tables.toLinear[in[1]] * alpha;
+            out[2] = tables.toLinear[in[2]] * alpha;
+            out[3] = alpha;
         }
-        
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
-        
-        if(nComponents == 3) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        if(nComponents == 4) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-        
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        
-        delete data;
     }
-    
-    void Bind()
+}
+
+void EncodeSrgbRows(const float* linear, int width, int nComponents, unsigned char* image, int firstRow, int lastRow)
+{
+    const SrgbTables& tables = SrgbTables::Get();
+    const float scale = SrgbTables::encodeSize - 1;
+    for(int y = firstRow; y < lastRow; y++)
     {
-        glBindTexture(GL_TEXTURE_2D, textureId);
-    }
-};
-
-class TextureCube {
-    unsigned int textureId;
-public:
-    TextureCube(
-                const std::string& inputFileName0, const std::string& inputFileName1, const std::string& inputFileName2,
-                const std::string& inputFileName3, const std::string& inputFileName4, const std::string& inputFileName5) {
-        unsigned char* data[6]; int width[6]; int height[6]; int nComponents[6]; std::string filename[6];
-        filename[0] = inputFileName0; filename[1] = inputFileName1; filename[2] = inputFileName2;
-        filename[3] = inputFileName3; filename[4] = inputFileName4; filename[5] = inputFileName5;
-        for(int i = 0; i < 6; i++) {
-            data[i] = stbi_load(filename[i].c_str(), &width[i], &height[i], &nComponents[i], 0);
-            if(data[i] == NULL) printf("Textures not loaded");
-            if(data == NULL) {
-                return;
-            }
-        }
-        glGenTextures(1, &textureId); glBindTexture(GL_TEXTURE_CUBE_MAP, textureId);
-        for(int i = 0; i < 6; i++) {
-            if(nComponents[i] == 4) glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGBA, width[i], height[i], 0, GL_RGBA, GL_UNSIGNED_BYTE, data[i]);
-            if(nComponents[i] == 3) glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width[i], height[i], 0, GL_RGB, GL_UNSIGNED_BYTE, data[i]);
+        const float* in = linear + (size_t)y * width * 4;
+        unsigned char* out = image + (size_t)y * width * nComponents;
+        for(int x = 0; x < width; x++, in += 4, out += nComponents)
+        {
+            float alpha = in[3];
+            float unpremultiply = alpha > 0 ? scale / alpha : 0;
+            for(int c = 0; c < 3; c++)
+                out[c] = tables.fromLinear[std::min((int)(in[c] * unpremultiply + 0.5f), SrgbTables::encodeSize - 1)];
+            if(nComponents == 4) out[3] = (unsigned char)(std::min(alpha, 1.0f) * 255.0f + 0.5f);
         }
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        for(int i = 0; i < 6; i++)  delete data[i];
     }
-    
-    void Bind() { glBindTexture(GL_TEXTURE_CUBE_MAP, textureId); }
-};
+}
 
-class Material
+// 2x2 box filter from one level to the next; an odd last row or column is averaged with itself
+void DownsampleRows(const float* source, int sourceWidth, int sourceHeight, float* target, int width, int firstRow, int lastRow)
 {
-    Shader* shader;
-    Texture* texture;
-    vec3 ka, kd, ks;
-    float shininess;
-    TextureCube* environmentMap;
-    
-public:
-    Material(Shader* s, vec3 ka, vec3 kd, vec3 ks, float shininess, Texture* texture = 0,
-             TextureCube* e = 0) :
-        shader(s), ka(ka), kd(kd), ks(ks), shininess(shininess), texture(texture), environmentMap(e){}
-    
-    Shader* GetShader() { return shader; }
-    
-    void UploadAttributes()
+    for(int y = firstRow; y < lastRow; y++)
     {
-        if(texture){
-            shader->UploadSamplerID();
-            texture->Bind();
-            shader->UploadMaterialAttributes(ka, kd, ks, shininess);
-        }
-        if(environmentMap){
-            shader->UploadSamplerCubeID();
-            environmentMap->Bind();
+        const float* row0 = source + (size_t)std::min(2 * y, sourceHeight - 1) * sourceWidth * 4;
+        const float* row1 = source + (size_t)std::min(2 * y + 1, sourceHeight - 1) * sourceWidth * 4;
+        float* out = target + (size_t)y * width * 4;
+        for(int x = 0; x < width; x++, out += 4)
+        {
+            int x0 = std::min(2 * x, sourceWidth - 1) * 4, x1 = std::min(2 * x + 1, sourceWidth - 1) * 4;
+#if defined(MATH_SSE)
+            __m128 sum = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(row0 + x0), _mm_loadu_ps(row0 + x1)),
+                                    _mm_add_ps(_mm_loadu_ps(row1 + x0), _mm_loadu_ps(row1 + x1)));
+            _mm_storeu_ps(out, _mm_mul_ps(sum, _mm_set1_ps(0.25f)));
+#elif defined(MATH_NEON)
+            float32x4_t sum = vaddq_f32(vaddq_f32(vld1q_f32(row0 + x0), vld1q_f32(row0 + x1)),
+                                        vaddq_f32(vld1q_f32(row1 + x0), vld1q_f32(row1 + x1)));
+            vst1q_f32(out, vmulq_n_f32(sum, 0.25f));
+#else
+            for(int c = 0; c < 4; c++) out[c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c]) * 0.25f;
+#endif
         }
     }
+}
+
+struct ImageLevel
+{
+    const unsigned char* data;
+    int width, height;
 };
 
-class Light
+// how the levels of a mip chain file are stored: bytes as decoded, or S3TC blocks of 4x4 texels
+enum TextureFormat { rawTexture, bc1Texture, bc3Texture };
+
+// header of a .mipcache or cooked .bctex file, followed by every level of the chain from the full
+// image down to 1x1, each starting on a 16 byte boundary
+struct MipCacheHeader
 {
-    vec3 La, Le;
-    vec4 worldLightPosition;
+    char magic[4];
+    unsigned int version;
+    long long sourceSize;
+    long long sourceModified;
+    unsigned long long sourceHash;
+    unsigned int width, height;
+    unsigned int nComponents;
+    unsigned int levelCount;
+    unsigned int format;            // TextureFormat
+    unsigned int reserved;
+    unsigned long long levelOffsets[maxMipLevels];
+};
+
+class MipCache
+{
+    static const unsigned int currentVersion = 2;
+    
+    MappedFile file;
+    const MipCacheHeader* header;
     
 public:
-    Light(vec3 La, vec3 Le, vec4 worldLightPosition):
-    La(La), Le(Le), worldLightPosition(worldLightPosition) {}
+    static std::string GetPath(const char* sourceFilename) { return std::string(sourceFilename) + ".mipcache"; }
+    static std::string GetCookedPath(const char* sourceFilename) { return std::string(sourceFilename) + ".bctex"; }
     
-    void UploadAttributes(Shader* shader)
+    static size_t GetLevelBytes(unsigned int format, int nComponents, int width, int height)
     {
-        shader->UploadLightAttributes(La, Le, worldLightPosition);
+        size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+        if(format == bc1Texture) return blocks * 8;
+        if(format == bc3Texture) return blocks * 16;
+        return (size_t)width * height * nComponents;
     }
     
-    void SetPointLightSource(vec3& pos) {
-        worldLightPosition = vec4(pos.x, pos.y, pos.z, 1);
-    }
+    // maps the cache and keeps it only if it was written by this version for exactly this source
+    MipCache(const std::string& path, const SourceFileStamp& source);
     
-    void SetDirectionalLightSource(vec3& dir) {
-        worldLightPosition = vec4(dir.x, dir.y, dir.z, 0);
-    }
+    bool IsValid() { return header != NULL; }
+    const MipCacheHeader& GetHeader() { return *header; }
+    const unsigned char* GetLevel(int level) { return (const unsigned char*)file.Begin() + header->levelOffsets[level]; }
+    
+    static bool Write(const std::string& path, const SourceFileStamp& source, const std::vector<ImageLevel>& levels, int nComponents, unsigned int format);
 };
 
-class Mesh
+MipCache::MipCache(const std::string& path, const SourceFileStamp& source) : file(path.c_str()), header(NULL)
 {
-    Geometry* geometry;
-    Material* material;
+    if(!file.IsOpen() || file.Size() < sizeof(MipCacheHeader)) return;
+    const MipCacheHeader* h = (const MipCacheHeader*)file.Begin();
+    
+    if(memcmp(h->magic, "MIPC", 4) != 0 || h->version != currentVersion) return;
+    if(h->sourceSize != source.size || h->sourceModified != source.modified || h->sourceHash != source.hash) return;
+    if((h->nComponents != 3 && h->nComponents != 4) || h->levelCount == 0 || h->levelCount > maxMipLevels) return;
+    if(h->format != rawTexture && h->format != (h->nComponents == 4 ? bc3Texture : bc1Texture)) return;
+    for(unsigned int i = 0; i < h->levelCount; i++)
+    {
+        int width = std::max((int)h->width >> i, 1), height = std::max((int)h->height >> i, 1);
+        if(h->levelOffsets[i] + GetLevelBytes(h->format, h->nComponents, width, height) > file.Size()) return;
+    }
     
-public:
-    Mesh(Geometry* g, Material* m)
+    header = h;
+}
+
+bool MipCache::Write(const std::string& path, const SourceFileStamp& source, const std::vector<ImageLevel>& levels, int nComponents, unsigned int format)
+{
+    MipCacheHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "MIPC", 4);
+    h.version = currentVersion;
+    h.sourceSize = source.size;
+    h.sourceModified = source.modified;
+    h.sourceHash = source.hash;
+    h.width = levels[0].width;
+    h.height = levels[0].height;
+    h.nComponents = nComponents;
+    h.levelCount = (unsigned int)levels.size();
+    h.format = format;
+    
+    unsigned long long offset = sizeof(MipCacheHeader);
+    for(size_t i = 0; i < levels.size(); i++)
     {
-        geometry = g;
-        material = m;
+        h.levelOffsets[i] = (offset + 15) & ~15ull;
+        offset = h.levelOffsets[i] + GetLevelBytes(format, nComponents, levels[i].width, levels[i].height);
     }
     
-    Shader* GetShader() { return material->GetShader(); }
+    // written under a temporary name so a reader never maps a half-written cache
+    std::string temporaryPath = path + ".tmp";
+    FILE* f = fopen(temporaryPath.c_str(), "wb");
+    if(!f) return false;
     
-    void Draw()
+    static const char zeros[16] = {0};
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    offset = sizeof(MipCacheHeader);
+    for(size_t i = 0; i < levels.size() && ok; i++)
     {
-        material->UploadAttributes();
-        geometry->Draw();
+        size_t levelBytes = GetLevelBytes(format, nComponents, levels[i].width, levels[i].height);
+        ok = fwrite(zeros, 1, h.levelOffsets[i] - offset, f) == h.levelOffsets[i] - offset;
+        ok = ok && fwrite(levels[i].data, 1, levelBytes, f) == levelBytes;
+        offset = h.levelOffsets[i] + levelBytes;
     }
-};
-
-class Camera {
-    vec3  wEye, wLookat, wVup;
-    float fov, asp, fp, bp;
-    
-    vec3 velocity;
-    float angularVelocity;
+    ok = (fclose(f) == 0) && ok;
     
-public:
-    Camera()
+    remove(path.c_str());
+    if(!ok || rename(temporaryPath.c_str(), path.c_str()) != 0)
     {
-        wEye = vec3(0.0, 0.0, 2.0);
-        wLookat = vec3(0.0, 0.0, 0.0);
-        wVup = vec3(0.0, 1.0, 0.0);
-        fov = M_PI / 4.0; asp = 1.0; fp = 0.01; bp = 10.0;
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline unsigned short PackRgb565(const float color[3])
+{
+    int r = std::min(std::max((int)(color[0] * (31.0f / 255.0f) + 0.5f), 0), 31);
+    int g = std::min(std::max((int)(color[1] * (63.0f / 255.0f) + 0.5f), 0), 63);
+    int b = std::min(std::max((int)(color[2] * (31.0f / 255.0f) + 0.5f), 0), 31);
+    return (unsigned short)((r << 11) | (g << 5) | b);
+}
+
+inline void UnpackRgb565(unsigned short packed, float color[3])
+{
+    int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+    color[0] = (float)((r << 3) | (r >> 2));
+    color[1] = (float)((g << 2) | (g >> 4));
+    color[2] = (float)((b << 3) | (b >> 2));
+}
+
+// picks the nearest of the four colors between two 565 endpoints for each texel of a block, given as
+// 16 reds, greens and blues; returns the squared error. The four colors lie on one line, so the nearest
+// is found by projecting each texel onto it, four texels at a time.
+float FitColorIndices(const float texels[3][16], unsigned short color0, unsigned short color1, unsigned int& indices)
+{
+    float palette[4][3];
+    UnpackRgb565(color0, palette[0]);
+    UnpackRgb565(color1, palette[1]);
+    for(int c = 0; c < 3; c++)
+    {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
     }
     
-    void SetAspectRatio(float a) { asp = a; }
+    float axis[3] = { palette[1][0] - palette[0][0], palette[1][1] - palette[0][1], palette[1][2] - palette[0][2] };
+    float length = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    float scale = length > 0 ? 3 / length : 0;
     
-    vec3 GetEyePosition()
+    float steps[16];
+#if defined(MATH_SSE)
+    __m128 ar = _mm_set1_ps(axis[0] * scale), ag = _mm_set1_ps(axis[1] * scale), ab = _mm_set1_ps(axis[2] * scale);
+    __m128 pr = _mm_set1_ps(palette[0][0]), pg = _mm_set1_ps(palette[0][1]), pb = _mm_set1_ps(palette[0][2]);
+    for(int i = 0; i < 16; i += 4)
     {
-        return wEye;
+        __m128 t = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(texels[0] + i), pr), ar);
+        t = _mm_add_ps(t, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(texels[1] + i), pg), ag));
+        t = _mm_add_ps(t, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(texels[2] + i), pb), ab));
+        t = _mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), _mm_set1_ps(3.0f));
+        _mm_storeu_ps(steps + i, t);
     }
-    
-    mat4 GetViewMatrix()
+#elif defined(MATH_NEON)
+    float32x4_t pr = vdupq_n_f32(palette[0][0]), pg = vdupq_n_f32(palette[0][1]), pb = vdupq_n_f32(palette[0][2]);
+    for(int i = 0; i < 16; i += 4)
     {
-        vec3 w = (wEye - wLookat).normalize();
-        vec3 u = cross(wVup, w).normalize();
-        vec3 v = cross(w, u);
-        
-        return
-        mat4(
-             1.0f,    0.0f,    0.0f,    0.0f,
-             0.0f,    1.0f,    0.0f,    0.0f,
-             0.0f,    0.0f,    1.0f,    0.0f,
-             -wEye.x, -wEye.y, -wEye.z, 1.0f ) *
-        mat4(
-             u.x,  v.x,  w.x,  0.0f,
-             u.y,  v.y,  w.y,  0.0f,
-             u.z,  v.z,  w.z,  0.0f,
-             0.0f, 0.0f, 0.0f, 1.0f );
+        float32x4_t t = vmulq_n_f32(vsubq_f32(vld1q_f32(texels[0] + i), pr), axis[0] * scale);
+        t = vaddq_f32(t, vmulq_n_f32(vsubq_f32(vld1q_f32(texels[1] + i), pg), axis[1] * scale));
+        t = vaddq_f32(t, vmulq_n_f32(vsubq_f32(vld1q_f32(texels[2] + i), pb), axis[2] * scale));
+        t = vminq_f32(vmaxq_f32(t, vdupq_n_f32(0.0f)), vdupq_n_f32(3.0f));
+        vst1q_f32(steps + i, t);
     }
-    
-    mat4 GetProjectionMatrix()
+#else
+    for(int i = 0; i < 16; i++)
     {
-        float sy = 1/tan(fov/2);
-        return mat4(
-                    sy/asp, 0.0f,  0.0f,               0.0f,
-                    0.0f,   sy,    0.0f,               0.0f,
-                    0.0f,   0.0f, -(fp+bp)/(bp - fp), -1.0f,
-                    0.0f,   0.0f, -2*fp*bp/(bp - fp),  0.0f);
+        float t = ((texels[0][i] - palette[0][0]) * axis[0] + (texels[1][i] - palette[0][1]) * axis[1] + (texels[2][i] - palette[0][2]) * axis[2]) * scale;
+        steps[i] = std::min(std::max(t, 0.0f), 3.0f);
     }
+#endif
     
-    mat4 GetInverseViewMatrix() {
-        vec3 w = (wEye - wLookat).normalize();
-        vec3 u = cross(wVup, w).normalize();
-        vec3 v = cross(w, u);
-        return mat4(
-                    u.x,  u.y,  u.z,  0.0f,
-                    v.x,  v.y,  v.z,  0.0f,
-                    w.x,  w.y,  w.z,  0.0f,
-                    0.0f, 0.0f, 0.0f, 1.0f );
+    // steps along the line from color0 run through the indices 0, 2, 3, 1
+    static const unsigned int stepIndex[4] = { 0, 2, 3, 1 };
+    float error = 0;
+    indices = 0;
+    for(int i = 0; i < 16; i++)
+    {
+        unsigned int index = stepIndex[(int)(steps[i] + 0.5f)];
+        indices |= index << (2 * i);
+        for(int c = 0; c < 3; c++)
+        {
+            float d = texels[c][i] - palette[index][c];
+            error += d * d;
+        }
+    }
+    return error;
+}
+
+// endpoints along the principal axis of the block's colors, then refit once by least squares to the
+// indices they gave; always in the four color mode, which BC3 requires
+void EncodeColorBlock(const float texels[3][16], unsigned char* block)
+{
+    float mean[3] = { 0, 0, 0 };
+    for(int c = 0; c < 3; c++)
+    {
+        for(int i = 0; i < 16; i++) mean[c] += texels[c][i];
+        mean[c] /= 16;
+    }
+    float covariance[6] = { 0, 0, 0, 0, 0, 0 };
+    for(int i = 0; i < 16; i++)
+    {
+        float r = texels[0][i] - mean[0], g = texels[1][i] - mean[1], b = texels[2][i] - mean[2];
+        covariance[0] += r * r; covariance[1] += r * g; covariance[2] += r * b;
+        covariance[3] += g * g; covariance[4] += g * b; covariance[5] += b * b;
     }
     
-    mat4 GetInverseProjectionMatrix() {
-        float sy = 1/tan(fov/2);
-        return mat4(
-                    asp/sy,        0.0f,        0.0f,        0.0f,
-                    0.0f,        1.0/sy,        0.0f,        0.0f,
-                    0.0f,        0.0f,        0.0f,        (fp - bp) / 2.0 / fp / bp,
-                    0.0f,        0.0f,        -1.0f,        (fp + bp) / 2.0 / fp / bp);
+    // a few rounds of power iteration find the axis well enough for 565 endpoints
+    float axis[3] = { 1, 1, 1 };
+    for(int iteration = 0; iteration < 4; iteration++)
+    {
+        float x = covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2];
+        float y = covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2];
+        float z = covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2];
+        float length = std::max(fabsf(x), std::max(fabsf(y), fabsf(z)));
+        if(length == 0) break;
+        axis[0] = x / length; axis[1] = y / length; axis[2] = z / length;
     }
     
-    vec3 GetAhead()
+    float low = 0, high = 0;
+    for(int i = 0; i < 16; i++)
     {
-        return (wLookat - wEye).normalize();
+        float t = (texels[0][i] - mean[0]) * axis[0] + (texels[1][i] - mean[1]) * axis[1] + (texels[2][i] - mean[2]) * axis[2];
+        low = std::min(low, t);
+        high = std::max(high, t);
+    }
+    float axisLength = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+    float inset = (high - low) / 16;
+    float end0[3], end1[3];
+    for(int c = 0; c < 3; c++)
+    {
+        end0[c] = mean[c] + axis[c] * (high - inset) / std::max(axisLength, 1e-6f);
+        end1[c] = mean[c] + axis[c] * (low + inset) / std::max(axisLength, 1e-6f);
     }
     
-    void Control()
+    unsigned short color0 = PackRgb565(end0), color1 = PackRgb565(end1);
+    if(color0 < color1) std::swap(color0, color1);
+    unsigned int indices = 0;
+    float error = color0 == color1 ? 0 : FitColorIndices(texels, color0, color1, indices);
+    
+    if(color0 != color1)
     {
-        if(keyboardState['w'])
+        static const float weight0[4] = { 1, 0, 2.0f / 3, 1.0f / 3 };
+        float aa = 0, bb = 0, ab = 0, ax[3] = { 0, 0, 0 }, bx[3] = { 0, 0, 0 };
+        for(int i = 0; i < 16; i++)
         {
-            velocity = GetAhead() * 2.0;
-            return;
+            float w = weight0[(indices >> (2 * i)) & 3];
+            aa += w * w; bb += (1 - w) * (1 - w); ab += w * (1 - w);
+            for(int c = 0; c < 3; c++) { ax[c] += w * texels[c][i]; bx[c] += (1 - w) * texels[c][i]; }
         }
-        
-        if(keyboardState['s'])
+        float determinant = aa * bb - ab * ab;
+        if(fabsf(determinant) > 1e-6f)
         {
-            velocity = GetAhead() * (-2.0);
-            return;
+            for(int c = 0; c < 3; c++)
+            {
+                end0[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+                end1[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+            }
+            unsigned short refit0 = PackRgb565(end0), refit1 = PackRgb565(end1);
+            if(refit0 < refit1) std::swap(refit0, refit1);
+            unsigned int refitIndices;
+            if(refit0 != refit1 && FitColorIndices(texels, refit0, refit1, refitIndices) < error)
+            {
+                color0 = refit0; color1 = refit1; indices = refitIndices;
+            }
         }
-        
-        if(keyboardState['d'])
+    }
+    
+    block[0] = color0 & 0xFF; block[1] = color0 >> 8;
+    block[2] = color1 & 0xFF; block[3] = color1 >> 8;
+    for(int i = 0; i < 4; i++) block[4 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+// alpha between the block's smallest and largest value, in the eight step mode, so fully opaque
+// and fully transparent texels stay exact
+void EncodeAlphaBlock(const float alphas[16], unsigned char* block)
+{
+    float low = 255, high = 0;
+    for(int i = 0; i < 16; i++) { low = std::min(low, alphas[i]); high = std::max(high, alphas[i]); }
+    int alpha0 = (int)(high + 0.5f), alpha1 = (int)(low + 0.5f);
+    
+    unsigned long long indices = 0;
+    if(alpha0 > alpha1)
+    {
+        float scale = 7.0f / (alpha0 - alpha1);
+        for(int i = 0; i < 16; i++)
         {
-            angularVelocity = 20.0;
-            return;
+            // 7 steps from alpha1 land on index 0 (alpha0), none on index 1 (alpha1), the rest count down from 7
+            int step = std::min(std::max((int)((alphas[i] - alpha1) * scale + 0.5f), 0), 7);
+            unsigned long long index = step == 7 ? 0 : step == 0 ? 1 : 8 - step;
+            indices |= index << (3 * i);
         }
-        
-        if(keyboardState['a'])
+    }
+    block[0] = (unsigned char)alpha0;
+    block[1] = (unsigned char)alpha1;
+    for(int i = 0; i < 6; i++) block[2 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+void DecodeColorBlock(const unsigned char* block, bool allowTransparent, unsigned char texels[16][4])
+{
+    unsigned short color0 = block[0] | (block[1] << 8), color1 = block[2] | (block[3] << 8);
+    float palette[4][4];
+    UnpackRgb565(color0, palette[0]);
+    UnpackRgb565(color1, palette[1]);
+    palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+    for(int c = 0; c < 3; c++)
+    {
+        if(color0 > color1 || !allowTransparent)
         {
-            angularVelocity = -20.0;
-            return;
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+        else
+        {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
         }
-        
-        angularVelocity = 0.0;
-        velocity = vec3(0.0, 0.0, 0.0);
     }
+    if(color0 <= color1 && allowTransparent) palette[3][3] = 0;
     
-    void Move(float dt)
+    unsigned int indices = block[4] | (block[5] << 8) | (block[6] << 16) | ((unsigned int)block[7] << 24);
+    for(int i = 0; i < 16; i++)
+        for(int c = 0; c < 4; c++) texels[i][c] = (unsigned char)(palette[(indices >> (2 * i)) & 3][c] + 0.5f);
+}
+
+void DecodeAlphaBlock(const unsigned char* block, unsigned char texels[16][4])
+{
+    int alpha0 = block[0], alpha1 = block[1];
+    int palette[8] = { alpha0, alpha1 };
+    for(int i = 1; i < 7; i++)
+        palette[i + 1] = alpha0 > alpha1 ? ((7 - i) * alpha0 + i * alpha1 + 3) / 7 : i < 5 ? ((5 - i) * alpha0 + i * alpha1 + 2) / 5 : (i == 5 ? 0 : 255);
+    
+    unsigned long long indices = 0;
+    for(int i = 0; i < 6; i++) indices |= (unsigned long long)block[2 + i] << (8 * i);
+    for(int i = 0; i < 16; i++) texels[i][3] = (unsigned char)palette[(indices >> (3 * i)) & 7];
+}
+
+// encodes one level into BC1 (three components) or BC3 (four) blocks, bands of block rows in parallel;
+// blocks past the edge of a small level repeat its last row and column
+void CompressLevel(const ImageLevel& level, int nComponents, unsigned char* blocks)
+{
+    int blocksWide = (level.width + 3) / 4, blocksHigh = (level.height + 3) / 4;
+    size_t blockBytes = nComponents == 4 ? 16 : 8;
+    ForEachRowBand(blocksHigh, blocksWide * 16, [&](int firstRow, int lastRow) {
+        for(int by = firstRow; by < lastRow; by++)
+            for(int bx = 0; bx < blocksWide; bx++)
+            {
+                float texels[4][16];
+                for(int i = 0; i < 16; i++)
+                {
+                    int x = std::min(bx * 4 + i % 4, level.width - 1), y = std::min(by * 4 + i / 4, level.height - 1);
+                    const unsigned char* texel = level.data + ((size_t)y * level.width + x) * nComponents;
+                    for(int c = 0; c < nComponents; c++) texels[c][i] = texel[c];
+                }
+                unsigned char* block = blocks + ((size_t)by * blocksWide + bx) * blockBytes;
+                if(nComponents == 4)
+                {
+                    EncodeAlphaBlock(texels[3], block);
+                    block += 8;
+                }
+                EncodeColorBlock(texels, block);
+            }
+    });
+}
+
+// the CPU fallback for drivers without S3TC, and what the cooker checks its output against
+void DecompressLevel(const unsigned char* blocks, int width, int height, int nComponents, unsigned char* image)
+{
+    int blocksWide = (width + 3) / 4, blocksHigh = (height + 3) / 4;
+    size_t blockBytes = nComponents == 4 ? 16 : 8;
+    ForEachRowBand(blocksHigh, blocksWide * 16, [&](int firstRow, int lastRow) {
+        for(int by = firstRow; by < lastRow; by++)
+            for(int bx = 0; bx < blocksWide; bx++)
+            {
+                const unsigned char* block = blocks + ((size_t)by * blocksWide + bx) * blockBytes;
+                unsigned char texels[16][4];
+                if(nComponents == 4)
+                {
+                    DecodeColorBlock(block + 8, false, texels);
+                    DecodeAlphaBlock(block, texels);
+                }
+                else DecodeColorBlock(block, true, texels);
+                
+                for(int i = 0; i < 16; i++)
+                {
+                    int x = bx * 4 + i % 4, y = by * 4 + i / 4;
+                    if(x < width && y < height) memcpy(image + ((size_t)y * width + x) * nComponents, texels[i], nComponents);
+                }
+            }
+    });
+}
+
+// CPU half of an image load: Read may run on any thread, the texture uploads the result on the GL thread;
+// a mipmapped load comes with its whole chain, and any load takes a current cooked .bctex over the image
+struct ImageLoad
+{
+    std::string filename;
+    bool mipmapped;
+    unsigned char* data;                // level 0
+    int width, height, nComponents;
+    unsigned int format;                // TextureFormat of every level
+    std::vector<ImageLevel> levels;     // level 0 alone unless mipmapped
+    unsigned char* decoded;             // owned by stb_image, NULL when the levels are in a cache
+    std::vector<unsigned char> generated;
+    MipCache* cache;
+    
+    ImageLoad(const std::string& filename, bool mipmapped) : filename(filename), mipmapped(mipmapped), data(NULL), width(0), height(0), nComponents(0), format(rawTexture), decoded(NULL), cache(NULL) {}
+    ~ImageLoad() { if(decoded) stbi_image_free(decoded); delete cache; }
+    
+    void Read();
+    bool ReadCache(const std::string& path, const SourceFileStamp& source);
+    bool Decode();
+    void GenerateMips();
+    void Decompress();
+};
+
+void ImageLoad::Read()
+{
+    SourceFileStamp source;
+    bool stamped = source.Read(filename.c_str());
+    if(stamped && cookedTexturesEnabled && ReadCache(MipCache::GetCookedPath(filename.c_str()), source))
     {
-        wEye = wEye + velocity * dt;
-        wLookat = wLookat + velocity * dt;
-        
-        vec3 w = (wLookat - wEye);
-        float l = w.length();
-        w = w.normalize();
-        vec3 v = wVup.normalize();
-        vec3 u = cross(w, v);
-        
-        float alpha = (angularVelocity * dt) * M_PI / 180.0;
-        
-        wLookat = wEye + (w * cos(alpha) + u * sin(alpha)) * l;
-    }
-    
-    void MoveHelicam(vec3 pos, float orient, float dt) {
-        //force = force + 4*dt;
-        //acceleration = force*invMass;
-        //speed = speed - acceleration * dt;
-    
-        float radians = orient * (M_PI/180);
-        wEye = pos + vec3(2*cosf(radians), 2, 2*sinf(radians));
-        wLookat = pos + vec3(0, 1.5, 0);
+        if(!blockCompressionSupported) Decompress();
+        return;
     }
+    if(stamped && mipmapped && ReadCache(MipCache::GetPath(filename.c_str()), source)) return;
     
-    void UploadAttributes(Shader *shader)
+    if(!Decode()) return;
+    if(mipmapped && (nComponents == 3 || nComponents == 4))
     {
-        shader->UploadEyePosition(wEye);
+        GenerateMips();
+        MipCache::Write(MipCache::GetPath(filename.c_str()), source, levels, nComponents, rawTexture);
     }
-    
-    
-};
-
-Camera camera;
-vec3 wEye = camera.GetEyePosition();
-Light light = Light(vec3(1, 1, 1), vec3(1, 1, 1), vec4(0.1, 0.1, 0.1, 0.0));
+}
 
-class Environment : public Geometry
+// takes the levels from a valid cache, keeping it mapped until the upload
+bool ImageLoad::ReadCache(const std::string& path, const SourceFileStamp& source)
 {
-    unsigned int vbo;
-    EnvironmentShader *shader;
-    TextureCube *environmentMap;
-    
-public:
-    Environment(EnvironmentShader *s, TextureCube *e)
+    cache = new MipCache(path, source);
+    if(!cache->IsValid())
     {
-        shader = s;
-        environmentMap = e;
-        
-        glBindVertexArray(vao);
-        glGenBuffers(1, &vbo);
-        
-        glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        static float vertexCoords[] =     {
-            -1,    -1,     0,     1,
-            1,     -1,     0,     1,
-            -1,      1,     0,     1,
-            1,      1,     0,     1    };
-        
-        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+        delete cache;
+        cache = NULL;
+        return false;
     }
     
-    void Draw()
+    const MipCacheHeader& header = cache->GetHeader();
+    width = header.width; height = header.height; nComponents = header.nComponents; format = header.format;
+    for(unsigned int i = 0; i < (mipmapped ? header.levelCount : 1); i++)
     {
-        shader->Run();
-        environmentMap->Bind();
-        mat4 viewDirMatrix = camera.GetInverseProjectionMatrix() * camera.GetInverseViewMatrix();
-        shader->UploadViewDirMatrix(viewDirMatrix);
-        glEnable(GL_DEPTH_TEST);
-        glEnable(GL_BLEND);
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-        glDisable(GL_BLEND);
-        glDisable(GL_DEPTH_TEST);
+        ImageLevel level = { cache->GetLevel(i), std::max(width >> i, 1), std::max(height >> i, 1) };
+        levels.push_back(level);
     }
-};
+    data = (unsigned char*)levels[0].data;
+    return true;
+}
 
-class Object{
-    Shader* shader;
-    Mesh *mesh;
-    vec3 position;
-    vec3 scaling;
-    float orientation;
+bool ImageLoad::Decode()
+{
+    data = decoded = stbi_load(filename.c_str(), &width, &height, &nComponents, 0);
+    if(data == NULL) return false;
     
-public:
-    Object(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) : position(position), scaling(scaling), orientation(orientation)
+    ImageLevel level = { data, width, height };
+    levels.push_back(level);
+    return true;
+}
+
+// turns block-compressed levels back into bytes, for drivers that cannot sample them
+void ImageLoad::Decompress()
+{
+    size_t totalBytes = 0;
+    for(size_t i = 0; i < levels.size(); i++) totalBytes += (size_t)levels[i].width * levels[i].height * nComponents;
+    generated.resize(totalBytes);
+    
+    unsigned char* out = generated.data();
+    for(size_t i = 0; i < levels.size(); i++)
     {
-        shader = m->GetShader();
-        mesh = m;
+        DecompressLevel(levels[i].data, levels[i].width, levels[i].height, nComponents, out);
+        levels[i].data = out;
+        out += (size_t)levels[i].width * levels[i].height * nComponents;
+    }
+    data = generated.data();
+    format = rawTexture;
+}
+
+// fills in the levels below the decoded image, each filtered from the float copy of the one above so
+// the chain only rounds once per level
+void ImageLoad::GenerateMips()
+{
+    size_t generatedBytes = 0;
+    int levelCount = 1;
+    for(int w = width, h = height; (w > 1 || h > 1) && levelCount < maxMipLevels; levelCount++)
+    {
+        w = std::max(w / 2, 1); h = std::max(h / 2, 1);
+        generatedBytes += (size_t)w * h * nComponents;
     }
+    generated.resize(generatedBytes);
     
-    virtual void UploadAttributes(Shader* s) {}
-    virtual vec3& GetPosition() { return position; }
-    virtual float GetOrientation() { return orientation; }
-    virtual void Move(float dt) {}
-    virtual void PushedBy(float dt, Object* o) {}
-    virtual void DrawSpotlight() {}
-    virtual void Roll(float dt, Object* o, int index) {}
-    virtual void SetAheadOrientation(float orient) {}
+    std::vector<float> source((size_t)width * height * 4), target;
+    ForEachRowBand(height, width, [&](int firstRow, int lastRow) {
+        DecodeLinearRows(data, width, nComponents, source.data(), firstRow, lastRow);
+    });
     
-    void Draw()
+    unsigned char* out = generated.data();
+    for(int i = 1; i < levelCount; i++)
     {
-        shader->Run();
-        UploadAttributes(shader);
-        light.UploadAttributes(shader);
-        camera.UploadAttributes(shader);
-        mesh->Draw();
+        const ImageLevel& above = levels[i - 1];
+        ImageLevel level = { out, std::max(above.width / 2, 1), std::max(above.height / 2, 1) };
+        target.resize((size_t)level.width * level.height * 4);
+        ForEachRowBand(level.height, level.width, [&](int firstRow, int lastRow) {
+            DownsampleRows(source.data(), above.width, above.height, target.data(), level.width, firstRow, lastRow);
+            EncodeSrgbRows(target.data(), level.width, nComponents, out, firstRow, lastRow);
+        });
+        levels.push_back(level);
+        out += (size_t)level.width * level.height * nComponents;
+        source.swap(target);
     }
+}
+
+// uploads one level of a load to target, as blocks when it is S3TC compressed; returns the bytes it takes
+size_t UploadImageLevel(unsigned int target, int index, ImageLoad& load)
+{
+    const ImageLevel& level = load.levels[index];
+    size_t bytes = MipCache::GetLevelBytes(load.format, load.nComponents, level.width, level.height);
     
-    void DrawShadow(Shader* shadowShader)
+    if(load.format == bc1Texture) glCompressedTexImage2D(target, index, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, level.width, level.height, 0, (int)bytes, level.data);
+    else if(load.format == bc3Texture) glCompressedTexImage2D(target, index, GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, level.width, level.height, 0, (int)bytes, level.data);
+    else
     {
-        shadowShader->Run();
-        
-        UploadAttributes(shadowShader);
-        
-        vec3 source = vec3(9, 20, 9);
-        light.SetDirectionalLightSource(source);
-        //light.SetPointLightSource(source);
-        light.UploadAttributes(shadowShader);
-        
-        camera.UploadAttributes(shadowShader);
-        
-        mesh->Draw();
-        
+        // the small levels have rows that are not a multiple of four bytes
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        if(load.nComponents == 3) glTexImage2D(target, index, GL_RGB, level.width, level.height, 0, GL_RGB, GL_UNSIGNED_BYTE, level.data);
+        else if(load.nComponents == 4) glTexImage2D(target, index, GL_RGBA, level.width, level.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, level.data);
+        else bytes = 0;
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
     }
-    
-};
+    return bytes;
+}
 
-class AvatarObject: public Object
+class Texture
 {
-    Shader* shader;
-    Mesh *mesh;
-    vec3 position;
-    vec3 scaling;
-    float orientation;
+    unsigned int textureId;
+    size_t bytes;
+    
+    // bound in place of textures whose image has not arrived yet
+    static unsigned int GetPlaceholder()
+    {
+        static unsigned int placeholderId = 0;
+        if(!placeholderId)
+        {
+            static const unsigned char grey[4] = {128, 128, 128, 255};
+            glGenTextures(1, &placeholderId);
+            glBindTexture(GL_TEXTURE_2D, placeholderId);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+        return placeholderId;
+    }
     
 public:
-    AvatarObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
-    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    // shows the placeholder until Upload gives it an image
+    Texture()
     {
-        shader = m->GetShader();
-        mesh = m;
+        textureId = 0;
+        bytes = 0;
     }
     
-    void UploadAttributes(Shader* s)
+    Texture(const std::string& inputFileName)
     {
-        mat4 T = mat4(
-                      1.0,            0.0,            0.0,            0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      0.0,            0.0,            1.0,            0.0,
-                      position.x,        position.y,        position.z,        1.0);
-        
-        mat4 InvT = mat4(
-                         1.0,            0.0,            0.0,            0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         0.0,            0.0,            1.0,            0.0,
-                         -position.x,    -position.y,    -position.z,    1.0);
-        
-        mat4 S = mat4(
-                      scaling.x,        0.0,            0.0,            0.0,
-                      0.0,            scaling.y,        0.0,            0.0,
-                      0.0,            0.0,            scaling.z,        0.0,
-                      0.0,            0.0,            0.0,            1.0);
-        
-        mat4 InvS = mat4(
-                         1.0/scaling.x,    0.0,            0.0,            0.0,
-                         0.0,            1.0/scaling.y,    0.0,            0.0,
-                         0.0,            0.0,            1.0/scaling.z,    0.0,
-                         0.0,            0.0,            0.0,            1.0);
-        
-        float alpha = orientation / 180.0 * M_PI;
-        
-        mat4 R = mat4(
-                      cos(alpha),        0.0,            sin(alpha),        0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      -sin(alpha),    0.0,            cos(alpha),        0.0,
-                      0.0,            0.0,            0.0,            1.0);
+        textureId = 0;
+        bytes = 0;
         
-        mat4 InvR = mat4(
-                         cos(alpha),        0.0,            -sin(alpha),    0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         sin(alpha),        0.0,            cos(alpha),        0.0,
-                         0.0,            0.0,            0.0,            1.0);
-        
-        mat4 M = S * R * T;
-        mat4 InvM = InvT * InvR * InvS;
-        
-        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        mat4 VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        
-        s->UploadM(M);
-        s->UploadInvM(InvM);
-        s->UploadMVP(MVP);
-        s->UploadVP(VP);
+        ImageLoad load(inputFileName, mipmapsEnabled);
+        load.Read();
+        Upload(load);
     }
     
-    void DrawSpotlight() {
-        shader->Run();
-        UploadAttributes(shader);
+    // uploads every level the load brings; a full chain is sampled trilinearly, and anisotropically
+    // where the driver has GL_EXT_texture_filter_anisotropic
+    void Upload(ImageLoad& load)
+    {
+        if(load.data == NULL)
+        {
+            return;
+        }
         
-        vec3 source = position+vec3(0, 2, 0);
-        light.SetPointLightSource(source);
-        light.UploadAttributes(shader);
+        glGenTextures(1, &textureId);
+        glBindTexture(GL_TEXTURE_2D, textureId);
         
-        camera.UploadAttributes(shader);
-        mesh->Draw();
+        bytes = 0;
+        for(size_t i = 0; i < load.levels.size(); i++) bytes += UploadImageLevel(GL_TEXTURE_2D, (int)i, load);
+        
+        int levelCount = (int)load.levels.size();
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, std::max(levelCount - 1, 0));
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, levelCount > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        if(levelCount > 1 && GetAnisotropy() > 1) glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAX_ANISOTROPY_EXT, GetAnisotropy());
+        
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
     }
     
-    vec3& GetPosition() { return position; }
-    
-    float GetOrientation() { return orientation; }
-    
-    void Move(float dt) {
-        float radians = orientation * (M_PI/180);
-        if (keyboardState['w']) {
-            position.x = position.x - dt * cos(radians);
-            position.z = position.z - dt * sin(radians);
-        }
-        if (keyboardState['s']) {
-            position.x = position.x + dt * cos(radians);
-            position.z = position.z + dt * sin(radians);
-        }
-        if (keyboardState['a']) {
-            orientation = orientation - dt*50;
-        }
-        if (keyboardState['d']) {
-            orientation = orientation + dt*50;
+    // the driver's limit, capped by --anisotropy; 1 without the extension
+    static float GetAnisotropy()
+    {
+        static float supported = 0;
+        static bool software = false;
+        if(supported == 0)
+        {
+            supported = 1;
+            if(HasExtension("GL_EXT_texture_filter_anisotropic") || HasExtension("GL_ARB_texture_filter_anisotropic"))
+                glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &supported);
+            software = IsSoftwareRenderer();
         }
+        if(maxAnisotropy > 0) return std::max(1.0f, std::min(supported, maxAnisotropy));
+        return software ? 1.0f : supported;
     }
-
-    
-};
-
-class BackgroundObject: public Object
-{
-    Shader* shader;
-    Mesh *mesh;
-    vec3 position;
-    vec3 scaling;
-    float orientation;
     
-public:
-    BackgroundObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
-    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    ~Texture()
     {
-        shader = m->GetShader();
-        mesh = m;
+        if(textureId) glDeleteTextures(1, &textureId);
     }
     
-    void UploadAttributes(Shader* s)
+    size_t GetBytes() { return bytes; }
+    unsigned int GetId() { return textureId; }
+    
+    void Bind()
     {
-        mat4 T = mat4(
-                      1.0,            0.0,            0.0,            0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      0.0,            0.0,            1.0,            0.0,
-                      position.x,        position.y,        position.z,        1.0);
-        
-        mat4 InvT = mat4(
-                         1.0,            0.0,            0.0,            0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         0.0,            0.0,            1.0,            0.0,
-                         -position.x,    -position.y,    -position.z,    1.0);
-        
-        mat4 S = mat4(
-                      scaling.x,        0.0,            0.0,            0.0,
-                      0.0,            scaling.y,        0.0,            0.0,
-                      0.0,            0.0,            scaling.z,        0.0,
-                      0.0,            0.0,            0.0,            1.0);
-        
-        mat4 InvS = mat4(
-                         1.0/scaling.x,    0.0,            0.0,            0.0,
-                         0.0,            1.0/scaling.y,    0.0,            0.0,
-                         0.0,            0.0,            1.0/scaling.z,    0.0,
-                         0.0,            0.0,            0.0,            1.0);
-        
-        float alpha = orientation / 180.0 * M_PI;
-        
-        mat4 R = mat4(
-                      cos(alpha),        0.0,            sin(alpha),        0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      -sin(alpha),    0.0,            cos(alpha),        0.0,
-                      0.0,            0.0,            0.0,            1.0);
-        
-        mat4 InvR = mat4(
-                         cos(alpha),        0.0,            -sin(alpha),    0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         sin(alpha),        0.0,            cos(alpha),        0.0,
-                         0.0,            0.0,            0.0,            1.0);
-        
-        mat4 M = S * R * T;
-        mat4 InvM = InvT * InvR * InvS;
-        
-        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        mat4 VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        
-        s->UploadM(M);
-        s->UploadInvM(InvM);
-        s->UploadMVP(MVP);
-        s->UploadVP(VP);
+        glState.BindTexture(GL_TEXTURE_2D, textureId ? textureId : GetPlaceholder());
     }
-    
-    vec3& GetPosition() { return position; }
 };
 
-class RoundObject: public Object
-{
-    Shader* shader;
-    Mesh *mesh;
-    vec3 position;
-    vec3 scaling;
-    float orientation;
-    float rollAngle = 0;
-    vec3 u = vec3(0, 0, 0);
+class TextureCube {
+    unsigned int textureId;
     
-public:
-    RoundObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
-    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    struct CubeLoad
     {
-        shader = m->GetShader();
-        mesh = m;
-    }
+        ImageLoad* faces[6];
+        ~CubeLoad() { for(int i = 0; i < 6; i++) delete faces[i]; }
+    };
     
-    void UploadAttributes(Shader* s)
-    {
-        mat4 T = mat4(
-                      1.0,            0.0,            0.0,            0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      0.0,            0.0,            1.0,            0.0,
-                      position.x,        position.y,        position.z,        1.0);
-        
-        mat4 InvT = mat4(
-                         1.0,            0.0,            0.0,            0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         0.0,            0.0,            1.0,            0.0,
-                         -position.x,    -position.y,    -position.z,    1.0);
-        
-        mat4 S = mat4(
-                      scaling.x,        0.0,            0.0,            0.0,
-                      0.0,            scaling.y,        0.0,            0.0,
-                      0.0,            0.0,            scaling.z,        0.0,
-                      0.0,            0.0,            0.0,            1.0);
-        
-        mat4 InvS = mat4(
-                         1.0/scaling.x,    0.0,            0.0,            0.0,
-                         0.0,            1.0/scaling.y,    0.0,            0.0,
-                         0.0,            0.0,            1.0/scaling.z,    0.0,
-                         0.0,            0.0,            0.0,            1.0);
-        
-        float alpha = orientation / 180.0 * M_PI;
-        
-        mat4 R = mat4(
-                      cos(alpha),        0.0,            sin(alpha),        0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      -sin(alpha),    0.0,            cos(alpha),        0.0,
-                      0.0,            0.0,            0.0,            1.0);
-        
-        mat4 InvR = mat4(
-                         cos(alpha),        0.0,            -sin(alpha),    0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         sin(alpha),        0.0,            cos(alpha),        0.0,
-                         0.0,            0.0,            0.0,            1.0);
-        
-        float b = rollAngle / 180.0 * M_PI;
-        
-        mat4 rollM = mat4(
-            cos(b)+pow(u.x,2)*(1-cos(b)), u.x*u.y*(1-cos(b))-u.z*sin(b), u.x*u.z*(1-cos(b))+u.y*sin(b), 0.0,
-            u.y*u.x*(1-cos(b))+u.z*sin(b), cos(b)+pow(u.y,2)*(1-cos(b)), u.y*u.z*(1-cos(b))-u.x*sin(b), 0.0,
-            u.z*u.x*(1-cos(b))-u.y*sin(b), u.z*u.y*(1-cos(b))+u.x*sin(b), cos(b)+pow(u.z,2)*(1-cos(b)), 0.0,
-                         0.0, 0.0, 0.0, 1.0);
-        
-        mat4 invRollM = mat4();
-        
-        double m[16];
-        double invOut[16];
-        for (int i=0; i<4; i++) {
-            for (int j=0; j<4; j++) {
-                m[i+j*4] = rollM.m[i][j];
-            }
-        }
-        
-        if(gluInvertMatrix(m, invOut)) {
-            for (int i=0; i<4; i++) {
-                for (int j=0; j<4; j++) {
-                    invRollM.m[i][j] = invOut[i+j*4];
-                }
+    void Upload(CubeLoad& load) {
+        for(int i = 0; i < 6; i++) {
+            if(load.faces[i]->data == NULL) {
+                printf("Textures not loaded");
+                return;
             }
         }
-        
-        mat4 M = S * R * rollM * T;
-        mat4 InvM = InvT * invRollM * InvR * InvS;
-        
-        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        mat4 VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        
-        s->UploadM(M);
-        s->UploadInvM(InvM);
-        s->UploadMVP(MVP);
-        s->UploadVP(VP);
+        glGenTextures(1, &textureId); glBindTexture(GL_TEXTURE_CUBE_MAP, textureId);
+        for(int i = 0; i < 6; i++) UploadImageLevel(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, *load.faces[i]);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     }
     
-    vec3& GetPosition() { return position; }
-    
-    void PushedBy(float dt, Object* o) {
-        vec3 dist = o->GetPosition() - position;
-        float push_radius = 0.5;
-        float len = vec2(dist.x, dist.z).length();
-        if (len < push_radius && keyboardState['w']) {
-            // ball roll
-            rollAngle = rollAngle - 100*dt;
-            u = cross(vec3(dist.x, 0, dist.z).normalize(), vec3(0, 1, 0));
-            // ball position
-            float radians = o->GetOrientation() * (M_PI/180);
-            position.x = position.x - dt * cos(radians);
-            position.z = position.z - dt * sin(radians);
-        }
+public:
+    // the faces are decoded through the asset loader; the map stays unbound until all six arrive
+    TextureCube(
+                const std::string& inputFileName0, const std::string& inputFileName1, const std::string& inputFileName2,
+                const std::string& inputFileName3, const std::string& inputFileName4, const std::string& inputFileName5) {
+        textureId = 0;
+        std::shared_ptr<CubeLoad> load = std::make_shared<CubeLoad>();
+        load->faces[0] = new ImageLoad(inputFileName0, false); load->faces[1] = new ImageLoad(inputFileName1, false);
+        load->faces[2] = new ImageLoad(inputFileName2, false); load->faces[3] = new ImageLoad(inputFileName3, false);
+        load->faces[4] = new ImageLoad(inputFileName4, false); load->faces[5] = new ImageLoad(inputFileName5, false);
+        loader.Load([load] { for(int i = 0; i < 6; i++) load->faces[i]->Read(); },
+                    [this, load] { Upload(*load); });
     }
     
+    ~TextureCube() { if(textureId) glDeleteTextures(1, &textureId); }
+    
+    void Bind() { glState.BindTexture(GL_TEXTURE_CUBE_MAP, textureId); }
 };
 
-class CarObject: public Object
+std::string GetCanonicalPath(const std::string& filename)
 {
-    Shader* shader;
-    Mesh *mesh;
-    vec3 position;
-    vec3 scaling;
-    float orientation;
-    float ahead_orientation = orientation;
-    
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
+    char buffer[_MAX_PATH];
+    if(_fullpath(buffer, filename.c_str(), _MAX_PATH)) return buffer;
+#else
+    char* resolved = realpath(filename.c_str(), NULL);
+    if(resolved)
+    {
+        std::string path(resolved);
+        free(resolved);
+        return path;
+    }
+#endif
+    return filename;
+}
+
+// reference-counted meshes and textures shared between every Mesh and Material that uses them;
+// files are keyed by canonical path, and by content so copies of an asset are loaded once as well
+class AssetRegistry
+{
+    struct Entry
+    {
+        std::string key;
+        long long size;
+        unsigned long long hash;
+        Geometry* geometry;
+        Texture* texture;
+        int references;
+        size_t bytes;
+    };
+    
+    std::map<std::string, Entry*> byKey;
+    std::map<std::pair<long long, unsigned long long>, Entry*> byContent;
+    std::map<void*, Entry*> byHandle;
+    
+    int hits, misses;
+    size_t residentBytes;
+    
+    Entry* Find(const std::string& filename, std::string& key, SourceFileStamp& stamp);
+    void Insert(Entry* entry, void* handle);
+    Entry* Unreference(void* handle);
+    
+public:
+    AssetRegistry() : hits(0), misses(0), residentBytes(0) {}
+    
+    // each call hands out one reference, to be returned through Release; the asset may still be
+    // loading, in which case it draws as a placeholder until the loader uploads it
+    Geometry* AcquireMesh(const std::string& filename);
+    Texture* AcquireTexture(const std::string& filename);
+    
+    // takes ownership of generated geometry so it is released like loaded meshes
+    Geometry* Register(const std::string& name, Geometry* geometry);
+    
+    void Release(Geometry* geometry);
+    void Release(Texture* texture);
+    
+    int GetHits() { return hits; }
+    int GetMisses() { return misses; }
+    size_t GetResidentBytes() { return residentBytes; }
+    
+    void PrintStatistics()
+    {
+        printf("Assets: %d resident, %.1f KB, %d hits, %d misses\n", (int)byKey.size(), residentBytes / 1024.0, hits, misses);
+    }
+};
+
+AssetRegistry::Entry* AssetRegistry::Find(const std::string& filename, std::string& key, SourceFileStamp& stamp)
+{
+    key = GetCanonicalPath(filename);
+    std::map<std::string, Entry*>::iterator byPath = byKey.find(key);
+    if(byPath != byKey.end()) return byPath->second;
+    
+    stamp.size = -1;
+    stamp.hash = 0;
+    if(!stamp.Read(filename.c_str())) return NULL;
+    std::map<std::pair<long long, unsigned long long>, Entry*>::iterator sameContent = byContent.find(std::make_pair(stamp.size, stamp.hash));
+    return sameContent != byContent.end() ? sameContent->second : NULL;
+}
+
+void AssetRegistry::Insert(Entry* entry, void* handle)
+{
+    entry->references = 1;
+    byKey[entry->key] = entry;
+    if(entry->size >= 0) byContent[std::make_pair(entry->size, entry->hash)] = entry;
+    byHandle[handle] = entry;
+    residentBytes += entry->bytes;
+}
+
+Geometry* AssetRegistry::AcquireMesh(const std::string& filename)
+{
+    std::string key;
+    SourceFileStamp stamp;
+    Entry* entry = Find(filename, key, stamp);
+    if(entry && entry->geometry)
+    {
+        entry->references++;
+        hits++;
+        return entry->geometry;
+    }
+    
+    // handed out empty; the loader fills it in once the file has been read off the GL thread
+    PolygonalMesh* mesh = new PolygonalMesh();
+    entry = new Entry();
+    entry->key = key;
+    entry->size = stamp.size;
+    entry->hash = stamp.hash;
+    entry->geometry = mesh;
+    entry->texture = NULL;
+    entry->bytes = 0;
+    Insert(entry, mesh);
+    misses++;
+    
+    std::shared_ptr<MeshLoad> load = std::make_shared<MeshLoad>(filename);
+    loader.Load([load] { load->Read(); },
+                [this, entry, mesh, load] {
+                    mesh->Upload(*load);
+                    entry->bytes = mesh->GetBufferBytes();
+                    residentBytes += entry->bytes;
+                });
+    return mesh;
+}
+
+Texture* AssetRegistry::AcquireTexture(const std::string& filename)
+{
+    std::string key;
+    SourceFileStamp stamp;
+    Entry* entry = Find(filename, key, stamp);
+    if(entry && entry->texture)
+    {
+        entry->references++;
+        hits++;
+        return entry->texture;
+    }
+    
+    Texture* texture = new Texture();
+    entry = new Entry();
+    entry->key = key;
+    entry->size = stamp.size;
+    entry->hash = stamp.hash;
+    entry->geometry = NULL;
+    entry->texture = texture;
+    entry->bytes = 0;
+    Insert(entry, texture);
+    misses++;
+    
+    std::shared_ptr<ImageLoad> load = std::make_shared<ImageLoad>(filename, mipmapsEnabled);
+    loader.Load([load] { load->Read(); },
+                [this, entry, texture, load] {
+                    texture->Upload(*load);
+                    entry->bytes = texture->GetBytes();
+                    residentBytes += entry->bytes;
+                });
+    return texture;
+}
+
+Geometry* AssetRegistry::Register(const std::string& name, Geometry* geometry)
+{
+    Entry* entry = new Entry();
+    entry->key = name;
+    entry->size = -1;
+    entry->hash = 0;
+    entry->geometry = geometry;
+    entry->texture = NULL;
+    entry->bytes = 0;
+    Insert(entry, geometry);
+    return geometry;
+}
+
+AssetRegistry::Entry* AssetRegistry::Unreference(void* handle)
+{
+    std::map<void*, Entry*>::iterator found = byHandle.find(handle);
+    if(found == byHandle.end()) return NULL;
+    
+    Entry* entry = found->second;
+    if(--entry->references > 0) return NULL;
+    
+    byHandle.erase(found);
+    if(byKey[entry->key] == entry) byKey.erase(entry->key);
+    if(entry->size >= 0 && byContent[std::make_pair(entry->size, entry->hash)] == entry) byContent.erase(std::make_pair(entry->size, entry->hash));
+    residentBytes -= entry->bytes;
+    return entry;
+}
+
+void AssetRegistry::Release(Geometry* geometry)
+{
+    Entry* entry = Unreference(geometry);
+    if(!entry) return;
+    delete entry->geometry;
+    delete entry;
+}
+
+void AssetRegistry::Release(Texture* texture)
+{
+    Entry* entry = Unreference(texture);
+    if(!entry) return;
+    delete entry->texture;
+    delete entry;
+}
+
+AssetRegistry assets;
+
+class Material
+{
+    Shader* shader;
+    Texture* texture;
+    vec3 ka, kd, ks;
+    float shininess;
+    TextureCube* environmentMap;
+    int sortId;
+    
+public:
+    // takes over one registry reference to the texture
+    Material(Shader* s, vec3 ka, vec3 kd, vec3 ks, float shininess, Texture* texture = 0,
+             TextureCube* e = 0) :
+        shader(s), ka(ka), kd(kd), ks(ks), shininess(shininess), texture(texture), environmentMap(e)
+    {
+        static int materialCount = 0;
+        sortId = materialCount++;
+    }
+    
+    ~Material()
+    {
+        if(texture) assets.Release(texture);
+    }
+    
+    Shader* GetShader() { return shader; }
+    int GetSortId() { return sortId; }
+    unsigned int GetTextureId() { return texture ? texture->GetId() : 0; }
+    
+    void UploadAttributes() { UploadAttributes(shader); }
+    
+    // instanced draws use a variant of the material's shader
+    void UploadAttributes(Shader* shader)
+    {
+        if(texture){
+            shader->UploadSamplerID();
+            texture->Bind();
+            if(!shader->HasMaterialUniforms(this)) shader->UploadMaterialAttributes(ka, kd, ks, shininess);
+        }
+        if(environmentMap){
+            shader->UploadSamplerCubeID();
+            environmentMap->Bind();
+        }
+        shader->SetMaterialUniforms(this);
+    }
+};
+
+class Light
+{
+    vec3 La, Le;
+    vec4 worldLightPosition;
+    bool changed;
+    
+    void SetPosition(vec4 position)
+    {
+        if(memcmp(&position, &worldLightPosition, sizeof(vec4)) == 0) return;
+        worldLightPosition = position;
+        changed = true;
+    }
+    
+public:
+    Light(vec3 La, vec3 Le, vec4 worldLightPosition):
+    La(La), Le(Le), worldLightPosition(worldLightPosition), changed(true) {}
+    
+    // rewrites the light block only if the light moved since the last upload
+    void UploadAttributes()
+    {
+        if(!changed) return;
+        
+        LightBlock block;
+        block.La[0] = La.x; block.La[1] = La.y; block.La[2] = La.z; block.La[3] = 0;
+        block.Le[0] = Le.x; block.Le[1] = Le.y; block.Le[2] = Le.z; block.Le[3] = 0;
+        block.worldLightPosition = worldLightPosition;
+        lightBlock.Update(&block);
+        changed = false;
+    }
+    
+    void SetPointLightSource(vec3& pos) {
+        SetPosition(vec4(pos.x, pos.y, pos.z, 1));
+    }
+    
+    void SetDirectionalLightSource(vec3& dir) {
+        SetPosition(vec4(dir.x, dir.y, dir.z, 0));
+    }
+};
+
+class Mesh
+{
+    Geometry* geometry;
+    Material* material;
+    
+public:
+    // takes over one registry reference to the geometry
+    Mesh(Geometry* g, Material* m)
+    {
+        geometry = g;
+        material = m;
+    }
+    
+    ~Mesh()
+    {
+        assets.Release(geometry);
+    }
+    
+    Shader* GetShader() { return material->GetShader(); }
+    Material* GetMaterial() { return material; }
+    Geometry* GetGeometry() { return geometry; }
+    
+    void Draw()
+    {
+        material->UploadAttributes();
+        geometry->Draw();
+    }
+};
+
+class Camera {
+    vec3  wEye, wLookat, wVup;
+    float fov, asp, fp, bp;
+    
+    mat4 viewProjection;
+    int frame;
+    
+    vec3 velocity;
+    float angularVelocity;
+    
+public:
+    Camera()
+    {
+        wEye = vec3(0.0, 0.0, 2.0);
+        wLookat = vec3(0.0, 0.0, 0.0);
+        wVup = vec3(0.0, 1.0, 0.0);
+        fov = M_PI / 4.0; asp = 1.0; fp = 0.01; bp = 10.0;
+        frame = 0;
+    }
+    
+    void SetAspectRatio(float a) { asp = a; }
+    
+    float GetFov() { return fov; }
+    float GetAspectRatio() { return asp; }
+    float GetNearPlane() { return fp; }
+    float GetFarPlane() { return bp; }
+    
+    vec3 GetEyePosition()
+    {
+        return wEye;
+    }
+    
+    mat4 GetViewMatrix()
+    {
+        vec3 w = (wEye - wLookat).normalize();
+        vec3 u = cross(wVup, w).normalize();
+        vec3 v = cross(w, u);
+        
+        return
+        mat4(
+             1.0f,    0.0f,    0.0f,    0.0f,
+             0.0f,    1.0f,    0.0f,    0.0f,
+             0.0f,    0.0f,    1.0f,    0.0f,
+             -wEye.x, -wEye.y, -wEye.z, 1.0f ) *
+        mat4(
+             u.x,  v.x,  w.x,  0.0f,
+             u.y,  v.y,  w.y,  0.0f,
+             u.z,  v.z,  w.z,  0.0f,
+             0.0f, 0.0f, 0.0f, 1.0f );
+    }
+    
+    mat4 GetProjectionMatrix()
+    {
+        float sy = 1/tan(fov/2);
+        return mat4(
+                    sy/asp, 0.0f,  0.0f,               0.0f,
+                    0.0f,   sy,    0.0f,               0.0f,
+                    0.0f,   0.0f, -(fp+bp)/(bp - fp), -1.0f,
+                    0.0f,   0.0f, -2*fp*bp/(bp - fp),  0.0f);
+    }
+    
+    mat4 GetInverseViewMatrix() {
+        vec3 w = (wEye - wLookat).normalize();
+        vec3 u = cross(wVup, w).normalize();
+        vec3 v = cross(w, u);
+        return mat4(
+                    u.x,  u.y,  u.z,  0.0f,
+                    v.x,  v.y,  v.z,  0.0f,
+                    w.x,  w.y,  w.z,  0.0f,
+                    0.0f, 0.0f, 0.0f, 1.0f );
+    }
+    
+    mat4 GetInverseProjectionMatrix() {
+        float sy = 1/tan(fov/2);
+        return mat4(
+                    asp/sy,        0.0f,        0.0f,        0.0f,
+                    0.0f,        1.0/sy,        0.0f,        0.0f,
+                    0.0f,        0.0f,        0.0f,        (fp - bp) / 2.0 / fp / bp,
+                    0.0f,        0.0f,        -1.0f,        (fp + bp) / 2.0 / fp / bp);
+    }
+    
+    vec3 GetAhead()
+    {
+        return (wLookat - wEye).normalize();
+    }
+    
+    void Control()
+    {
+        if(keyboardState['w'])
+        {
+            velocity = GetAhead() * 2.0;
+            return;
+        }
+        
+        if(keyboardState['s'])
+        {
+            velocity = GetAhead() * (-2.0);
+            return;
+        }
+        
+        if(keyboardState['d'])
+        {
+            angularVelocity = 20.0;
+            return;
+        }
+        
+        if(keyboardState['a'])
+        {
+            angularVelocity = -20.0;
+            return;
+        }
+        
+        angularVelocity = 0.0;
+        velocity = vec3(0.0, 0.0, 0.0);
+    }
+    
+    void Move(float dt)
+    {
+        wEye = wEye + velocity * dt;
+        wLookat = wLookat + velocity * dt;
+        
+        vec3 w = (wLookat - wEye);
+        float l = w.length();
+        w = w.normalize();
+        vec3 v = wVup.normalize();
+        vec3 u = cross(w, v);
+        
+        float alpha = (angularVelocity * dt) * M_PI / 180.0;
+        
+        wLookat = wEye + (w * cos(alpha) + u * sin(alpha)) * l;
+    }
+    
+    void MoveHelicam(vec3 pos, float orient, float dt) {
+        //force = force + 4*dt;
+        //acceleration = force*invMass;
+        //speed = speed - acceleration * dt;
+    
+        float radians = orient * (M_PI/180);
+        wEye = pos + vec3(2*cosf(radians), 2, 2*sinf(radians));
+        wLookat = pos + vec3(0, 1.5, 0);
+    }
+    
+    // view-projection of the current frame, valid after UploadAttributes
+    mat4& GetViewProjectionMatrix() { return viewProjection; }
+    int GetFrame() { return frame; }
+    
+    // written once per frame, before anything is drawn
+    void UploadAttributes()
+    {
+        CameraBlock block;
+        block.viewMatrix = GetViewMatrix();
+        block.projectionMatrix = GetProjectionMatrix();
+        block.VP = block.viewMatrix * block.projectionMatrix;
+        viewProjection = block.VP;
+        frame++;
+        block.worldEyePosition[0] = wEye.x; block.worldEyePosition[1] = wEye.y; block.worldEyePosition[2] = wEye.z;
+        block.worldEyePosition[3] = 1;
+        cameraBlock.Update(&block);
+    }
+    
+    
+};
+
+Camera camera;
+vec3 wEye = camera.GetEyePosition();
+Light light = Light(vec3(1, 1, 1), vec3(1, 1, 1), vec4(0.1, 0.1, 0.1, 0.0));
+
+class Environment : public Geometry
+{
+    unsigned int vbo;
+    EnvironmentShader *shader;
+    TextureCube *environmentMap;
+    
+public:
+    Environment(EnvironmentShader *s, TextureCube *e)
+    {
+        shader = s;
+        environmentMap = e;
+        
+        glBindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        static float vertexCoords[] =     {
+            -1,    -1,     0,     1,
+            1,     -1,     0,     1,
+            -1,      1,     0,     1,
+            1,      1,     0,     1    };
+        
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+    }
+    
+    void Draw()
+    {
+        shader->Run();
+        environmentMap->Bind();
+        mat4 viewDirMatrix = camera.GetInverseProjectionMatrix() * camera.GetInverseViewMatrix();
+        shader->UploadViewDirMatrix(viewDirMatrix);
+        glState.SetDepthTest(true);
+        glState.SetBlend(true);
+        glState.BindVertexArray(vao);
+        GL_DRAW(glDrawArrays(GL_TRIANGLE_STRIP, 0, 4));
+    }
+};
+
+// where an object is, as the simulation leaves it after a step
+struct Pose
+{
+    vec3 position;
+    vec3 scaling;
+    float orientation;
+    float rollAngle;
+    vec3 rollAxis;
+    
+    Pose() : scaling(1, 1, 1), orientation(0), rollAngle(0) {}
+    Pose(const vec3& p, const vec3& s, float orient, float roll = 0, const vec3& axis = vec3(0, 0, 0)) :
+    position(p), scaling(s), orientation(orient), rollAngle(roll), rollAxis(axis) {}
+    
+    bool operator==(const Pose& o) const
+    {
+        return position.x == o.position.x && position.y == o.position.y && position.z == o.position.z &&
+               scaling.x == o.scaling.x && scaling.y == o.scaling.y && scaling.z == o.scaling.z && orientation == o.orientation &&
+               rollAngle == o.rollAngle && rollAxis.x == o.rollAxis.x && rollAxis.y == o.rollAxis.y && rollAxis.z == o.rollAxis.z;
+    }
+    bool operator!=(const Pose& o) const { return !(*this == o); }
+};
+
+// model transform of an object: scaling, rotation about y, an optional roll about an arbitrary axis,
+// then translation; the matrices are rebuilt only when one of the parameters changes
+// the parameters are the object's pose blended between where the last simulation step started and
+// where it ended, so motion stays smooth whatever the frame rate; owned by rendering
+class Transform
+{
+    Pose previous, current;
+    float blend;
+    
+    bool dirty;
+    mat4 M, InvM, MVP;
+    int mvpFrame;
+    unsigned int version;
+    
+    void Update();
+    
+    void Invalidate()
+    {
+        dirty = true;
+        version++;
+    }
+    
+public:
+    Transform() : blend(1), dirty(true), mvpFrame(-1), version(0) {}
+    
+    // takes the poses a step started and ended with and marks the matrices dirty if either moved
+    void Set(const Pose& from, const Pose& to)
+    {
+        if(version != 0 && from == previous && to == current) return;
+        previous = from;
+        current = to;
+        Invalidate();
+    }
+    
+    // how far rendering is between the two poses, from 0 to 1
+    void SetBlend(float alpha)
+    {
+        if(alpha == blend) return;
+        blend = alpha;
+        if(previous != current) Invalidate();
+    }
+    
+    // the blended pose, for what follows the object on screen
+    vec3 GetPosition() { return previous.position + (current.position - previous.position) * blend; }
+    float GetOrientation() { return previous.orientation + (current.orientation - previous.orientation) * blend; }
+    
+    // changes whenever the parameters do, so callers can tell whether anything they derived is stale
+    unsigned int GetVersion() { return version; }
+    
+    mat4& GetModelMatrix()
+    {
+        if(dirty) Update();
+        return M;
+    }
+    
+    // the shaders transform normals as InvM * n, so the inverse doubles as the normal matrix
+    mat4& GetInverseModelMatrix()
+    {
+        if(dirty) Update();
+        return InvM;
+    }
+    
+    // M * VP, shared by every draw of the object within one frame
+    mat4& GetModelViewProjectionMatrix(mat4& VP, int frame)
+    {
+        if(dirty) Update();
+        if(mvpFrame != frame)
+        {
+            MVP = M * VP;
+            mvpFrame = frame;
+        }
+        return MVP;
+    }
+};
+
+void Transform::Update()
+{
+    // the roll axis changes with the direction of a push, so it is not blended
+    vec3 position = GetPosition();
+    vec3 scaling = previous.scaling + (current.scaling - previous.scaling) * blend;
+    float orientation = GetOrientation();
+    float rollAngle = previous.rollAngle + (current.rollAngle - previous.rollAngle) * blend;
+    vec3 rollAxis = current.rollAxis;
+    
+    mat4 T = mat4(
+                  1.0,            0.0,            0.0,            0.0,
+                  0.0,            1.0,            0.0,            0.0,
+                  0.0,            0.0,            1.0,            0.0,
+                  position.x,        position.y,        position.z,        1.0);
+    
+    mat4 InvT = mat4(
+                     1.0,            0.0,            0.0,            0.0,
+                     0.0,            1.0,            0.0,            0.0,
+                     0.0,            0.0,            1.0,            0.0,
+                     -position.x,    -position.y,    -position.z,    1.0);
+    
+    mat4 S = mat4(
+                  scaling.x,        0.0,            0.0,            0.0,
+                  0.0,            scaling.y,        0.0,            0.0,
+                  0.0,            0.0,            scaling.z,        0.0,
+                  0.0,            0.0,            0.0,            1.0);
+    
+    mat4 InvS = mat4(
+                     1.0/scaling.x,    0.0,            0.0,            0.0,
+                     0.0,            1.0/scaling.y,    0.0,            0.0,
+                     0.0,            0.0,            1.0/scaling.z,    0.0,
+                     0.0,            0.0,            0.0,            1.0);
+    
+    float alpha = orientation / 180.0 * M_PI;
+    
+    mat4 R = mat4(
+                  cos(alpha),        0.0,            sin(alpha),        0.0,
+                  0.0,            1.0,            0.0,            0.0,
+                  -sin(alpha),    0.0,            cos(alpha),        0.0,
+                  0.0,            0.0,            0.0,            1.0);
+    
+    mat4 InvR = mat4(
+                     cos(alpha),        0.0,            -sin(alpha),    0.0,
+                     0.0,            1.0,            0.0,            0.0,
+                     sin(alpha),        0.0,            cos(alpha),        0.0,
+                     0.0,            0.0,            0.0,            1.0);
+    
+    if(rollAngle == 0)
+    {
+        M = S * R * T;
+        InvM = InvT * InvR * InvS;
+    }
+    else
+    {
+        vec3 u = rollAxis;
+        float b = rollAngle / 180.0 * M_PI;
+        
+        mat4 rollM = mat4(
+            cos(b)+pow(u.x,2)*(1-cos(b)), u.x*u.y*(1-cos(b))-u.z*sin(b), u.x*u.z*(1-cos(b))+u.y*sin(b), 0.0,
+            u.y*u.x*(1-cos(b))+u.z*sin(b), cos(b)+pow(u.y,2)*(1-cos(b)), u.y*u.z*(1-cos(b))-u.x*sin(b), 0.0,
+            u.z*u.x*(1-cos(b))-u.y*sin(b), u.z*u.y*(1-cos(b))+u.x*sin(b), cos(b)+pow(u.z,2)*(1-cos(b)), 0.0,
+                         0.0, 0.0, 0.0, 1.0);
+        
+        mat4 invRollM = RigidInverse(rollM);
+        
+        M = S * R * rollM * T;
+        InvM = InvT * invRollM * InvR * InvS;
+    }
+    
+    dirty = false;
+    mvpFrame = -1;
+}
+
+// how close to the avatar an object has to be to get pushed
+const float pushRadius = 0.5;
+
+class Object{
+    Shader* shader;
+    Mesh *mesh;
+    vec3 position;
+    vec3 scaling;
+    float orientation;
+    bool active;
+    bool inView;
+    unsigned int shadowCascades;
+    
+protected:
+    Transform transform;
+    
+    // per-object uniforms, the view-projection part comes from the camera once per frame
+    void UploadTransform(Shader* s)
+    {
+        s->UploadM(transform.GetModelMatrix());
+        s->UploadInvM(transform.GetInverseModelMatrix());
+        s->UploadMVP(transform.GetModelViewProjectionMatrix(camera.GetViewProjectionMatrix(), camera.GetFrame()));
+    }
+    
+public:
+    Object(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) : position(position), scaling(scaling), orientation(orientation)
+    {
+        shader = m->GetShader();
+        mesh = m;
+        active = true;
+        inView = true;
+        shadowCascades = (1 << maxShadowCascades) - 1;
+    }
+    
+    // the object's current position, scaling and orientation, read by the simulation after a step;
+    // rendering only sees them through the transform the published scene state sets
+    virtual void GetPose(Pose& pose) { pose = Pose(position, scaling, orientation); }
+    
+    // what the profiler calls the object's draws
+    virtual const char* GetName() { return "object"; }
+    
+    void UploadAttributes(Shader* s) { UploadTransform(s); }
+    
+    Transform& GetTransform() { return transform; }
+    
+    // world-space bounding sphere, center in xyz and radius in w; false if the mesh has no bounds
+    bool GetBoundingSphere(vec4& sphere)
+    {
+        vec3 center;
+        float radius;
+        if(!mesh->GetGeometry()->GetBoundingSphere(center, radius)) return false;
+        
+        const mat4& M = GetTransform().GetModelMatrix();
+        sphere = vec4(center.x, center.y, center.z, 1) * M;
+        float scale = 0;
+        for(int i = 0; i < 3; i++) scale = std::max(scale, M.m[i][0] * M.m[i][0] + M.m[i][1] * M.m[i][1] + M.m[i][2] * M.m[i][2]);
+        sphere.v[3] = radius * sqrtf(scale);
+        return true;
+    }
+    
+    // pooled objects stay in the scene while unused, inactive objects are neither drawn nor found
+    void SetActive(bool isActive) { active = isActive; }
+    bool IsActive() { return active; }
+    
+    // moves a pooled object to where it is reused
+    virtual void Place(vec3, vec3, float) {}
+    
+    // puts an object that moves itself where a benchmark path says, on the ground plane
+    virtual void Follow(float, float, float) {}
+    
+    // culling result of the current frame for the main pass and, one bit per cascade, the shadow pass
+    void SetVisibility(bool visible, unsigned int cascades) { inView = visible; shadowCascades = cascades; }
+    bool IsVisible() { return inView; }
+    bool IsShadowVisible() { return shadowCascades != 0; }
+    bool IsShadowVisible(int cascade) { return (shadowCascades >> cascade) & 1; }
+    unsigned int GetShadowCascades() { return shadowCascades; }
+    
+    Mesh* GetMesh() { return mesh; }
+    virtual vec3& GetPosition() { return position; }
+    virtual float GetOrientation() { return orientation; }
+    // whether Move or Roll can change the object without anything pushing it
+    virtual bool MovesItself() { return false; }
+    // static objects only change when they are placed, so their shadows are cached
+    virtual bool IsStatic() { return !MovesItself(); }
+    virtual void Move(float dt) {}
+    virtual void PushedBy(float dt, Object* o) {}
+    virtual void DrawSpotlight() {}
+    virtual void Roll(float dt, Object* o, int index) {}
+    virtual void SetAheadOrientation(float orient) {}
+    
+    void Draw()
+    {
+        shader->Run();
+        UploadAttributes(shader);
+        mesh->Draw();
+    }
+    
+    // the depth-only shadow shader reads no material, so only the geometry is drawn
+    void DrawShadow(Shader* shadowShader)
+    {
+        shadowShader->Run();
+        UploadAttributes(shadowShader);
+        mesh->GetGeometry()->Draw();
+    }
+    
+};
+
+class AvatarObject: public Object
+{
+    Shader* shader;
+    Mesh *mesh;
+    vec3 position;
+    vec3 scaling;
+    float orientation;
+    
+public:
+    AvatarObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
+    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    {
+        shader = m->GetShader();
+        mesh = m;
+    }
+    
+    void GetPose(Pose& pose) { pose = Pose(position, scaling, orientation); }
+    const char* GetName() { return "avatar"; }
+    
+    void DrawSpotlight() {
+        shader->Run();
+        UploadAttributes(shader);
+        
+        vec3 source = transform.GetPosition() + vec3(0, 2, 0);
+        light.SetPointLightSource(source);
+        light.UploadAttributes();
+        
+        mesh->Draw();
+    }
+    
+    vec3& GetPosition() { return position; }
+    
+    float GetOrientation() { return orientation; }
+    
+    bool MovesItself() { return true; }
+    
+    void Follow(float x, float z, float orient)
+    {
+        position.x = x;
+        position.z = z;
+        orientation = orient;
+    }
+    
+    void Move(float dt) {
+        float radians = orientation * (M_PI/180);
+        if (keyboardState['w']) {
+            position.x = position.x - dt * cos(radians);
+            position.z = position.z - dt * sin(radians);
+        }
+        if (keyboardState['s']) {
+            position.x = position.x + dt * cos(radians);
+            position.z = position.z + dt * sin(radians);
+        }
+        if (keyboardState['a']) {
+            orientation = orientation - dt*50;
+        }
+        if (keyboardState['d']) {
+            orientation = orientation + dt*50;
+        }
+    }
+
+    
+};
+
+class BackgroundObject: public Object
+{
+    Shader* shader;
+    Mesh *mesh;
+    vec3 position;
+    vec3 scaling;
+    float orientation;
+    
+public:
+    BackgroundObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
+    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    {
+        shader = m->GetShader();
+        mesh = m;
+    }
+    
+    void GetPose(Pose& pose) { pose = Pose(position, scaling, orientation); }
+    const char* GetName() { return "background"; }
+    
+    vec3& GetPosition() { return position; }
+    
+    void Place(vec3 p, vec3 s, float o)
+    {
+        position = p;
+        scaling = s;
+        orientation = o;
+    }
+};
+
+class RoundObject: public Object
+{
+    Shader* shader;
+    Mesh *mesh;
+    vec3 position;
+    vec3 scaling;
+    float orientation;
+    float rollAngle = 0;
+    vec3 u = vec3(0, 0, 0);
+    
+public:
+    RoundObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
+    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    {
+        shader = m->GetShader();
+        mesh = m;
+    }
+    
+    void GetPose(Pose& pose) { pose = Pose(position, scaling, orientation, rollAngle, u); }
+    const char* GetName() { return "ball"; }
+    
+    vec3& GetPosition() { return position; }
+    
+    void Place(vec3 p, vec3 s, float o)
+    {
+        position = p;
+        scaling = s;
+        orientation = o;
+        rollAngle = 0;
+        u = vec3(0, 0, 0);
+    }
+    
+    // the avatar pushes it around
+    bool IsStatic() { return false; }
+    
+    void PushedBy(float dt, Object* o) {
+        vec3 dist = o->GetPosition() - position;
+        float len = vec2(dist.x, dist.z).length();
+        if (len < pushRadius && keyboardState['w']) {
+            // ball roll
+            rollAngle = rollAngle - 100*dt;
+            u = cross(vec3(dist.x, 0, dist.z).normalize(), vec3(0, 1, 0));
+            // ball position
+            float radians = o->GetOrientation() * (M_PI/180);
+            position.x = position.x - dt * cos(radians);
+            position.z = position.z - dt * sin(radians);
+        }
+    }
+    
+};
+
+class CarObject: public Object
+{
+    Shader* shader;
+    Mesh *mesh;
+    vec3 position;
+    vec3 scaling;
+    float orientation;
+    float ahead_orientation = orientation;
+    
+public:
+    CarObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
+    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    {
+        shader = m->GetShader();
+        mesh = m;
+    }
+    
+    void GetPose(Pose& pose) { pose = Pose(position, scaling, orientation); }
+    const char* GetName() { return "car"; }
+    
+    vec3& GetPosition() { return position; }
+    void SetAheadOrientation(float orient) {
+        ahead_orientation = orient;
+    }
+    
+    bool MovesItself() { return true; }
+    
+    // the body never turns, only the wheels steer
+    void Follow(float x, float z, float)
+    {
+        position.x = x;
+        position.z = z;
+    }
+    
+    void Move(float dt) {
+        float radians = (ahead_orientation-90) * (M_PI/180);
+        if (keyboardState['i']) {
+            position.x = position.x - dt * cos(radians);
+            position.z = position.z - dt * sin(radians);
+        }
+        if (keyboardState['k']) {
+            position.x = position.x + dt * cos(radians);
+            position.z = position.z + dt * sin(radians);
+        }/**
+        if (keyboardState['j']) {
+            orientation = orientation - dt*10;
+        }
+        if (keyboardState['l']) {
+            orientation = orientation + dt*10;
+        }**/
+    }
+    
+};
+
+class WheelObject: public Object
+{
+    Shader* shader;
+    Mesh *mesh;
+    vec3 position;
+    vec3 scaling;
+    float orientation;
+    float rollAngle = 0;
+    vec3 u = vec3(0, 0, 0);
+    
+public:
+    WheelObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
+    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    {
+        shader = m->GetShader();
+        mesh = m;
+    }
+    
+    void GetPose(Pose& pose) { pose = Pose(position, scaling, orientation, rollAngle, u); }
+    const char* GetName() { return "wheel"; }
+    
+    vec3& GetPosition() { return position; }
+    
+    bool MovesItself() { return true; }
+    
+    void Roll(float dt, Object* o, int index) {
+        if (index == 7) {
+            position = o->GetPosition() + vec3(1, -0.3, -0.6);
+        }else if (index == 8) {
+            position = o->GetPosition() + vec3(-1.25, -0.3, -0.6);
+        }else if (index == 9) {
+            position = o->GetPosition() + vec3(1, -0.3, 0.6);
+        }else {
+            position = o->GetPosition() + vec3(-1.25, -0.3, 0.6);
+        }
+        float radians = orientation * (M_PI/180);
+        u = (vec3(position.x - 20 * cos(radians), position.y, position.z - 20 * sin(radians))
+                      - position).normalize();
+        if (keyboardState['i']) {
+            o->SetAheadOrientation(orientation);
+            rollAngle = rollAngle + 100*dt;
+        }
+        if (keyboardState['k']) {
+            o->SetAheadOrientation(orientation);
+            rollAngle = rollAngle - 100*dt;
+        }
+        if (keyboardState['j']) {
+            orientation = orientation - dt*50;
+        }
+        if (keyboardState['l']) {
+            orientation = orientation + dt*50;
+        }
+    }
+    
+};
+
+// objects sharing one Mesh, drawn with a single instanced call per pass; every instance carries its
+// model matrix and inverse in a buffer that is rewritten only when one of them changed
+class MeshInstances
+{
+    static const int floatsPerInstance = 32;
+    
+    // the instances one pass draws; culling leaves the main pass and each shadow cascade with
+    // different subsets, so each has a vertex array and instance buffer of its own
+    struct Stream
+    {
+        unsigned int vao;
+        unsigned int buffer;
+        int count;
+        int capacity;
+        bool attached;
+        std::vector<float> data, frameData;
+    };
+    
+    enum { mainStream, shadowStream, streamCount = shadowStream + maxShadowCascades };
+    
+    Mesh* mesh;
+    std::vector<Object*> objects;
+    Stream streams[streamCount];
+    
+    // the geometry's buffers may still be loading, so the vertex array is completed on first use
+    bool Prepare(Stream& stream)
+    {
+        if(stream.attached) return true;
+        glState.BindVertexArray(stream.vao);
+        if(!mesh->GetGeometry()->AttachBuffers()) return false;
+        
+        glBindBuffer(GL_ARRAY_BUFFER, stream.buffer);
+        for(int i = 0; i < 8; i++)
+        {
+            glEnableVertexAttribArray(3 + i);
+            glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, floatsPerInstance * sizeof(float), (void*)(i * 4 * sizeof(float)));
+            glVertexAttribDivisor(3 + i, 1);
+        }
+        stream.attached = true;
+        return true;
+    }
+    
+    void Upload(Stream& stream)
+    {
+        if(stream.capacity < stream.count)
+        {
+            GL_COUNT(glBindBuffer(GL_ARRAY_BUFFER, stream.buffer));
+            GL_COUNT(glBufferData(GL_ARRAY_BUFFER, stream.frameData.size() * sizeof(float), stream.frameData.data(), GL_DYNAMIC_DRAW));
+            stream.capacity = stream.count;
+        }
+        else if(stream.frameData != stream.data)
+        {
+            GL_COUNT(glBindBuffer(GL_ARRAY_BUFFER, stream.buffer));
+            GL_COUNT(glBufferSubData(GL_ARRAY_BUFFER, 0, stream.frameData.size() * sizeof(float), stream.frameData.data()));
+        }
+        stream.data.swap(stream.frameData);
+    }
+    
+    void DrawInstances(Stream& stream)
+    {
+        glState.SetDepthTest(true);
+        glState.SetBlend(false);
+        glState.BindVertexArray(stream.vao);
+        mesh->GetGeometry()->DrawInstanced(stream.count);
+    }
+    
+public:
+    MeshInstances(Mesh* mesh) : mesh(mesh)
+    {
+        for(int i = 0; i < streamCount; i++)
+        {
+            glGenVertexArrays(1, &streams[i].vao);
+            glGenBuffers(1, &streams[i].buffer);
+            streams[i].count = streams[i].capacity = 0;
+            streams[i].attached = false;
+        }
+    }
+    
+    ~MeshInstances()
+    {
+        for(int i = 0; i < streamCount; i++)
+        {
+            glDeleteBuffers(1, &streams[i].buffer);
+            glDeleteVertexArrays(1, &streams[i].vao);
+        }
+    }
+    
+    void Add(Object* object) { objects.push_back(object); }
+    Object* GetFirst() { return objects[0]; }
+    int GetVisibleCount() { return streams[mainStream].count; }
+    int GetShadowCount(int cascade) { return streams[shadowStream + cascade].count; }
+    
+    // collects this frame's matrices of the instances each pass can see, after culling
+    void Update()
+    {
+        for(int s = 0; s < streamCount; s++)
+        {
+            streams[s].count = 0;
+            streams[s].frameData.clear();
+        }
+        
+        for(int i = 0; i < (int)objects.size(); i++)
+        {
+            bool visible[streamCount];
+            visible[mainStream] = objects[i]->IsVisible();
+            for(int c = 0; c < maxShadowCascades; c++) visible[shadowStream + c] = objects[i]->IsShadowVisible(c);
+            if(!visible[mainStream] && !objects[i]->IsShadowVisible()) continue;
+            
+            Transform& transform = objects[i]->GetTransform();
+            const float* M = &transform.GetModelMatrix().m[0][0];
+            const float* InvM = &transform.GetInverseModelMatrix().m[0][0];
+            for(int s = 0; s < streamCount; s++)
+            {
+                if(!visible[s]) continue;
+                streams[s].frameData.insert(streams[s].frameData.end(), M, M + 16);
+                streams[s].frameData.insert(streams[s].frameData.end(), InvM, InvM + 16);
+                streams[s].count++;
+            }
+        }
+        
+        for(int s = 0; s < streamCount; s++) Upload(streams[s]);
+    }
+    
+    void Draw(Shader* instancedShader)
+    {
+        Stream& stream = streams[mainStream];
+        if(!stream.count || !Prepare(stream)) return;
+        instancedShader->Run();
+        mesh->GetMaterial()->UploadAttributes(instancedShader);
+        DrawInstances(stream);
+    }
+    
+    void DrawShadow(Shader* instancedShadowShader, int cascade)
+    {
+        Stream& stream = streams[shadowStream + cascade];
+        if(!stream.count || !Prepare(stream)) return;
+        instancedShadowShader->Run();
+        DrawInstances(stream);
+    }
+};
+
+// depth of the shadow casters seen from the directional light, in cascades that split the camera's
+// frustum by distance, each a layer of a texture array. A cascade's box holds the bounding sphere of its
+// slice with room to spare, so it keeps its size while the camera turns and only moves once the sphere
+// has drifted by part of its radius, snapped to whole texels so the shadows do not shimmer.
+// Static casters are drawn into cached layers that are redrawn only where they went stale: moving a box
+// scrolls its layer by whole texels and leaves just the uncovered strips to draw, and a static caster
+// placed, moved, entering or leaving redraws its own rectangle. The layers the shaders sample are copies
+// of those with the moving casters drawn over, redrawn only when one of them moved and only in the
+// rectangle they cover now or covered the last time
+class ShadowMap
+{
+public:
+    static const int defaultCascadeCount = 3;
+    static const int defaultSize = 1024;
+    static constexpr float splitBlend = 0.5f;       // of logarithmic against uniform split distances
+    static constexpr float recenterFraction = 0.25f;    // of a slice's radius its box has to spare
+    static constexpr float depthRange = 40.0f;      // from a box center towards and away from the light
+    static constexpr float depthTolerance = 10.0f;  // of a slice along the light before its depths are redrawn
+    static constexpr float normalOffsetTexels = 1.5f;
+    
+    // texels x0 <= x < x1, y0 <= y < y1; the default one is empty and grows by Add
+    struct Rect
+    {
+        int x0, y0, x1, y1;
+        
+        Rect() : x0(1 << 30), y0(1 << 30), x1(0), y1(0) { }
+        Rect(int x0, int y0, int x1, int y1) : x0(x0), y0(y0), x1(x1), y1(y1) { }
+        
+        bool IsEmpty() const { return x1 <= x0 || y1 <= y0; }
+        long GetArea() const { return IsEmpty() ? 0 : (long)(x1 - x0) * (y1 - y0); }
+        bool Overlaps(const Rect& r) const { return x0 < r.x1 && r.x0 < x1 && y0 < r.y1 && r.y0 < y1; }
+        
+        void Add(const Rect& r)
+        {
+            if(r.IsEmpty()) return;
+            x0 = std::min(x0, r.x0); y0 = std::min(y0, r.y0);
+            x1 = std::max(x1, r.x1); y1 = std::max(y1, r.y1);
+        }
+    };
+    
+private:
+    enum { staticLayer, combinedLayer, layerCount };
+    static const int maxStaticRects = 16;
+    
+    struct Cascade
+    {
+        float end;          // view depth where the slice ends
+        float distance;     // of the slice's bounding sphere center from the eye
+        float radius;
+        float halfExtent;   // of the box across the light
+        float centerU, centerV, centerW;    // the box center along u, v and direction
+        bool placed;
+        mat4 lightViewProjection;
+        Frustum frustum;
+        unsigned int framebuffers[layerCount];
+        
+        std::vector<Rect> staticRects;      // of the static layer to redraw
+        bool combinedValid;
+        uint64_t movingSignature;
+        Rect movingBounds, drawnBounds;     // of the moving casters this frame and when they were last drawn
+    };
+    
+    // depth texture arrays with a layer per cascade; the combined one is sampled
+    unsigned int textures[layerCount];
+    int size, cascadeCount;
+    Cascade cascades[maxShadowCascades];
+    
+    vec3 direction;     // towards the light
+    vec3 u, v;          // across it
+    bool oriented;
+    ShadowBlock block;
+    int staticRenders, combinedRenders;
+    
+    int savedFramebuffers[2];
+    int savedViewport[4];
+    
+    void Release()
+    {
+        for(int i = 0; i < layerCount; i++)
+        {
+            for(int c = 0; c < cascadeCount; c++)
+                if(cascades[c].framebuffers[i]) glDeleteFramebuffers(1, &cascades[c].framebuffers[i]);
+            if(textures[i]) glDeleteTextures(1, &textures[i]);
+            textures[i] = 0;
+        }
+        for(int c = 0; c < maxShadowCascades; c++)
+            for(int i = 0; i < layerCount; i++) cascades[c].framebuffers[i] = 0;
+    }
+    
+    // splits blend logarithmic distances, which keep texels the same size on screen, with uniform ones,
+    // which keep the far cascades from thinning out; a box that has to change its size starts over
+    void Split(Camera& camera)
+    {
+        float nearPlane = camera.GetNearPlane(), farPlane = camera.GetFarPlane();
+        float tanHalfFov = tanf(camera.GetFov() / 2);
+        float aspect = camera.GetAspectRatio();
+        float k2 = tanHalfFov * tanHalfFov * (1 + aspect * aspect);     // squared corner spread per unit of depth
+        float start = nearPlane;
+        for(int c = 0; c < cascadeCount; c++)
+        {
+            Cascade& cascade = cascades[c];
+            float t = (float)(c + 1) / cascadeCount;
+            cascade.end = splitBlend * nearPlane * powf(farPlane / nearPlane, t) + (1 - splitBlend) * (nearPlane + (farPlane - nearPlane) * t);
+            if(c == cascadeCount - 1) cascade.end = farPlane;
+            
+            // the smallest sphere around the slice's eight corners lies on the view axis
+            float distance = (start + cascade.end) * (1 + k2) / 2;
+            float radius;
+            if(distance >= cascade.end)
+            {
+                distance = cascade.end;
+                radius = cascade.end * sqrtf(k2);
+            }
+            else radius = sqrtf((distance - start) * (distance - start) + start * start * k2);
+            
+            if(radius != cascade.radius) cascade.placed = false;
+            cascade.distance = distance;
+            cascade.radius = radius;
+            cascade.halfExtent = radius * (1 + recenterFraction);
+            start = cascade.end;
+        }
+    }
+    
+    // the light looks at the center from depthRange away, the box is an orthographic projection
+    void SetViewProjection(int c)
+    {
+        Cascade& cascade = cascades[c];
+        vec3 w = direction;
+        mat4 view = mat4(
+                         u.x,  v.x,  w.x,  0.0f,
+                         u.y,  v.y,  w.y,  0.0f,
+                         u.z,  v.z,  w.z,  0.0f,
+                         -cascade.centerU, -cascade.centerV, -(cascade.centerW + depthRange), 1.0f);
+        float farPlane = 2 * depthRange;
+        mat4 projection = mat4(
+                               1 / cascade.halfExtent, 0.0f,                   0.0f,            0.0f,
+                               0.0f,                   1 / cascade.halfExtent, 0.0f,            0.0f,
+                               0.0f,                   0.0f,                   -2 / farPlane,   0.0f,
+                               0.0f,                   0.0f,                   -1.0f,           1.0f);
+        cascade.lightViewProjection = view * projection;
+        cascade.frustum.Set(cascade.lightViewProjection);
+        
+        // from the light's axes to texture coordinates and depth in [0, 1], the box's clip space halved
+        float scale = 0.5f / cascade.halfExtent;
+        block.cascadeScales[c] = scale;
+        block.cascadeOffsetsU[c] = 0.5f - cascade.centerU * scale;
+        block.cascadeOffsetsV[c] = 0.5f - cascade.centerV * scale;
+        block.cascadeOffsetsW[c] = 0.5f + cascade.centerW / (2 * depthRange);
+        block.normalOffsets[c] = normalOffsetTexels * GetTexelSize(c);
+    }
+    
+    // follows the slice's sphere; true if the box moved
+    bool Place(int c, vec3 focus, bool turned)
+    {
+        Cascade& cascade = cascades[c];
+        float fu = dot(focus, u), fv = dot(focus, v), fw = dot(focus, direction);
+        bool deep = fabsf(fw - cascade.centerW) > depthTolerance;
+        float spare = cascade.halfExtent - cascade.radius;
+        if(cascade.placed && !turned && !deep && fabsf(fu - cascade.centerU) <= spare && fabsf(fv - cascade.centerV) <= spare) return false;
+        
+        // centers snapped to whole texels keep the rasterized shadows from crawling when the box moves
+        float texel = GetTexelSize(c);
+        float snappedU = floorf(fu / texel + 0.5f) * texel, snappedV = floorf(fv / texel + 0.5f) * texel;
+        if(!cascade.placed || turned || deep)
+        {
+            cascade.staticRects.assign(1, Rect(0, 0, size, size));
+            cascade.centerW = fw;
+        }
+        else Scroll(c, (int)floorf((snappedU - cascade.centerU) / texel + 0.5f), (int)floorf((snappedV - cascade.centerV) / texel + 0.5f));
+        cascade.centerU = snappedU;
+        cascade.centerV = snappedV;
+        cascade.placed = true;
+        cascade.combinedValid = false;
+        SetViewProjection(c);
+        return true;
+    }
+    
+    void SaveTarget()
+    {
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &savedFramebuffers[0]);
+        glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &savedFramebuffers[1]);
+        glGetIntegerv(GL_VIEWPORT, savedViewport);
+    }
+    
+    void RestoreTarget()
+    {
+        GL_COUNT(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, savedFramebuffers[0]));
+        GL_COUNT(glBindFramebuffer(GL_READ_FRAMEBUFFER, savedFramebuffers[1]));
+        GL_COUNT(glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]));
+    }
+    
+    // casters are drawn with the cascade's view and projection from the Shadow block
+    void Begin(int c, int layer)
+    {
+        SaveTarget();
+        block.lightViewProjection = cascades[c].lightViewProjection;
+        shadowBlock.Update(&block);
+        GL_COUNT(glBindFramebuffer(GL_FRAMEBUFFER, cascades[c].framebuffers[layer]));
+        GL_COUNT(glViewport(0, 0, size, size));
+        // the offset keeps surfaces facing the light from shadowing themselves
+        GL_COUNT(glEnable(GL_POLYGON_OFFSET_FILL));
+        GL_COUNT(glPolygonOffset(2.0f, 4.0f));
+        GL_COUNT(glEnable(GL_SCISSOR_TEST));
+    }
+    
+    void End()
+    {
+        GL_COUNT(glDisable(GL_SCISSOR_TEST));
+        GL_COUNT(glDisable(GL_POLYGON_OFFSET_FILL));
+        RestoreTarget();
+    }
+    
+    void Scissor(const Rect& r) { GL_COUNT(glScissor(r.x0, r.y0, r.x1 - r.x0, r.y1 - r.y0)); }
+    
+    void Blit(unsigned int from, unsigned int to, const Rect& source, int dx, int dy)
+    {
+        GL_COUNT(glBindFramebuffer(GL_READ_FRAMEBUFFER, from));
+        GL_COUNT(glBindFramebuffer(GL_DRAW_FRAMEBUFFER, to));
+        GL_COUNT(glBlitFramebuffer(source.x0, source.y0, source.x1, source.y1, source.x0 + dx, source.y0 + dy, source.x1 + dx, source.y1 + dy, GL_DEPTH_BUFFER_BIT, GL_NEAREST));
+    }
+    
+    // past maxStaticRects a rectangle is merged into the one it grows the least
+    void AddStaticRect(int c, const Rect& r)
+    {
+        std::vector<Rect>& rects = cascades[c].staticRects;
+        if(r.IsEmpty()) return;
+        if(rects.size() < maxStaticRects)
+        {
+            rects.push_back(r);
+            return;
+        }
+        int best = 0;
+        long bestGrowth = 0;
+        for(int i = 0; i < (int)rects.size(); i++)
+        {
+            Rect merged = rects[i];
+            merged.Add(r);
+            long growth = merged.GetArea() - rects[i].GetArea();
+            if(i == 0 || growth < bestGrowth) { best = i; bestGrowth = growth; }
+        }
+        rects[best].Add(r);
+    }
+    
+    // the depths that stay in the box move by whole texels, since the center is snapped to them and
+    // keeps its distance to the light. They are shifted through the combined layer, which is rebuilt
+    // anyway, and the strips the box uncovered are left for Render to draw
+    void Scroll(int c, int dx, int dy)
+    {
+        Cascade& cascade = cascades[c];
+        std::vector<Rect> pending;
+        pending.swap(cascade.staticRects);
+        if(abs(dx) >= size || abs(dy) >= size)
+        {
+            AddStaticRect(c, Rect(0, 0, size, size));
+            return;
+        }
+        
+        SaveTarget();
+        Rect kept(std::max(dx, 0), std::max(dy, 0), size + std::min(dx, 0), size + std::min(dy, 0));
+        Blit(cascade.framebuffers[staticLayer], cascade.framebuffers[combinedLayer], kept, -dx, -dy);
+        Rect shifted(kept.x0 - dx, kept.y0 - dy, kept.x1 - dx, kept.y1 - dy);
+        Blit(cascade.framebuffers[combinedLayer], cascade.framebuffers[staticLayer], shifted, 0, 0);
+        RestoreTarget();
+        
+        for(int i = 0; i < (int)pending.size(); i++)
+        {
+            Rect r = pending[i];
+            AddStaticRect(c, Rect(std::max(r.x0 - dx, 0), std::max(r.y0 - dy, 0), std::min(r.x1 - dx, size), std::min(r.y1 - dy, size)));
+        }
+        if(dx > 0) AddStaticRect(c, Rect(size - dx, 0, size, size));
+        if(dx < 0) AddStaticRect(c, Rect(0, 0, -dx, size));
+        if(dy > 0) AddStaticRect(c, Rect(0, size - dy, size, size));
+        if(dy < 0) AddStaticRect(c, Rect(0, 0, size, -dy));
+    }
+    
+public:
+    ShadowMap()
+    {
+        for(int i = 0; i < layerCount; i++) textures[i] = 0;
+        size = defaultSize;
+        cascadeCount = 0;
+        for(int c = 0; c < maxShadowCascades; c++)
+        {
+            Cascade& cascade = cascades[c];
+            for(int i = 0; i < layerCount; i++) cascade.framebuffers[i] = 0;
+            cascade.end = cascade.distance = cascade.radius = cascade.halfExtent = 0;
+            cascade.centerU = cascade.centerV = cascade.centerW = 0;
+            cascade.placed = cascade.combinedValid = false;
+            cascade.movingSignature = 0;
+        }
+        oriented = false;
+        block = ShadowBlock();
+        staticRenders = combinedRenders = 0;
+    }
+    
+    ~ShadowMap() { Release(); }
+    
+    // allocates count layers of size x size texels; every cascade starts over
+    void Configure(int count, int mapSize)
+    {
+        Release();
+        int maxSize = 0;
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+        cascadeCount = std::max(1, std::min(count, maxShadowCascades));
+        size = std::max(1, maxSize > 0 ? std::min(mapSize, maxSize) : mapSize);
+        for(int c = 0; c < maxShadowCascades; c++)
+        {
+            cascades[c].placed = cascades[c].combinedValid = false;
+            cascades[c].radius = 0;
+            cascades[c].staticRects.clear();
+        }
+        
+        // outside the map the border depth of 1 passes every comparison, so what the box misses is lit
+        const float border[4] = {1, 1, 1, 1};
+        int previous = 0;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+        for(int i = 0; i < layerCount; i++)
+        {
+            glGenTextures(1, &textures[i]);
+            glBindTexture(GL_TEXTURE_2D_ARRAY, textures[i]);
+            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, size, size, cascadeCount, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+            glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, border);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+            
+            for(int c = 0; c < cascadeCount; c++)
+            {
+                glGenFramebuffers(1, &cascades[c].framebuffers[i]);
+                glBindFramebuffer(GL_FRAMEBUFFER, cascades[c].framebuffers[i]);
+                glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, textures[i], 0, c);
+                glDrawBuffer(GL_NONE);
+                glReadBuffer(GL_NONE);
+                if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("Shadow map framebuffer incomplete\n");
+            }
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, previous);
+        glState.Reset();
+    }
+    
+    int GetCascadeCount() { return cascadeCount; }
+    int GetSize() { return size; }
+    
+    // follows the light and the camera's frustum; true if a box moved
+    bool Fit(vec3 lightDirection, Camera& camera)
+    {
+        vec3 d = lightDirection.normalize();
+        bool turned = !oriented || d.x != direction.x || d.y != direction.y || d.z != direction.z;
+        if(turned)
+        {
+            vec3 up = fabsf(d.y) > 0.99f ? vec3(1, 0, 0) : vec3(0, 1, 0);
+            direction = d;
+            u = cross(up, d).normalize();
+            v = cross(d, u);
+            oriented = true;
+        }
+        
+        Split(camera);
+        vec3 eye = camera.GetEyePosition(), ahead = camera.GetAhead();
+        bool moved = false;
+        for(int c = 0; c < cascadeCount; c++)
+            if(Place(c, eye + ahead * cascades[c].distance, turned)) moved = true;
+        
+        // unused cascades map everything off their texture
+        for(int c = cascadeCount; c < maxShadowCascades; c++)
+        {
+            block.cascadeScales[c] = 0;
+            block.cascadeOffsetsU[c] = block.cascadeOffsetsV[c] = block.cascadeOffsetsW[c] = -1;
+            block.normalOffsets[c] = 0;
+        }
+        block.lightRotation = mat4(
+                                   u.x, v.x, direction.x, 0.0f,
+                                   u.y, v.y, direction.y, 0.0f,
+                                   u.z, v.z, direction.z, 0.0f,
+                                   0.0f, 0.0f, 0.0f, 1.0f);
+        block.depthScale = -1 / (2 * depthRange);
+        block.cascadeCount = cascadeCount;
+        shadowBlock.Update(&block);
+        return moved;
+    }
+    
+    // a cascade's box as clip planes, for culling the casters
+    const Frustum& GetFrustum(int c) { return cascades[c].frustum; }
+    vec3 GetLightPosition(int c) { return u * cascades[c].centerU + v * cascades[c].centerV + direction * (cascades[c].centerW + depthRange); }
+    float GetCascadeEnd(int c) { return cascades[c].end; }
+    float GetTexelSize(int c) { return 2 * cascades[c].halfExtent / size; }
+    
+    // the texels of a cascade a bounding sphere covers, with one to spare
+    Rect GetRect(int c, const vec4& sphere)
+    {
+        Cascade& cascade = cascades[c];
+        vec4 clip = vec4(sphere.v[0], sphere.v[1], sphere.v[2], 1) * cascade.lightViewProjection;
+        float radius = sphere.v[3] / cascade.halfExtent + 1.0f / size;
+        float x0 = (clip.v[0] - radius) * 0.5f + 0.5f, x1 = (clip.v[0] + radius) * 0.5f + 0.5f;
+        float y0 = (clip.v[1] - radius) * 0.5f + 0.5f, y1 = (clip.v[1] + radius) * 0.5f + 0.5f;
+        return Rect(std::max(0, (int)floorf(x0 * size)), std::max(0, (int)floorf(y0 * size)),
+                    std::min(size, (int)ceilf(x1 * size)), std::min(size, (int)ceilf(y1 * size)));
+    }
+    
+    // a static caster changed where it was or is drawn; a caster without bounds covers the whole cascade
+    void AddStaticChange(int c, const vec4& sphere) { AddStaticRect(c, GetRect(c, sphere)); }
+    void AddUnboundedStaticChange(int c) { cascades[c].staticRects.assign(1, Rect(0, 0, size, size)); }
+    
+    // whether the next Render redraws a static layer, and a static caster has to be drawn for it
+    bool IsStaticStale(int c) { return !cascades[c].staticRects.empty(); }
+    bool IsStaticStale(int c, const vec4& sphere)
+    {
+        std::vector<Rect>& rects = cascades[c].staticRects;
+        Rect r = GetRect(c, sphere);
+        for(int i = 0; i < (int)rects.size(); i++)
+            if(rects[i].Overlaps(r)) return true;
+        return false;
+    }
+    
+    // collects where the moving casters are before Render
+    void ClearMovingBounds()
+    {
+        for(int c = 0; c < cascadeCount; c++) cascades[c].movingBounds = Rect();
+    }
+    void AddMovingBounds(int c, const vec4& sphere) { cascades[c].movingBounds.Add(GetRect(c, sphere)); }
+    void AddUnboundedMovingCaster(int c) { cascades[c].movingBounds = Rect(0, 0, size, size); }
+    
+    // forces the next Render to redraw the static layers, or only the moving casters
+    void Invalidate(bool staticCasters)
+    {
+        for(int c = 0; c < cascadeCount; c++)
+        {
+            if(staticCasters) cascades[c].staticRects.assign(1, Rect(0, 0, size, size));
+            cascades[c].combinedValid = false;
+        }
+    }
+    
+    // the signatures identify the state of the moving casters in each cascade; its layer is redrawn if
+    // that differs from the one it was drawn with or the static layer changed under it.
+    // drawCasters(c, false) draws the stale static casters of cascade c, drawCasters(c, true) the moving ones
+    void Render(const uint64_t* movingCasters, const std::function<void(int, bool)>& drawCasters)
+    {
+        for(int c = 0; c < cascadeCount; c++)
+        {
+            Cascade& cascade = cascades[c];
+            if(cascade.staticRects.empty() && cascade.combinedValid && movingCasters[c] == cascade.movingSignature) continue;
+            
+            Rect staticBounds;
+            if(!cascade.staticRects.empty())
+            {
+                // cleared one by one but drawn at once: outside the cleared rectangles the casters
+                // rasterize to the depths already there
+                Begin(c, staticLayer);
+                for(int i = 0; i < (int)cascade.staticRects.size(); i++)
+                {
+                    Scissor(cascade.staticRects[i]);
+                    GL_COUNT(glClear(GL_DEPTH_BUFFER_BIT));
+                    staticBounds.Add(cascade.staticRects[i]);
+                }
+                Scissor(staticBounds);
+                drawCasters(c, false);
+                End();
+                cascade.staticRects.clear();
+                staticRenders++;
+            }
+            
+            // the copy of the static layer only needs restoring where that changed or moving casters were or are
+            Rect rect(0, 0, size, size);
+            if(cascade.combinedValid)
+            {
+                rect = staticBounds;
+                rect.Add(cascade.movingBounds);
+                rect.Add(cascade.drawnBounds);
+            }
+            if(!rect.IsEmpty())
+            {
+                Begin(c, combinedLayer);
+                Scissor(rect);
+                GL_COUNT(glBindFramebuffer(GL_READ_FRAMEBUFFER, cascade.framebuffers[staticLayer]));
+                GL_COUNT(glBlitFramebuffer(rect.x0, rect.y0, rect.x1, rect.y1, rect.x0, rect.y0, rect.x1, rect.y1, GL_DEPTH_BUFFER_BIT, GL_NEAREST));
+                drawCasters(c, true);
+                End();
+            }
+            cascade.drawnBounds = cascade.movingBounds;
+            cascade.movingSignature = movingCasters[c];
+            cascade.combinedValid = true;
+            combinedRenders++;
+        }
+    }
+    
+    // leaves the active unit at 0, where the materials expect it
+    void Bind()
+    {
+        glState.ActiveTexture(shadowMapUnit);
+        glState.BindTexture(GL_TEXTURE_2D_ARRAY, textures[combinedLayer]);
+        glState.ActiveTexture(0);
+    }
+    
+    int GetStaticRenders() { return staticRenders; }
+    int GetCombinedRenders() { return combinedRenders; }
+};
+
+// passes run in this order; the light changes between them, within a pass draws are sorted freely
+enum RenderPass
+{
+    shadowPass,     // shadow casters into the shadow map
+    sunlitPass,     // the avatar, still under the directional light
+    spotlitPass,    // everything else, lit by the avatar's spotlight
+    renderPassCount
+};
+
+// one draw of the frame: a single object or a whole instance group, with the shader it runs
+struct RenderItem
+{
+    int pass;
+    Shader* shader;
+    Object* object;
+    MeshInstances* instances;
+    int cascade;        // of the shadow map, for the shadow pass
+};
+
+// collects the draws of a frame and replays them ordered by a 64-bit key of
+// pass | program | material | texture | depth, so draws sharing state end up next to each other
+// and glState can drop the repeated binds; opaque draws go front to back within equal state
+class RenderQueue
+{
+    struct SortEntry
+    {
+        uint64_t key;
+        unsigned int index;
+    };
+    
+    static const int depthBits = 24;
+    static constexpr float maxSortDepth = 1000.0f;
+    
+    std::vector<RenderItem> items;
+    std::vector<SortEntry> entries, scratch;
+    vec3 eye;
+    
+    // least significant digit first, one byte per round; rounds whose byte is the same in every key are skipped
+    void RadixSort()
+    {
+        int n = (int)entries.size();
+        scratch.resize(n);
+        unsigned int counts[8][256];
+        memset(counts, 0, sizeof(counts));
+        for(int i = 0; i < n; i++)
+            for(int b = 0; b < 8; b++) counts[b][(entries[i].key >> (b * 8)) & 0xFF]++;
+        
+        for(int b = 0; b < 8; b++)
+        {
+            unsigned int* count = counts[b];
+            if(count[(entries[0].key >> (b * 8)) & 0xFF] == (unsigned int)n) continue;
+            
+            unsigned int offset = 0;
+            for(int d = 0; d < 256; d++)
+            {
+                unsigned int c = count[d];
+                count[d] = offset;
+                offset += c;
+            }
+            for(int i = 0; i < n; i++) scratch[count[(entries[i].key >> (b * 8)) & 0xFF]++] = entries[i];
+            entries.swap(scratch);
+        }
+    }
+    
+public:
+    void Begin(const vec3& eyePosition)
+    {
+        items.clear();
+        entries.clear();
+        eye = eyePosition;
+    }
+    
+    void Add(int pass, Shader* shader, Material* material, vec3 position, Object* object, MeshInstances* instances = NULL, int cascade = 0)
+    {
+        float depth = (position - eye).length() / maxSortDepth;
+        uint64_t depthKey = (uint64_t)(fminf(depth, 1.0f) * ((1 << depthBits) - 1));
+        
+        uint64_t key = (uint64_t)pass << 60;
+        key |= (uint64_t)(shader->GetSortId() & 0xFF) << 52;
+        key |= (uint64_t)(material ? material->GetSortId() & 0xFFF : 0) << 40;
+        key |= (uint64_t)(material ? material->GetTextureId() & 0xFFFF : 0) << 24;
+        key |= depthKey;
+        
+        RenderItem item = { pass, shader, object, instances, cascade };
+        SortEntry entry = { key, (unsigned int)items.size() };
+        items.push_back(item);
+        entries.push_back(entry);
+    }
+    
+    void Sort()
+    {
+        if(!entries.empty()) RadixSort();
+    }
+    
+    // beginPass runs before the first draw of every pass that has draws
+    void Submit(const std::function<void(int)>& beginPass)
+    {
+        int pass = -1;
+        for(int i = 0; i < (int)entries.size(); i++)
+        {
+            RenderItem& item = items[entries[i].index];
+            if(item.pass != pass)
+            {
+                pass = item.pass;
+                beginPass(pass);
+            }
+            
+            // the name costs a virtual call, so it is only looked up while profiling
+            const char* scopeName = !profiler.IsEnabled() ? NULL : item.object ? item.object->GetName() : "instances";
+            ProfileScope scope(scopeName, true);
+            if(pass == shadowPass)
+            {
+                if(item.object) item.object->DrawShadow(item.shader);
+                else item.instances->DrawShadow(item.shader, item.cascade);
+            }
+            else
+            {
+                if(item.object) item.object->Draw();
+                else item.instances->Draw(item.shader);
+            }
+        }
+    }
+};
+
+// uniform grid over the XZ plane that buckets ids by position, for range and nearest queries that
+// only look at the cells around the query point; an id changes buckets only when it crosses a cell border
+class SpatialGrid
+{
+    struct Entry
+    {
+        float x, z;
+        int64_t cell;
+        int slot;       // index in the cell's id list
+        bool present;
+    };
+    
+    float cellSize;
+    std::unordered_map<int64_t, std::vector<int> > cells;
+    std::vector<Entry> entries;
+    int count;
+    
+    int CellCoordinate(float v) const { return (int)floorf(v / cellSize); }
+    static int64_t CellKey(int cx, int cz) { return ((int64_t)cx << 32) | (uint32_t)cz; }
+    
+    void Link(int id, int64_t cell)
+    {
+        std::vector<int>& ids = cells[cell];
+        entries[id].cell = cell;
+        entries[id].slot = (int)ids.size();
+        ids.push_back(id);
+    }
+    
+    // swaps the last id of the cell into the freed slot
+    void Unlink(int id)
+    {
+        std::unordered_map<int64_t, std::vector<int> >::iterator it = cells.find(entries[id].cell);
+        std::vector<int>& ids = it->second;
+        int last = ids.back();
+        ids[entries[id].slot] = last;
+        entries[last].slot = entries[id].slot;
+        ids.pop_back();
+        if(ids.empty()) cells.erase(it);
+    }
+    
+public:
+    SpatialGrid(float cellSize = 4.0f) : cellSize(cellSize), count(0) {}
+    
+    void Clear()
+    {
+        cells.clear();
+        entries.clear();
+        count = 0;
+    }
+    
+    int GetCount() const { return count; }
+    
+    void Insert(int id, float x, float z)
+    {
+        if(id >= (int)entries.size())
+        {
+            Entry empty = { 0, 0, 0, 0, false };
+            entries.resize(id + 1, empty);
+        }
+        if(entries[id].present) { Move(id, x, z); return; }
+        entries[id].x = x; entries[id].z = z;
+        entries[id].present = true;
+        Link(id, CellKey(CellCoordinate(x), CellCoordinate(z)));
+        count++;
+    }
+    
+    void Remove(int id)
+    {
+        if(id >= (int)entries.size() || !entries[id].present) return;
+        Unlink(id);
+        entries[id].present = false;
+        count--;
+    }
+    
+    void Move(int id, float x, float z)
+    {
+        Entry& entry = entries[id];
+        entry.x = x; entry.z = z;
+        int64_t cell = CellKey(CellCoordinate(x), CellCoordinate(z));
+        if(cell == entry.cell) return;
+        Unlink(id);
+        Link(id, cell);
+    }
+    
+    // appends every id within radius of (x, z)
+    void QueryRange(float x, float z, float radius, std::vector<int>& result) const
+    {
+        int x0 = CellCoordinate(x - radius), x1 = CellCoordinate(x + radius);
+        int z0 = CellCoordinate(z - radius), z1 = CellCoordinate(z + radius);
+        float radiusSquared = radius * radius;
+        
+        // a huge range would visit mostly empty cells, so walk the occupied ones instead
+        if((int64_t)(x1 - x0 + 1) * (z1 - z0 + 1) > (int64_t)cells.size())
+        {
+            for(std::unordered_map<int64_t, std::vector<int> >::const_iterator it = cells.begin(); it != cells.end(); ++it)
+                for(int i = 0; i < (int)it->second.size(); i++)
+                {
+                    const Entry& entry = entries[it->second[i]];
+                    float dx = entry.x - x, dz = entry.z - z;
+                    if(dx * dx + dz * dz <= radiusSquared) result.push_back(it->second[i]);
+                }
+            return;
+        }
+        
+        for(int cx = x0; cx <= x1; cx++)
+            for(int cz = z0; cz <= z1; cz++)
+            {
+                std::unordered_map<int64_t, std::vector<int> >::const_iterator it = cells.find(CellKey(cx, cz));
+                if(it == cells.end()) continue;
+                for(int i = 0; i < (int)it->second.size(); i++)
+                {
+                    const Entry& entry = entries[it->second[i]];
+                    float dx = entry.x - x, dz = entry.z - z;
+                    if(dx * dx + dz * dz <= radiusSquared) result.push_back(it->second[i]);
+                }
+            }
+    }
+    
+    // closest id within maxRadius of (x, z) other than exclude, -1 if there is none; searches rings of
+    // cells outwards and stops once the next ring is farther away than the best hit
+    int QueryNearest(float x, float z, float maxRadius, int exclude = -1) const
+    {
+        int cx = CellCoordinate(x), cz = CellCoordinate(z);
+        int maxRing = (int)ceilf(maxRadius / cellSize) + 1;
+        int best = -1;
+        float bestSquared = maxRadius * maxRadius;
+        
+        for(int ring = 0; ring <= maxRing; ring++)
+        {
+            // the query point lies in the center cell, so this ring is at least ring - 1 cells away
+            float ringDistance = (ring - 1) * cellSize;
+            if(ringDistance > 0 && ringDistance * ringDistance > bestSquared) break;
+            
+            int side = 2 * ring;
+            int perimeter = ring ? 4 * side : 1;
+            for(int k = 0; k < perimeter; k++)
+            {
+                // walks the border of the ring's square, one side after the other
+                int i, j;
+                int edge = ring ? k / side : 0, step = ring ? k % side : 0;
+                if(edge == 0) { i = -ring + step; j = -ring; }
+                else if(edge == 1) { i = ring; j = -ring + step; }
+                else if(edge == 2) { i = ring - step; j = ring; }
+                else { i = -ring; j = ring - step; }
+                
+                std::unordered_map<int64_t, std::vector<int> >::const_iterator it = cells.find(CellKey(cx + i, cz + j));
+                if(it == cells.end()) continue;
+                for(int n = 0; n < (int)it->second.size(); n++)
+                {
+                    int id = it->second[n];
+                    if(id == exclude) continue;
+                    float dx = entries[id].x - x, dz = entries[id].z - z;
+                    float distanceSquared = dx * dx + dz * dz;
+                    if(distanceSquared <= bestSquared) { bestSquared = distanceSquared; best = id; }
+                }
+            }
+        }
+        return best;
+    }
+};
+
+// props the world tiles are populated with
+enum PropKind
+{
+    treeProp, balloonProp, ballProp,
+    propKindCount
+};
+
+struct PropPlacement
+{
+    int kind;
+    vec3 position;
+    float scale;
+    float orientation;
+};
+
+// the endless ground around the avatar, cut into square tiles; a tile's props follow from its coordinates
+// and the world seed alone and are generated on the loader's workers, then placed by the simulation with
+// objects taken from fixed pools and handed back once the tile leaves the ring, so memory and per-frame
+// work stay bounded however far the avatar walks
+class TileStreamer
+{
+public:
+    static constexpr float tileSize = 8.0f;
+    static const int ringRadius = 2;                                        // tiles kept on every side of the avatar's
+    static const int maxTiles = (2 * ringRadius + 3) * (2 * ringRadius + 3); // tiles are retired one tile late
+    static const int maxPropsPerTile[propKindCount];
+    
+private:
+    struct Tile
+    {
+        int x, z;
+        int ticket;                 // identifies the generation request that fills this tile
+        bool ready;
+        std::vector<int> slots;     // scene objects placed on this tile
+    };
+    
+    struct GeneratedTile
+    {
+        int64_t key;
+        int ticket;
+        std::vector<PropPlacement> props;
+    };
+    
+    std::vector<Object*>* objects;
+    SpatialGrid* grid;
+    unsigned int seed;
+    std::unordered_map<int64_t, Tile> tiles;
+    std::vector<int> freeSlots[propKindCount];
+    std::vector<int> slotKinds;
+    int centerX, centerZ;
+    bool started;
+    int nextTicket;
+    
+    int tilesGenerated, peakTiles, peakSlotsInUse, slotsInUse;
+    
+    // tiles the workers finished, waiting for the simulation to place them
+    std::mutex generatedMutex;
+    std::vector<GeneratedTile> generated;
+    std::vector<GeneratedTile> placing;
+    std::atomic<int> generating;
+    bool waitForTiles;
+    
+    static int64_t TileKey(int x, int z) { return ((int64_t)x << 32) | (uint32_t)z; }
+    
+    // the authored scene around the origin is left as it is
+    static bool IsReserved(float x, float z) { return x * x + z * z < 100.0f; }
+    
+    static std::vector<PropPlacement> Generate(unsigned int worldSeed, int tileX, int tileZ)
+    {
+        // hash of the tile coordinates feeding a linear congruential generator
+        unsigned int state = worldSeed ^ ((unsigned int)tileX * 73856093u) ^ ((unsigned int)tileZ * 19349663u);
+        state = state * 2654435761u + 1013904223u;
+        auto next = [&state]() { state = state * 1664525u + 1013904223u; return (state >> 8) / 16777216.0f; };
+        
+        std::vector<PropPlacement> props;
+        for(int kind = 0; kind < propKindCount; kind++)
+        {
+            int count = (int)(next() * (maxPropsPerTile[kind] + 1));
+            for(int i = 0; i < count; i++)
+            {
+                float x = (tileX + next()) * tileSize;
+                float z = (tileZ + next()) * tileSize;
+                float r = next();
+                if(IsReserved(x, z)) continue;
+                
+                PropPlacement prop;
+                prop.kind = kind;
+                prop.orientation = r * 360;
+                if(kind == treeProp) { prop.position = vec3(x, -0.5, z); prop.scale = 0.04f + 0.02f * r; }
+                else if(kind == balloonProp) { prop.position = vec3(x, 1.5f + r, z); prop.scale = 0.1f; }
+                else { prop.position = vec3(x, -0.6, z); prop.scale = 0.2f; }
+                props.push_back(prop);
+            }
+        }
+        return props;
+    }
+    
+    // runs on the simulation thread once the tile's props are generated
+    void Populate(int64_t key, int ticket, const std::vector<PropPlacement>& props)
+    {
+        std::unordered_map<int64_t, Tile>::iterator it = tiles.find(key);
+        if(it == tiles.end() || it->second.ticket != ticket) return;
+        Tile& tile = it->second;
+        
+        for(int i = 0; i < (int)props.size(); i++)
+        {
+            std::vector<int>& pool = freeSlots[props[i].kind];
+            if(pool.empty()) continue;
+            int slot = pool.back();
+            pool.pop_back();
+            
+            Object* object = (*objects)[slot];
+            float scale = props[i].scale;
+            object->Place(props[i].position, vec3(scale, scale, scale), props[i].orientation);
+            object->SetActive(true);
+            grid->Insert(slot, props[i].position.x, props[i].position.z);
+            tile.slots.push_back(slot);
+        }
+        tile.ready = true;
+        tilesGenerated++;
+        slotsInUse += (int)tile.slots.size();
+        peakSlotsInUse = std::max(peakSlotsInUse, slotsInUse);
+    }
+    
+    void PopulateGenerated()
+    {
+        {
+            std::lock_guard<std::mutex> lock(generatedMutex);
+            placing.swap(generated);
+        }
+        // in the order they were requested, not the order the workers finished them
+        std::sort(placing.begin(), placing.end(), [](const GeneratedTile& a, const GeneratedTile& b) { return a.ticket < b.ticket; });
+        for(int i = 0; i < (int)placing.size(); i++) Populate(placing[i].key, placing[i].ticket, placing[i].props);
+        placing.clear();
+    }
+    
+    void Retire(Tile& tile)
+    {
+        for(int i = 0; i < (int)tile.slots.size(); i++)
+        {
+            int slot = tile.slots[i];
+            (*objects)[slot]->SetActive(false);
+            grid->Remove(slot);
+            freeSlots[slotKinds[slot]].push_back(slot);
+        }
+        slotsInUse -= (int)tile.slots.size();
+        tile.slots.clear();
+    }
+    
+public:
+    TileStreamer() : objects(NULL), grid(NULL), seed(2019), centerX(0), centerZ(0), started(false), nextTicket(0),
+        tilesGenerated(0), peakTiles(0), peakSlotsInUse(0), slotsInUse(0), generating(0), waitForTiles(false) {}
+    
+    // the scene creates enough objects of each kind for a full ring up front; they start out inactive
+    void Initialize(std::vector<Object*>* sceneObjects, SpatialGrid* sceneGrid, unsigned int worldSeed)
+    {
+        objects = sceneObjects;
+        grid = sceneGrid;
+        seed = worldSeed;
+    }
+    
+    // waits for the tiles it requests instead of placing them whenever they are ready, so a replayed
+    // run finds the same props on the same step every time
+    void SetWaitForTiles(bool wait) { waitForTiles = wait; }
+    
+    void AddSlot(int kind, int objectIndex)
+    {
+        if(objectIndex >= (int)slotKinds.size()) slotKinds.resize(objectIndex + 1, -1);
+        slotKinds[objectIndex] = kind;
+        freeSlots[kind].push_back(objectIndex);
+        (*objects)[objectIndex]->SetActive(false);
+    }
+    
+    // places the tiles generated since the last call, requests the tiles of the ring around the avatar,
+    // nearest first, and retires the ones left behind
+    void Update(const vec3& avatar)
+    {
+        PopulateGenerated();
+        int cx = (int)floorf(avatar.x / tileSize), cz = (int)floorf(avatar.z / tileSize);
+        if(started && cx == centerX && cz == centerZ) return;
+        started = true;
+        centerX = cx;
+        centerZ = cz;
+        
+        for(std::unordered_map<int64_t, Tile>::iterator it = tiles.begin(); it != tiles.end(); )
+        {
+            if(std::max(abs(it->second.x - cx), abs(it->second.z - cz)) > ringRadius + 1)
+            {
+                Retire(it->second);
+                it = tiles.erase(it);
+            }
+            else ++it;
+        }
+        
+        for(int ring = 0; ring <= ringRadius; ring++)
+            for(int dx = -ring; dx <= ring; dx++)
+                for(int dz = -ring; dz <= ring; dz++)
+                {
+                    if(std::max(abs(dx), abs(dz)) != ring) continue;
+                    int x = cx + dx, z = cz + dz;
+                    int64_t key = TileKey(x, z);
+                    if(tiles.count(key)) continue;
+                    
+                    Tile& tile = tiles[key];
+                    tile.x = x; tile.z = z;
+                    tile.ticket = nextTicket++;
+                    tile.ready = false;
+                    
+                    // nothing to upload, the props wait for the simulation's next update
+                    int ticket = tile.ticket;
+                    unsigned int worldSeed = seed;
+                    generating++;
+                    loader.Load([this, worldSeed, key, ticket, x, z] {
+                                    GeneratedTile done = { key, ticket, Generate(worldSeed, x, z) };
+                                    std::lock_guard<std::mutex> lock(generatedMutex);
+                                    generated.push_back(done);
+                                    generating--;
+                                },
+                                [] {});
+                }
+        peakTiles = std::max(peakTiles, (int)tiles.size());
+        
+        // without loader threads the tiles were generated right away
+        if(waitForTiles)
+            while(generating > 0) std::this_thread::yield();
+        PopulateGenerated();
+    }
+    
+    int GetTileCount() { return (int)tiles.size(); }
+    int GetPeakTileCount() { return peakTiles; }
+    int GetTilesGenerated() { return tilesGenerated; }
+    int GetPeakSlotsInUse() { return peakSlotsInUse; }
+};
+
+const int TileStreamer::maxPropsPerTile[propKindCount] = { 4, 1, 1 };
+
+// --no-instancing draws every object on its own, --stress-trees N scatters N more trees on the ground
+bool instancingEnabled = true;
+int stressTrees = 0;
+
+// --no-culling draws objects outside the view as well
+bool cullingEnabled = true;
+
+// --no-streaming keeps the world to the authored scene
+bool streamingEnabled = true;
+// set when recording or replaying input, see TileStreamer::SetWaitForTiles
+bool waitForTiles = false;
+
+// --shadow-cascades and --shadow-size set the shadow map's cascades and their resolution, the c key
+// cycles through one to maxShadowCascades cascades
+int shadowCascadeCount = ShadowMap::defaultCascadeCount;
+int shadowMapSize = ShadowMap::defaultSize;
+
+// what rendering needs of the simulated objects after a step, by object index: the pose each started
+// and ended the step with, and whether it is in the world at all
+struct SceneState
+{
+    unsigned int step;
+    double time;            // when the step ends, on the simulation clock
+    float stepLength;
+    std::vector<Pose> from, to;
+    std::vector<char> active;
+    
+    SceneState() : step(0), time(0), stepLength(0) {}
+};
+
+// three scene states passed from the simulation to rendering without locks: the simulation fills the back
+// one and swaps it for the middle one, rendering swaps its front one for the middle one when that holds a
+// newer state, so neither waits for the other and no state is read while it is written
+class StateExchange
+{
+    static const int fresh = 4;
+    SceneState states[3];
+    std::atomic<int> middle;
+    int back, front;
+    
+public:
+    StateExchange() : middle(1), back(0), front(2) {}
+    
+    SceneState& GetBack() { return states[back]; }
+    void Publish() { back = middle.exchange(back | fresh) & ~fresh; }
+    
+    // true if a newer state became the front one
+    bool Acquire()
+    {
+        if(!(middle.load() & fresh)) return false;
+        front = middle.exchange(front) & ~fresh;
+        return true;
+    }
+    SceneState& GetFront() { return states[front]; }
+};
+
+class Scene
+{
+    MeshShader *meshShader;
+    MeshShader *spotlightShader;
+    ReflectiveShader *reflectiveShader;
+    InfiniteQuadShader *infiniteShader;
+    ShadowShader *shadowShader;
+    InstancedMeshShader *instancedMeshShader;
+    InstancedShadowShader *instancedShadowShader;
+    TextureCube *environmentMap;
+    EnvironmentShader *envShader;
+    MarbleShader *marbleShader;
+    
+    std::vector<Material*> materials;
+    std::vector<Mesh*> meshes;
+    std::vector<Object*> objects;
+    
+    // objects that share a mesh with the default shader are drawn as instances
+    std::vector<MeshInstances*> instanceGroups;
+    std::vector<MeshInstances*> objectInstances;
+    
+    Environment *environment;
+    
+    RenderQueue renderQueue;
+    
+    ShadowMap shadowMap;
+    RenderQueue shadowQueue;
+    
+    // how each static caster was when the static layers of the shadow map last drew it, by object
+    // index; drawn has a bit per cascade
+    struct CasterRecord
+    {
+        unsigned int drawn;
+        bool bounded;
+        unsigned int version;
+        vec4 sphere;
+        
+        CasterRecord() : drawn(0), bounded(false), version(0) { }
+    };
+    std::vector<CasterRecord> casterRecords;
+    
+    // every object but the ground by index, and the ones that move without being pushed
+    SpatialGrid grid;
+    std::vector<int> movers;
+    std::vector<int> nearby;
+    
+    // simulation steps taken, and the pose of each object the current step may change from before it did
+    unsigned int step;
+    std::vector<Pose> stepStart;
+    std::vector<unsigned int> stepStarted;
+    
+    // the simulation publishes a state after every step, rendering draws the newest one and blends the
+    // objects that moved during that step
+    StateExchange states;
+    std::vector<int> blending;
+    
+    TileStreamer streamer;
+    
+    // tests every object's bounding sphere against the view frustum, and against the box of each
+    // shadow cascade for the shadow pass
+    void Cull()
+    {
+        Frustum frustum;
+        frustum.Set(camera.GetViewProjectionMatrix());
+        unsigned int allCascades = (1 << shadowMap.GetCascadeCount()) - 1;
+        SceneState& state = states.GetFront();
+        for(int i = 0; i < (int)objects.size(); i++)
+        {
+            if(!state.active[i])
+            {
+                objects[i]->SetVisibility(false, 0);
+                continue;
+            }
+            
+            bool visible = true;
+            unsigned int cascades = allCascades;
+            vec4 sphere;
+            if(cullingEnabled && objects[i]->GetBoundingSphere(sphere))
+            {
+                visible = frustum.IsVisible(sphere);
+                cascades = 0;
+                for(int c = 0; c < shadowMap.GetCascadeCount(); c++)
+                    if(shadowMap.GetFrustum(c).IsVisible(sphere)) cascades |= 1 << c;
+            }
+            objects[i]->SetVisibility(visible, cascades);
+            
+            if(visible) frameStats.visibleObjects++;
+            else frameStats.culledObjects++;
+            if(!cascades) frameStats.culledShadows++;
+        }
+    }
+    
+    // decides what the shadow map draws this frame, cascade by cascade. A static caster placed, moved,
+    // entering or leaving a cascade's box since its static layer drew it marks where it was and where it
+    // is as stale, and only the static casters over stale texels are drawn; the moving casters in a box
+    // hash to a signature that changes when one of them moves, enters or leaves, so the shadow map knows
+    // when to redraw them
+    void SelectShadowCasters(uint64_t* movingCasters)
+    {
+        if(casterRecords.size() != objects.size()) casterRecords.resize(objects.size());
+        int cascadeCount = shadowMap.GetCascadeCount();
+        for(int c = 0; c < cascadeCount; c++) movingCasters[c] = 14695981039346656037ull;
+        shadowMap.ClearMovingBounds();
+        // last object is the ground, which receives shadows but casts none
+        for(int i = 0; i < (int)objects.size() - 1; i++)
+        {
+            Object* object = objects[i];
+            unsigned int inBox = object->GetShadowCascades();
+            vec4 sphere;
+            bool bounded = object->GetBoundingSphere(sphere);
+            unsigned int version = object->GetTransform().GetVersion();
+            
+            if(!object->IsStatic())
+            {
+                for(int c = 0; c < cascadeCount; c++)
+                {
+                    if(!((inBox >> c) & 1)) continue;
+                    movingCasters[c] = (movingCasters[c] ^ ((uint64_t)i << 32 | version)) * 1099511628211ull;
+                    if(bounded) shadowMap.AddMovingBounds(c, sphere);
+                    else shadowMap.AddUnboundedMovingCaster(c);
+                }
+                continue;
+            }
+            
+            CasterRecord& record = casterRecords[i];
+            bool changed = version != record.version || bounded != record.bounded;
+            if(inBox == record.drawn && (!inBox || !changed)) continue;
+            for(int c = 0; c < cascadeCount; c++)
+            {
+                bool was = (record.drawn >> c) & 1, is = (inBox >> c) & 1;
+                if(was == is && (!is || !changed)) continue;
+                if(was)
+                {
+                    if(record.bounded) shadowMap.AddStaticChange(c, record.sphere);
+                    else shadowMap.AddUnboundedStaticChange(c);
+                }
+                if(is)
+                {
+                    if(bounded) shadowMap.AddStaticChange(c, sphere);
+                    else shadowMap.AddUnboundedStaticChange(c);
+                }
+            }
+            record.drawn = inBox;
+            record.bounded = bounded;
+            record.version = version;
+            record.sphere = sphere;
+        }
+        
+        for(int i = 0; i < (int)objects.size() - 1; i++)
+        {
+            Object* object = objects[i];
+            if(!object->IsStatic() || !object->IsShadowVisible()) continue;
+            CasterRecord& record = casterRecords[i];
+            unsigned int stale = 0;
+            for(int c = 0; c < cascadeCount; c++)
+                if(object->IsShadowVisible(c) && shadowMap.IsStaticStale(c) && (!record.bounded || shadowMap.IsStaticStale(c, record.sphere)))
+                    stale |= 1 << c;
+            object->SetVisibility(object->IsVisible(), stale);
+        }
+    }
+    
+    void RenderShadowMap(const uint64_t* movingCasters)
+    {
+        shadowMap.Render(movingCasters, [this](int cascade, bool moving) {
+            shadowQueue.Begin(shadowMap.GetLightPosition(cascade));
+            // last object is the ground, which receives shadows but casts none
+            for(int i = 0; i < (int)objects.size() - 1; i++)
+            {
+                Object* object = objects[i];
+                if(object->IsStatic() == moving) continue;
+                MeshInstances* group = objectInstances[i];
+                if(group && group->GetFirst() != object) continue;
+                
+                vec3 position = object->GetTransform().GetPosition();
+                if(group) { if(group->GetShadowCount(cascade)) shadowQueue.Add(shadowPass, instancedShadowShader, NULL, position, NULL, group, cascade); }
+                else if(object->IsShadowVisible(cascade)) shadowQueue.Add(shadowPass, shadowShader, NULL, position, object, NULL, cascade);
+            }
+            shadowQueue.Sort();
+            shadowQueue.Submit([](int) {});
+        });
+    }
+    
+    // keeps the pose an object starts the current step with, before anything changes it
+    void BeginStep(int i)
+    {
+        if(stepStarted[i] == step) return;
+        objects[i]->GetPose(stepStart[i]);
+        stepStarted[i] = step;
+    }
+    
+    // objects the step did not change are published as they are
+    void PublishState(double time, float dt)
+    {
+        SceneState& state = states.GetBack();
+        state.step = step;
+        state.time = time;
+        state.stepLength = dt;
+        state.from.resize(objects.size());
+        state.to.resize(objects.size());
+        state.active.resize(objects.size());
+        for(int i = 0; i < (int)objects.size(); i++)
+        {
+            objects[i]->GetPose(state.to[i]);
+            state.from[i] = stepStarted[i] == step ? stepStart[i] : state.to[i];
+            state.active[i] = objects[i]->IsActive();
+        }
+        states.Publish();
+    }
+    
+    // hands a newer state to the transforms, and blends what moved by how far time is past its step
+    void ApplyState(double time)
+    {
+        if(states.Acquire())
+        {
+            SceneState& state = states.GetFront();
+            blending.clear();
+            for(int i = 0; i < (int)objects.size(); i++)
+            {
+                objects[i]->GetTransform().Set(state.from[i], state.to[i]);
+                if(state.from[i] != state.to[i]) blending.push_back(i);
+            }
+        }
+        
+        SceneState& state = states.GetFront();
+        float alpha = 1;
+        if(time >= 0 && state.stepLength > 0) alpha = (float)std::max(0.0, std::min(1.0, (time - state.time) / state.stepLength));
+        for(int k = 0; k < (int)blending.size(); k++) objects[blending[k]]->GetTransform().SetBlend(alpha);
+    }
+    
+    // static and moving objects are kept apart, they go into different layers of the shadow map
+    void GroupInstances()
+    {
+        std::map<std::pair<Mesh*, bool>, std::vector<int> > byMesh;
+        for(int i = 0; i < (int)objects.size(); i++)
+            if(objects[i]->GetMesh()->GetShader() == meshShader)
+                byMesh[std::make_pair(objects[i]->GetMesh(), objects[i]->IsStatic())].push_back(i);
+        
+        objectInstances.assign(objects.size(), (MeshInstances*)0);
+        for(std::map<std::pair<Mesh*, bool>, std::vector<int> >::iterator it = byMesh.begin(); it != byMesh.end(); ++it)
+        {
+            if(it->second.size() < 2) continue;
+            MeshInstances* group = new MeshInstances(it->first.first);
+            for(int j = 0; j < (int)it->second.size(); j++)
+            {
+                group->Add(objects[it->second[j]]);
+                objectInstances[it->second[j]] = group;
+            }
+            instanceGroups.push_back(group);
+        }
+    }
+    
 public:
-    CarObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
-    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    Scene()
     {
-        shader = m->GetShader();
-        mesh = m;
+        meshShader = 0;
+        spotlightShader = 0;
+        reflectiveShader = 0;
+        infiniteShader = 0;
+        shadowShader = 0;
+        instancedMeshShader = 0;
+        instancedShadowShader = 0;
+        environmentMap = 0;
+        envShader = 0;
+        marbleShader = 0;
+        step = 0;
+    }
+    
+    void Initialize()
+    {
+        meshShader = new MeshShader();
+        spotlightShader = new MeshShader();
+        reflectiveShader = new ReflectiveShader();
+        infiniteShader = new InfiniteQuadShader();
+        shadowShader = new ShadowShader();
+        instancedMeshShader = new InstancedMeshShader();
+        instancedShadowShader = new InstancedShadowShader();
+        marbleShader = new MarbleShader();
+        shadowMap.Configure(shadowCascadeCount, shadowMapSize);
+        
+        std::string directory = meshDirectory;
+        environmentMap = new TextureCube(directory + "environment/posx512.jpg",
+                        directory + "environment/negx512.jpg",
+                        directory + "environment/posy512.jpg",
+                        directory + "environment/negy512.jpg",
+                        directory + "environment/posz512.jpg",
+                        directory + "environment/negz512.jpg");
+        
+        envShader = new EnvironmentShader();
+        
+        vec3 diffuse_ka = vec3(0.1, 0.1, 0.1);
+        vec3 diffuse_kd = vec3(0.9, 0.9, 0.9);
+        vec3 diffuse_ks = vec3(0.0, 0.0, 0.0);
+        float diffuse_shininess = 0;
+
+        
+        vec3 specular_ka = vec3(0.1, 0.1, 0.1);
+        vec3 specular_kd = vec3(0.6, 0.6, 0.6);
+        vec3 specular_ks = vec3(0.3, 0.3, 0.3);
+        float specular_shininess = 50;
+
+        // every texture and mesh comes from the asset registry, so repeated files are loaded once
+        materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, assets.AcquireTexture(directory + "tigger/tigger.png"), environmentMap));
+        meshes.push_back(new Mesh(assets.AcquireMesh(directory + "tigger/tigger.obj"), materials[0]));
+        Object* object = new AvatarObject(meshes[0], vec3(0.0, -1.0, 0.0), vec3(0.05, 0.05, 0.05), -60.0);
+        objects.push_back(object);
+        
+        materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, assets.AcquireTexture(directory + "tree/tree.png"), environmentMap));
+        meshes.push_back(new Mesh(assets.AcquireMesh(directory + "tree/tree.obj"), materials[1]));
+        Object* object2 = new BackgroundObject(meshes[1], vec3(-2, -0.5, 0.5), vec3(0.06, 0.06, 0.06), -60.0);
+        objects.push_back(object2);
+        
+        materials.push_back(new Material(meshShader, specular_ka, specular_kd, specular_ks, specular_shininess, assets.AcquireTexture(directory + "tree/tree.png"), environmentMap));
+        meshes.push_back(new Mesh(assets.AcquireMesh(directory + "tree/tree.obj"), materials[2]));
+        Object* object3 = new BackgroundObject(meshes[2], vec3(-1, -0.8, 4), vec3(0.03, 0.03, 0.03), 120.0);
+        objects.push_back(object3);
+        
+        materials.push_back(new Material(meshShader, specular_ka, specular_kd, specular_ks, specular_shininess, assets.AcquireTexture(directory + "balloon/balloon.png"), environmentMap));
+        meshes.push_back(new Mesh(assets.AcquireMesh(directory + "balloon/balloon.obj"), materials[3]));
+        Object* object4 = new BackgroundObject(meshes[3], vec3(-3, 2, 7), vec3(0.1, 0.1, 0.1), 0);
+        objects.push_back(object4);
+
+        materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, assets.AcquireTexture(directory + "ball/ball.png"), environmentMap));
+        meshes.push_back(new Mesh(assets.AcquireMesh(directory + "ball/ball.obj"), materials[4]));
+        Object* object5 = new RoundObject(meshes[4], vec3(0, -0.6, 1.3), vec3(0.2, 0.2, 0.2), 90);
+        objects.push_back(object5);
+        
+        materials.push_back(new Material(marbleShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, assets.AcquireTexture(directory + "ball/ball.png"), environmentMap));
+        meshes.push_back(new Mesh(assets.AcquireMesh(directory + "ball/ball.obj"), materials[5]));
+        Object* object6 = new RoundObject(meshes[5], vec3(-3, -0.8, 2.5), vec3(0.15, 0.15, 0.15), 90);
+        objects.push_back(object6);
+        
+        
+        vec3 carpos = vec3(2, -0.3, 3);
+        materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, assets.AcquireTexture(directory + "chevy/chevy.png"), environmentMap));
+        meshes.push_back(new Mesh(assets.AcquireMesh(directory + "chevy/chassis.obj"), materials[6]));
+        Object* object7 = new CarObject(meshes[6], carpos, vec3(0.09, 0.09, 0.09), 90);
+        objects.push_back(object7);
+
+        // the four wheels share one mesh so they can be drawn as instances
+        materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, assets.AcquireTexture(directory + "chevy/chevy.png"), environmentMap));
+        meshes.push_back(new Mesh(assets.AcquireMesh(directory + "chevy/wheel.obj"), materials[7]));
+        
+        //vec3 pos = carpos + vec3(1*cos(90), -0.3, -0.6*sin(90));
+        
+        Object* object8 = new WheelObject(meshes[7], carpos + vec3(1, -0.3, -0.6), vec3(0.09, 0.09, 0.09), 90);
+        objects.push_back(object8);
+        Object* object9 = new WheelObject(meshes[7], carpos + vec3(-1.25, -0.3, -0.6), vec3(0.09, 0.09, 0.09), 90);
+        objects.push_back(object9);
+        Object* object10 = new WheelObject(meshes[7], carpos + vec3(1, -0.3, 0.6), vec3(0.09, 0.09, 0.09), 90);
+        objects.push_back(object10);
+        Object* object11 = new WheelObject(meshes[7], carpos + vec3(-1.25, -0.3, 0.6), vec3(0.09, 0.09, 0.09), 90);
+        objects.push_back(object11);
+        
+        // stress test: extra copies of the first tree scattered around the origin at a constant density
+        unsigned int seed = 12345;
+        float radius = 2.0f * sqrtf((float)stressTrees);
+        for(int i = 0; i < stressTrees; i++)
+        {
+            seed = seed * 1664525u + 1013904223u; float x = (seed >> 8) / 16777216.0f;
+            seed = seed * 1664525u + 1013904223u; float z = (seed >> 8) / 16777216.0f;
+            seed = seed * 1664525u + 1013904223u; float r = (seed >> 8) / 16777216.0f;
+            float scale = 0.04f + 0.02f * r;
+            objects.push_back(new BackgroundObject(meshes[1], vec3((x * 2 - 1) * radius, -0.5, (z * 2 - 1) * radius), vec3(scale, scale, scale), r * 360));
+        }
+        
+        // pooled props for the streamed tiles, enough for every tile the ring can hold
+        if(streamingEnabled)
+        {
+            streamer.Initialize(&objects, &grid, 2019);
+            streamer.SetWaitForTiles(waitForTiles);
+            Mesh* propMeshes[propKindCount] = { meshes[1], meshes[3], meshes[4] };
+            for(int kind = 0; kind < propKindCount; kind++)
+                for(int i = 0; i < TileStreamer::maxTiles * TileStreamer::maxPropsPerTile[kind]; i++)
+                {
+                    if(kind == ballProp) objects.push_back(new RoundObject(propMeshes[kind], vec3(0, 0, 0)));
+                    else objects.push_back(new BackgroundObject(propMeshes[kind], vec3(0, 0, 0)));
+                    streamer.AddSlot(kind, (int)objects.size() - 1);
+                }
+        }
+        
+        //environment = new Environment(envShader, environmentMap);
+        
+        materials.push_back(new Material(infiniteShader, specular_ka, specular_kd, specular_ks, specular_shininess, assets.AcquireTexture(directory + "tree/tree.png"), environmentMap));
+        meshes.push_back(new Mesh(assets.Register("InfiniteTexturedQuad", new InfiniteTexturedQuad()), materials.back()));
+        Object* ground = new BackgroundObject(meshes.back(), vec3(0.0, -1.0, 0.0), vec3(10.0, 1.0, 10.0));
+        objects.push_back(ground);
+        
+        if(instancingEnabled) GroupInstances();
+        else objectInstances.assign(objects.size(), (MeshInstances*)0);
+        
+        for(int i = 0; i < (int)objects.size() - 1; i++)
+        {
+            if(!objects[i]->IsActive()) continue;
+            grid.Insert(i, objects[i]->GetPosition().x, objects[i]->GetPosition().z);
+            if(objects[i]->MovesItself()) movers.push_back(i);
+        }
+        
+        if(streamingEnabled) streamer.Update(objects[0]->GetPosition());
+        
+        stepStart.resize(objects.size());
+        stepStarted.assign(objects.size(), 0);
+        PublishState(0, 0);
+    }
+    
+    ~Scene()
+    {
+        loader.Finish();
+        
+        // meshes and materials hand their geometry and textures back to the registry
+        for(int i = 0; i < materials.size(); i++) delete materials[i];
+        for(int i = 0; i < meshes.size(); i++) delete meshes[i];
+        for(int i = 0; i < objects.size(); i++) delete objects[i];
+        for(int i = 0; i < (int)instanceGroups.size(); i++) delete instanceGroups[i];
+        
+        if(meshShader) delete meshShader;
+        if(reflectiveShader) delete reflectiveShader;
+        if(infiniteShader) delete infiniteShader;
+        if(shadowShader) delete shadowShader;
+        if(instancedMeshShader) delete instancedMeshShader;
+        if(instancedShadowShader) delete instancedShadowShader;
+        if(environmentMap) delete environmentMap;
+        if(envShader) delete envShader;
+        if(marbleShader) delete marbleShader;
     }
     
-    void UploadAttributes(Shader* s)
+    // draws the newest state the simulation published, time along on the simulation clock; without a
+    // time the objects are drawn where the step left them
+    void Draw(double time = -1)
     {
-        mat4 T = mat4(
-                      1.0,            0.0,            0.0,            0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      0.0,            0.0,            1.0,            0.0,
-                      position.x,        position.y,        position.z,        1.0);
+        // uploads since the last frame bound textures and vertex arrays behind the cache's back
+        glState.Reset();
+        
+        ApplyState(time);
+        // the helicam follows the avatar where it is drawn
+        Transform& avatar = objects[0]->GetTransform();
+        camera.MoveHelicam(avatar.GetPosition(), avatar.GetOrientation(), 0);
+        camera.UploadAttributes();
+        
+        // shadows are cast from a fixed directional light
+        vec3 source = vec3(9, 20, 9);
+        light.SetDirectionalLightSource(source);
+        //light.SetPointLightSource(source);
+        light.UploadAttributes();
+        shadowMap.Fit(source, camera);
         
-        mat4 InvT = mat4(
-                         1.0,            0.0,            0.0,            0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         0.0,            0.0,            1.0,            0.0,
-                         -position.x,    -position.y,    -position.z,    1.0);
+        uint64_t movingCasters[maxShadowCascades];
+        {
+            ProfileScope scope("cull");
+            Cull();
+            SelectShadowCasters(movingCasters);
+            for(int i = 0; i < (int)instanceGroups.size(); i++) instanceGroups[i]->Update();
+        }
+        
+        {
+            ProfileScope scope("shadow map", true);
+            RenderShadowMap(movingCasters);
+        }
+        shadowMap.Bind();
+        
+        ProfileScope scope("main pass", true);
+        renderQueue.Begin(camera.GetEyePosition());
         
-        mat4 S = mat4(
-                      scaling.x,        0.0,            0.0,            0.0,
-                      0.0,            scaling.y,        0.0,            0.0,
-                      0.0,            0.0,            scaling.z,        0.0,
-                      0.0,            0.0,            0.0,            1.0);
+        for(int i = 0; i < (int)objects.size(); i++)
+        {
+            Object* object = objects[i];
+            MeshInstances* group = objectInstances[i];
+            if(group && group->GetFirst() != object) continue;
+            
+            Material* material = object->GetMesh()->GetMaterial();
+            vec3 position = object->GetTransform().GetPosition();
+            
+            // the avatar's spotlight lights everything drawn after it
+            int pass = i == 0 ? sunlitPass : spotlitPass;
+            if(group) { if(group->GetVisibleCount()) renderQueue.Add(pass, instancedMeshShader, material, position, NULL, group); }
+            else if(object->IsVisible()) renderQueue.Add(pass, object->GetMesh()->GetShader(), material, position, object);
+        }
         
-        mat4 InvS = mat4(
-                         1.0/scaling.x,    0.0,            0.0,            0.0,
-                         0.0,            1.0/scaling.y,    0.0,            0.0,
-                         0.0,            0.0,            1.0/scaling.z,    0.0,
-                         0.0,            0.0,            0.0,            1.0);
+        renderQueue.Sort();
+        renderQueue.Submit([this](int pass) {
+            if(pass == spotlitPass) objects[0]->DrawSpotlight();
+        });
+        //environment->Draw();
         
-        float alpha = orientation / 180.0 * M_PI;
+    }
+    
+    // movers go first, in index order so the wheels follow the car's new position; pushes only depend
+    // on the avatar, so only the objects the grid finds next to it are asked. Runs on the simulation
+    // thread, time is when the step ends on the simulation clock
+    void Move(float dt, double time = 0) {
+        step++;
+        for(int k = 0; k < (int)movers.size(); k++) BeginStep(movers[k]);
         
-        mat4 R = mat4(
-                      cos(alpha),        0.0,            sin(alpha),        0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      -sin(alpha),    0.0,            cos(alpha),        0.0,
-                      0.0,            0.0,            0.0,            1.0);
+        for(int k = 0; k < (int)movers.size(); k++){
+            int i = movers[k];
+            objects[i]->Roll(dt, objects[6], i);
+            objects[i]->Move(dt);
+        }
         
-        mat4 InvR = mat4(
-                         cos(alpha),        0.0,            -sin(alpha),    0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         sin(alpha),        0.0,            cos(alpha),        0.0,
-                         0.0,            0.0,            0.0,            1.0);
+        vec3 avatar = objects[0]->GetPosition();
+        nearby.clear();
+        grid.QueryRange(avatar.x, avatar.z, pushRadius, nearby);
+        std::sort(nearby.begin(), nearby.end());
+        for(int k = 0; k < (int)nearby.size(); k++)
+        {
+            BeginStep(nearby[k]);
+            objects[nearby[k]]->PushedBy(dt, objects[0]);
+        }
         
-        mat4 M = S * R * T;
-        mat4 InvM = InvT * InvR * InvS;
+        for(int k = 0; k < (int)movers.size(); k++) UpdateGrid(movers[k]);
+        for(int k = 0; k < (int)nearby.size(); k++) UpdateGrid(nearby[k]);
         
-        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        mat4 VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
+        if(streamingEnabled) streamer.Update(objects[0]->GetPosition());
+        PublishState(time, dt);
+    }
+    
+    void UpdateGrid(int i)
+    {
+        grid.Move(i, objects[i]->GetPosition().x, objects[i]->GetPosition().z);
+    }
+    
+    Object* GetAvatar() {
+        return objects[0];
+    }
+    
+    Object* GetCar() { return objects[6]; }
+    
+    TileStreamer& GetStreamer() { return streamer; }
+    ShadowMap& GetShadowMap() { return shadowMap; }
+};
+
+Scene scene;
+
+// GL time finished asset loads may spend uploading per frame
+const double uploadBudgetMilliseconds = 4.0;
+
+// the simulation advances in fixed steps and rendering blends between the last two of them. After a
+// stall at most maxSteps are taken at once and the time beyond them is dropped, so one slow frame
+// neither makes the next one slower nor lets objects jump through each other
+class FixedTimestep
+{
+    double step;
+    int maxSteps;
+    bool started;
+    double lastTime;
+    double accumulator;
+    int droppedSteps;
+    
+public:
+    FixedTimestep(double step, int maxSteps) : step(step), maxSteps(maxSteps), started(false), lastTime(0), accumulator(0), droppedSteps(0) {}
+    
+    double GetStep() { return step; }
+    
+    // steps due for the time since the last call, in seconds; the first call only starts the clock
+    int Advance(double time)
+    {
+        if(!started)
+        {
+            lastTime = time;
+            started = true;
+            return 0;
+        }
+        accumulator += time - lastTime;
+        lastTime = time;
+        int steps = (int)(accumulator / step);
+        if(steps > maxSteps)
+        {
+            droppedSteps += steps - maxSteps;
+            steps = maxSteps;
+            accumulator = fmod(accumulator, step);
+        }
+        else accumulator -= steps * step;
+        return steps;
+    }
+    
+    // when the last step taken ends, and how long until the next one is due
+    double GetTime() { return lastTime - accumulator; }
+    double GetTimeToNextStep() { return step - accumulator; }
+    int GetDroppedSteps() { return droppedSteps; }
+};
+
+// runs the simulation on a thread of its own, taking the steps the clock calls for, each after applying
+// the input that arrived; every step publishes the scene's state for rendering. With
+// --no-simulation-thread the same steps run on the GLUT thread before each frame
+class Simulation
+{
+    FixedTimestep clock;
+    std::chrono::steady_clock::time_point epoch;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    
+    // CPU time spent in steps and the steps taken, read by the frame report on the other thread
+    std::atomic<long long> busyMicroseconds;
+    std::atomic<int> stepsTaken;
+    std::atomic<int> droppedSteps;
+    
+    // steps since the start, which recorded input is timed by
+    unsigned int step;
+    
+    // live key presses, or the recording being replayed, then recorded if recording
+    void ApplyInput()
+    {
+        InputQueue::Event event;
+        while(inputQueue.Pop(event))
+        {
+            if(inputPlayer.IsPlaying()) continue;
+            keyboardState[event.key] = event.down;
+            inputRecorder.Record(step, event);
+        }
+        while(inputPlayer.Next(step, event))
+        {
+            keyboardState[event.key] = event.down;
+            inputRecorder.Record(step, event);
+        }
+    }
+    
+    void Run()
+    {
+        profiler.NameThread("simulation");
+        while(!stopping)
+        {
+            Advance();
+            std::this_thread::sleep_for(std::chrono::duration<double>(clock.GetTimeToNextStep()));
+        }
+    }
+    
+public:
+    Simulation() : clock(1.0 / 120, 8), epoch(std::chrono::steady_clock::now()), stopping(false),
+        busyMicroseconds(0), stepsTaken(0), droppedSteps(0), step(0) {}
+    ~Simulation() { Stop(); }
+    
+    // seconds on the simulation clock, which both threads read
+    double GetTime() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - epoch).count(); }
+    
+    // takes the steps due by now
+    void Advance() { AdvanceTo(GetTime()); }
+    
+    // takes the steps due by the given time on the simulation clock; a scripted run passes its own
+    // times, so it takes the same steps however long its frames take
+    void AdvanceTo(double time)
+    {
+        int steps = clock.Advance(time);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ProfileScope scope("simulate");
+        for(int i = 0; i < steps; i++)
+        {
+            ProfileScope stepScope("step");
+            ApplyInput();
+            camera.Control();
+            scene.Move(clock.GetStep(), clock.GetTime() - (steps - 1 - i) * clock.GetStep());
+            step++;
+        }
+        busyMicroseconds += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        stepsTaken += steps;
+        droppedSteps = clock.GetDroppedSteps();
+    }
+    
+    void Start()
+    {
+        if(thread.joinable()) return;
+        stopping = false;
+        thread = std::thread(&Simulation::Run, this);
+    }
+    
+    void Stop()
+    {
+        if(!thread.joinable()) return;
+        stopping = true;
+        thread.join();
+    }
+    
+    bool IsRunning() { return thread.joinable(); }
+    int GetStepsPerSecond() { return (int)(1 / clock.GetStep() + 0.5); }
+    long long GetBusyMicroseconds() { return busyMicroseconds; }
+    int GetStepsTaken() { return stepsTaken; }
+    int GetDroppedSteps() { return droppedSteps; }
+};
+
+Simulation simulation;
+
+// --simulation-thread steps the simulation on a thread of its own; by default the steps are taken on
+// the GLUT thread, between frames, since a single core shows frame times varying more with the thread
+bool simulationThreadEnabled = false;
+
+// the pixels of captured frames as files: a raw Y4M video stream (4:2:0, full range), or one
+// uncompressed PNG per frame. Rows arrive bottom up, as glReadPixels returns them
+class FrameEncoder
+{
+    std::string path;
+    bool video;
+    FILE* stream;
+    int width, height;
+    std::vector<unsigned char> planes;
+    
+    static unsigned int Crc(unsigned int crc, const unsigned char* data, size_t n)
+    {
+        static unsigned int table[256];
+        if(!table[1])
+            for(unsigned int i = 0; i < 256; i++)
+            {
+                unsigned int c = i;
+                for(int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                table[i] = c;
+            }
+        crc = ~crc;
+        for(size_t i = 0; i < n; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+    
+    static void PutBigEndian(std::vector<unsigned char>& out, unsigned int v)
+    {
+        unsigned char bytes[4] = { (unsigned char)(v >> 24), (unsigned char)(v >> 16), (unsigned char)(v >> 8), (unsigned char)v };
+        out.insert(out.end(), bytes, bytes + 4);
+    }
+    
+    static void PutChunk(FILE* file, const char* type, const std::vector<unsigned char>& data)
+    {
+        std::vector<unsigned char> chunk;
+        PutBigEndian(chunk, (unsigned int)data.size());
+        chunk.insert(chunk.end(), type, type + 4);
+        chunk.insert(chunk.end(), data.begin(), data.end());
+        PutBigEndian(chunk, Crc(0, &chunk[4], chunk.size() - 4));
+        fwrite(&chunk[0], 1, chunk.size(), file);
+    }
+    
+    // RGB rows behind a zero filter byte each, in stored deflate blocks: larger files, but writing one
+    // costs no more than copying it, so the encoder keeps up with the frames
+    void WritePng(int frame, const unsigned char* rgba)
+    {
+        char filename[1024];
+        snprintf(filename, sizeof(filename), "%s%05d.png", path.c_str(), frame);
+        FILE* file = fopen(filename, "wb");
+        if(!file) return;
+        
+        std::vector<unsigned char> raw;
+        raw.reserve((size_t)(width * 3 + 1) * height);
+        for(int y = height - 1; y >= 0; y--)
+        {
+            raw.push_back(0);
+            const unsigned char* row = rgba + (size_t)y * width * 4;
+            for(int x = 0; x < width; x++) raw.insert(raw.end(), row + x * 4, row + x * 4 + 3);
+        }
         
-        s->UploadM(M);
-        s->UploadInvM(InvM);
-        s->UploadMVP(MVP);
-        s->UploadVP(VP);
+        std::vector<unsigned char> zlib;
+        zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+        zlib.push_back(0x78); zlib.push_back(0x01);
+        unsigned int a = 1, b = 0;
+        for(size_t start = 0; start < raw.size(); start += 65535)
+        {
+            size_t n = std::min((size_t)65535, raw.size() - start);
+            zlib.push_back(start + n == raw.size() ? 1 : 0);
+            zlib.push_back(n & 0xff); zlib.push_back(n >> 8);
+            zlib.push_back(~n & 0xff); zlib.push_back((~n >> 8) & 0xff);
+            zlib.insert(zlib.end(), raw.begin() + start, raw.begin() + start + n);
+        }
+        for(size_t i = 0; i < raw.size(); i++)
+        {
+            a = (a + raw[i]) % 65521;
+            b = (b + a) % 65521;
+        }
+        PutBigEndian(zlib, (b << 16) | a);
+        
+        static const unsigned char signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+        fwrite(signature, 1, 8, file);
+        std::vector<unsigned char> header;
+        PutBigEndian(header, width);
+        PutBigEndian(header, height);
+        unsigned char format[5] = { 8, 2, 0, 0, 0 };     // 8 bits per channel, RGB
+        header.insert(header.end(), format, format + 5);
+        PutChunk(file, "IHDR", header);
+        PutChunk(file, "IDAT", zlib);
+        PutChunk(file, "IEND", std::vector<unsigned char>());
+        fclose(file);
+    }
+    
+    void WriteVideoFrame(const unsigned char* rgba)
+    {
+        int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+        planes.resize((size_t)width * height + 2 * chromaWidth * chromaHeight);
+        unsigned char* Y = &planes[0];
+        unsigned char* U = Y + (size_t)width * height;
+        unsigned char* V = U + chromaWidth * chromaHeight;
+        for(int y = 0; y < height; y++)
+        {
+            const unsigned char* row = rgba + (size_t)(height - 1 - y) * width * 4;
+            for(int x = 0; x < width; x++)
+                Y[y * width + x] = (unsigned char)((77 * row[x * 4] + 150 * row[x * 4 + 1] + 29 * row[x * 4 + 2] + 128) >> 8);
+        }
+        // chroma from the average of each 2x2 block
+        for(int y = 0; y < chromaHeight; y++)
+            for(int x = 0; x < chromaWidth; x++)
+            {
+                int r = 0, g = 0, b = 0, n = 0;
+                for(int dy = 0; dy < 2 && 2 * y + dy < height; dy++)
+                    for(int dx = 0; dx < 2 && 2 * x + dx < width; dx++)
+                    {
+                        const unsigned char* p = rgba + ((size_t)(height - 1 - 2 * y - dy) * width + 2 * x + dx) * 4;
+                        r += p[0]; g += p[1]; b += p[2]; n++;
+                    }
+                r /= n; g /= n; b /= n;
+                U[y * chromaWidth + x] = (unsigned char)std::max(0, std::min(255, (-43 * r - 85 * g + 128 * b + 32768) >> 8));
+                V[y * chromaWidth + x] = (unsigned char)std::max(0, std::min(255, (128 * r - 107 * g - 21 * b + 32768) >> 8));
+            }
+        fputs("FRAME\n", stream);
+        fwrite(&planes[0], 1, planes.size(), stream);
+    }
+    
+public:
+    FrameEncoder() : video(false), stream(NULL), width(0), height(0) {}
+    ~FrameEncoder() { Close(); }
+    
+    // a path ending in .y4m is written as one video, any other is the prefix of numbered PNG files
+    bool Open(const std::string& p, int w, int h, int framesPerSecond)
+    {
+        path = p;
+        width = w;
+        height = h;
+        video = path.size() > 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+        if(!video) return true;
+        stream = fopen(path.c_str(), "wb");
+        if(!stream) return false;
+        fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=FULL\n", width, height, framesPerSecond);
+        return true;
+    }
+    
+    void Write(int frame, const unsigned char* rgba)
+    {
+        if(video) WriteVideoFrame(rgba);
+        else WritePng(frame, rgba);
+    }
+    
+    void Close()
+    {
+        if(stream) fclose(stream);
+        stream = NULL;
+    }
+};
+
+// records frames without stalling the GPU: each frame is read into the next of a ring of pixel buffer
+// objects, and the buffer is mapped only when the ring comes back round to it, several frames later,
+// by when the copy has long finished. The pixels are handed to an encoder thread; if it falls more than
+// a few frames behind, capturing waits for it rather than dropping frames
+class FrameCapture
+{
+    static const int ringSize = 3;
+    static const int maxQueued = 8;
+    
+    struct Frame
+    {
+        int index;
+        std::vector<unsigned char> pixels;
+    };
+    
+    unsigned int buffers[ringSize];
+    int bufferFrames[ringSize];     // the frame read into each buffer, -1 if none
+    int next;
+    int frame;
+    int width, height;
+    bool capturing;
+    
+    FrameEncoder encoder;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<Frame> queue;
+    std::vector<std::vector<unsigned char> > spare;
+    bool stopping;
+    double waitMilliseconds;
+    
+    void Run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            changed.wait(lock, [this] { return stopping || !queue.empty(); });
+            if(queue.empty()) return;
+            Frame f;
+            f.index = queue.front().index;
+            f.pixels.swap(queue.front().pixels);
+            queue.pop_front();
+            changed.notify_all();
+            
+            lock.unlock();
+            encoder.Write(f.index, &f.pixels[0]);
+            lock.lock();
+            spare.push_back(std::vector<unsigned char>());
+            spare.back().swap(f.pixels);
+        }
+    }
+    
+    // maps a buffer the GPU has finished with and queues its pixels for the encoder
+    void Collect(int slot)
+    {
+        if(bufferFrames[slot] < 0) return;
+        size_t size = (size_t)width * height * 4;
+        std::vector<unsigned char> pixels;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if(queue.size() >= maxQueued)
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                changed.wait(lock, [this] { return queue.size() < maxQueued; });
+                waitMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            }
+            if(!spare.empty())
+            {
+                pixels.swap(spare.back());
+                spare.pop_back();
+            }
+        }
+        pixels.resize(size);
+        
+        GL_COUNT(glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[slot]));
+        void* mapped = GL_COUNT(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT));
+        if(mapped) memcpy(&pixels[0], mapped, size);
+        GL_COUNT(glUnmapBuffer(GL_PIXEL_PACK_BUFFER));
+        GL_COUNT(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(Frame());
+        queue.back().index = bufferFrames[slot];
+        queue.back().pixels.swap(pixels);
+        bufferFrames[slot] = -1;
+        changed.notify_all();
     }
     
-    vec3& GetPosition() { return position; }
-    void SetAheadOrientation(float orient) {
-        ahead_orientation = orient;
+public:
+    FrameCapture() : next(0), frame(0), width(0), height(0), capturing(false), stopping(false), waitMilliseconds(0) {}
+    
+    // only reached when Finish never ran, e.g. after an early exit; the GL objects may be gone by then,
+    // so frames still in their buffers are dropped
+    ~FrameCapture()
+    {
+        if(!thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        thread.join();
     }
     
-    void Move(float dt) {
-        float radians = (ahead_orientation-90) * (M_PI/180);
-        if (keyboardState['i']) {
-            position.x = position.x - dt * cos(radians);
-            position.z = position.z - dt * sin(radians);
+    // the capture keeps the size it starts with: after the window is resized it records the bottom-left
+    // w by h corner of the framebuffer
+    bool Start(const std::string& path, int w, int h, int framesPerSecond)
+    {
+        width = w;
+        height = h;
+        if(!encoder.Open(path, w, h, framesPerSecond))
+        {
+            printf("Capture: cannot write %s\n", path.c_str());
+            return false;
         }
-        if (keyboardState['k']) {
-            position.x = position.x + dt * cos(radians);
-            position.z = position.z + dt * sin(radians);
-        }/**
-        if (keyboardState['j']) {
-            orientation = orientation - dt*10;
+        glGenBuffers(ringSize, buffers);
+        for(int i = 0; i < ringSize; i++)
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, (size_t)width * height * 4, NULL, GL_STREAM_READ);
+            bufferFrames[i] = -1;
         }
-        if (keyboardState['l']) {
-            orientation = orientation + dt*10;
-        }**/
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        capturing = true;
+        thread = std::thread(&FrameCapture::Run, this);
+        return true;
+    }
+    
+    bool IsCapturing() { return capturing; }
+    
+    // called once the frame is drawn, before the buffers are swapped
+    void Capture()
+    {
+        if(!capturing) return;
+        Collect(next);
+        GL_COUNT(glBindBuffer(GL_PIXEL_PACK_BUFFER, buffers[next]));
+        GL_COUNT(glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, NULL));
+        GL_COUNT(glBindBuffer(GL_PIXEL_PACK_BUFFER, 0));
+        bufferFrames[next] = frame++;
+        next = (next + 1) % ringSize;
     }
     
+    // collects the frames still in flight and waits until every one is written
+    void Finish()
+    {
+        if(!capturing) return;
+        for(int i = 0; i < ringSize; i++) Collect((next + i) % ringSize);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        thread.join();
+        encoder.Close();
+        glDeleteBuffers(ringSize, buffers);
+        capturing = false;
+        printf("Captured %d frames, %.1f ms spent waiting for the encoder\n", frame, waitMilliseconds);
+    }
 };
 
-class WheelObject: public Object
+// --capture path records every frame drawn
+FrameCapture capture;
+
+// CPU time spent rendering since the last report, and the time between frames and its square
+double renderMilliseconds = 0;
+double frameIntervalSum = 0, frameIntervalSquareSum = 0;
+int frameIntervals = 0;
+
+std::chrono::steady_clock::time_point startupTime;
+bool firstFrameReported = false;
+bool loadingReported = false;
+
+void onInitialization()
 {
-    Shader* shader;
-    Mesh *mesh;
-    vec3 position;
-    vec3 scaling;
-    float orientation;
-    float rollAngle = 0;
-    vec3 u = vec3(0, 0, 0);
+    glViewport(0, 0, windowWidth, windowHeight);
     
-public:
-    WheelObject(Mesh *m, vec3 position, vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) :
-    Object(m, position, scaling, orientation), position(position), scaling(scaling), orientation(orientation)
+    startupTime = std::chrono::steady_clock::now();
+    scene.Initialize();
+    printf("Scene initialized in %.1f ms with %d loader threads\n",
+           std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupTime).count(), loader.GetWorkerCount());
+}
+
+void ReportStartup()
+{
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startupTime).count();
+    if(!firstFrameReported)
     {
-        shader = m->GetShader();
-        mesh = m;
+        printf("First frame after %.1f ms\n", elapsed);
+        firstFrameReported = true;
+    }
+    if(!loadingReported && loader.IsIdle())
+    {
+        printf("All assets resident after %.1f ms\n", elapsed);
+        assets.PrintStatistics();
+        loadingReported = true;
+    }
+}
+
+// runs once, from the window's close callback while the context still exists, or from exit()
+void onExit()
+{
+    static bool finished = false;
+    if(finished) return;
+    finished = true;
+    // the simulation thread records input and profile scopes, so it stops before their files close
+    simulation.Stop();
+    capture.Finish();
+    inputRecorder.Close();
+    profiler.Finish();
+    printf("exit");
+}
+
+// prints the GL work of one frame every few seconds, and since the last report the mean time between
+// frames and its standard deviation, and the average CPU time per frame spent simulating and rendering
+void ReportFrameStatistics()
+{
+    static int frame = 0;
+    static int lastFrame = 0;
+    static long long lastBusyMicroseconds = 0;
+    static int lastSteps = 0;
+    if(frame++ % 300 == 0)
+    {
+        int frames = std::max(1, frame - lastFrame);
+        double mean = frameIntervals ? frameIntervalSum / frameIntervals : 0;
+        double deviation = frameIntervals ? sqrt(std::max(0.0, frameIntervalSquareSum / frameIntervals - mean * mean)) : 0;
+        long long busyMicroseconds = simulation.GetBusyMicroseconds();
+        int steps = simulation.GetStepsTaken();
+        printf("Time: %.2f ms between frames, deviation %.2f ms; %.2f ms rendering, %.2f ms simulating in %.1f steps per frame%s, %d steps dropped\n",
+               mean, deviation, renderMilliseconds / frames, (busyMicroseconds - lastBusyMicroseconds) / 1000.0 / frames,
+               (double)(steps - lastSteps) / frames, simulation.IsRunning() ? " on its own thread" : "", simulation.GetDroppedSteps());
+        renderMilliseconds = 0;
+        frameIntervalSum = frameIntervalSquareSum = 0;
+        frameIntervals = 0;
+        lastBusyMicroseconds = busyMicroseconds;
+        lastSteps = steps;
+        lastFrame = frame;
+        printf("Frame: %d GL calls, %d draw calls\n", frameStats.glCalls, frameStats.drawCalls);
+        printf("State: %d program changes, %d texture binds, %d vertex array binds, %d enable/disable, %d redundant changes skipped\n",
+               frameStats.programChanges, frameStats.textureBinds, frameStats.vertexArrayBinds,
+               frameStats.capabilityChanges, frameStats.skippedStateChanges);
+        printf("Culling: %d objects visible, %d culled, %d shadows culled\n",
+               frameStats.visibleObjects, frameStats.culledObjects, frameStats.culledShadows);
+    }
+}
+
+void onDisplay()
+{
+    static std::chrono::steady_clock::time_point lastFrame;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if(lastFrame.time_since_epoch().count())
+    {
+        double interval = std::chrono::duration<double, std::milli>(start - lastFrame).count();
+        frameIntervalSum += interval;
+        frameIntervalSquareSum += interval * interval;
+        frameIntervals++;
     }
+    lastFrame = start;
     
-    void UploadAttributes(Shader* s)
     {
-        mat4 T = mat4(
-                      1.0,            0.0,            0.0,            0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      0.0,            0.0,            1.0,            0.0,
-                      position.x,        position.y,        position.z,        1.0);
+        ProfileScope frameScope("frame");
+        {
+            ProfileScope scope("uploads");
+            loader.ProcessUploads(uploadBudgetMilliseconds);
+        }
+        frameStats.Reset();
         
-        mat4 InvT = mat4(
-                         1.0,            0.0,            0.0,            0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         0.0,            0.0,            1.0,            0.0,
-                         -position.x,    -position.y,    -position.z,    1.0);
+        glClearColor(0.3, 0.48, 0.52, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
-        mat4 S = mat4(
-                      scaling.x,        0.0,            0.0,            0.0,
-                      0.0,            scaling.y,        0.0,            0.0,
-                      0.0,            0.0,            scaling.z,        0.0,
-                      0.0,            0.0,            0.0,            1.0);
+        {
+            ProfileScope scope("draw");
+            scene.Draw(simulation.GetTime());
+        }
+        {
+            ProfileScope scope("capture", true);
+            capture.Capture();
+        }
         
-        mat4 InvS = mat4(
-                         1.0/scaling.x,    0.0,            0.0,            0.0,
-                         0.0,            1.0/scaling.y,    0.0,            0.0,
-                         0.0,            0.0,            1.0/scaling.z,    0.0,
-                         0.0,            0.0,            0.0,            1.0);
+        ProfileScope scope("swap");
+        glutSwapBuffers();
+    }
+    renderMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    profiler.EndFrame();
+    
+    ReportStartup();
+    ReportFrameStatistics();
+}
+
+void onKeyboard(unsigned char key, int x, int y)
+{
+    InputQueue::Event event = { key, true };
+    inputQueue.Push(event);
+    if(key == 'c')
+    {
+        shadowCascadeCount = shadowCascadeCount % maxShadowCascades + 1;
+        scene.GetShadowMap().Configure(shadowCascadeCount, shadowMapSize);
+        printf("%d shadow cascades\n", shadowCascadeCount);
+    }
+}
+
+void onKeyboardUp(unsigned char key, int x, int y)
+{
+    InputQueue::Event event = { key, false };
+    inputQueue.Push(event);
+}
+
+void onReshape(int winWidth, int winHeight)
+{
+    camera.SetAspectRatio((float)winWidth / winHeight);
+    glViewport(0, 0, winWidth, winHeight);
+}
+
+void onIdle( ) {
+    // without a thread of its own the simulation catches up here, before each frame
+    if(!simulation.IsRunning()) simulation.Advance();
+    
+    glutPostRedisplay();
+}
+
+// the loader PolygonalMesh used before ObjFile: rows buffered with a 256 byte getline,
+// then parsed with sscanf into individually allocated elements; kept only as a benchmark baseline
+int LegacyObjParse(const char* filename)
+{
+    struct Face { int positionIndices[4]; int normalIndices[4]; int texcoordIndices[4]; bool isQuad; };
+    
+    std::fstream file(filename);
+    if(!file.is_open()) return 0;
+    
+    std::vector<std::string*> rows;
+    std::vector<vec3*> positions;
+    std::vector<vec3*> normals;
+    std::vector<vec2*> texcoords;
+    std::vector<Face*> faces;
+    
+    char buffer[256];
+    while(!file.eof())
+    {
+        file.getline(buffer, 256);
+        rows.push_back(new std::string(buffer));
+    }
+    
+    for(int i = 0; i < (int)rows.size(); i++)
+    {
+        std::string& row = *rows[i];
+        if(row.empty() || row[0] == '#') continue;
+        float x, y, z;
+        if(row[0] == 'v' && row[1] == ' ') { sscanf(row.c_str(), "v %f %f %f", &x, &y, &z); positions.push_back(new vec3(x, y, z)); }
+        else if(row[0] == 'v' && row[1] == 'n') { sscanf(row.c_str(), "vn %f %f %f", &x, &y, &z); normals.push_back(new vec3(x, y, z)); }
+        else if(row[0] == 'v' && row[1] == 't') { sscanf(row.c_str(), "vt %f %f", &x, &y); texcoords.push_back(new vec2(x, y)); }
+        else if(row[0] == 'f')
+        {
+            Face* f = new Face();
+            f->isQuad = count(row.begin(), row.end(), ' ') != 3;
+            sscanf(row.c_str(), "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d",
+                   &f->positionIndices[0], &f->texcoordIndices[0], &f->normalIndices[0],
+                   &f->positionIndices[1], &f->texcoordIndices[1], &f->normalIndices[1],
+                   &f->positionIndices[2], &f->texcoordIndices[2], &f->normalIndices[2],
+                   &f->positionIndices[3], &f->texcoordIndices[3], &f->normalIndices[3]);
+            faces.push_back(f);
+        }
+    }
+    
+    int nTriangles = 0;
+    for(int i = 0; i < (int)faces.size(); i++) nTriangles += faces[i]->isQuad ? 2 : 1;
+    
+    for(int i = 0; i < (int)rows.size(); i++) delete rows[i];
+    for(int i = 0; i < (int)positions.size(); i++) delete positions[i];
+    for(int i = 0; i < (int)normals.size(); i++) delete normals[i];
+    for(int i = 0; i < (int)texcoords.size(); i++) delete texcoords[i];
+    for(int i = 0; i < (int)faces.size(); i++) delete faces[i];
+    return nTriangles;
+}
+
+// the benchmarks add up what their timed work produces and print the sum once at the end, so the
+// compiler cannot drop that work as unused
+void PrintChecksum(double checksum)
+{
+    printf("checksum %.15g\n", checksum);
+}
+
+// --bench-obj [directory]: CPU load time of every mesh with the legacy loader, ObjFile, and a warm .meshcache
+int BenchmarkObjLoading(const std::string& directory)
+{
+    const char* meshFiles[] = {
+        "ball/ball.obj", "balloon/balloon.obj", "chevy/chassis.obj", "chevy/chevy.obj",
+        "chevy/wheel.obj", "pikachu/pikachu.obj", "tigger/tigger.obj", "tree/tree.obj" };
+    const int repetitions = 5;
+    
+    printf("%-22s %10s %12s %12s %12s %8s\n", "mesh", "triangles", "legacy (ms)", "mapped (ms)", "cached (ms)", "speedup");
+    double legacyTotal = 0, mappedTotal = 0, cachedTotal = 0;
+    unsigned int checksum = 0;
+    for(int i = 0; i < (int)(sizeof(meshFiles) / sizeof(meshFiles[0])); i++)
+    {
+        std::string filename = directory + meshFiles[i];
+        double legacyBest = 1e30, mappedBest = 1e30, cachedBest = 1e30;
+        int legacyTriangles = 0, mappedTriangles = 0;
         
-        float alpha = orientation / 180.0 * M_PI;
+        for(int r = 0; r < repetitions; r++)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            legacyTriangles = LegacyObjParse(filename.c_str());
+            std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+            ObjFile obj;
+            obj.Load(filename.c_str());
+            mappedTriangles = obj.GetTriangleCount();
+            std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+            
+            legacyBest = std::min(legacyBest, std::chrono::duration<double, std::milli>(middle - start).count());
+            mappedBest = std::min(mappedBest, std::chrono::duration<double, std::milli>(stop - middle).count());
+        }
         
-        mat4 R = mat4(
-                      cos(alpha),        0.0,            sin(alpha),        0.0,
-                      0.0,            1.0,            0.0,            0.0,
-                      -sin(alpha),    0.0,            cos(alpha),        0.0,
-                      0.0,            0.0,            0.0,            1.0);
+        // the warm path: validate the cache and page in what glBufferData would read
+        std::string cachePath = MeshCache::GetPath(filename.c_str());
+        SourceFileStamp source;
+        if(source.Read(filename.c_str()) && !MeshCache(cachePath, source).IsValid())
+        {
+            ObjFile obj;
+            obj.Load(filename.c_str());
+            IndexedMesh mesh;
+            mesh.Build(obj);
+            MeshCache::Write(cachePath, source, mesh);
+        }
+        for(int r = 0; r < repetitions; r++)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            SourceFileStamp stamp;
+            stamp.Read(filename.c_str());
+            MeshCache cache(cachePath, stamp);
+            if(cache.IsValid())
+            {
+                const MeshCacheHeader& h = cache.GetHeader();
+                const unsigned char* begin = (const unsigned char*)cache.GetVertices();
+                const unsigned char* end = (const unsigned char*)cache.GetIndices() + (size_t)h.indexCount * h.indexSize;
+                for(const unsigned char* p = begin; p < end; p += 4096) checksum += *p;
+            }
+            cachedBest = std::min(cachedBest, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
         
-        mat4 InvR = mat4(
-                         cos(alpha),        0.0,            -sin(alpha),    0.0,
-                         0.0,            1.0,            0.0,            0.0,
-                         sin(alpha),        0.0,            cos(alpha),        0.0,
-                         0.0,            0.0,            0.0,            1.0);
+        if(legacyTriangles != mappedTriangles) printf("%s: triangle counts differ (%d vs %d)\n", meshFiles[i], legacyTriangles, mappedTriangles);
+        printf("%-22s %10d %12.2f %12.2f %12.2f %7.1fx\n", meshFiles[i], mappedTriangles, legacyBest, mappedBest, cachedBest, legacyBest / cachedBest);
+        legacyTotal += legacyBest;
+        mappedTotal += mappedBest;
+        cachedTotal += cachedBest;
+    }
+    printf("%-22s %10s %12.2f %12.2f %12.2f %7.1fx\n", "total", "", legacyTotal, mappedTotal, cachedTotal, legacyTotal / cachedTotal);
+    PrintChecksum(checksum);
+    return 0;
+}
+
+// --cook-textures [directory]: encodes the scene's textures, with their mip chains, and the environment
+// faces to BC1 (RGB) or BC3 (RGBA) .bctex files next to them, printing the memory they save, how long
+// they take to load against decoding the image, and their error
+int CookTextures(const std::string& directory)
+{
+    struct CookEntry
+    {
+        const char* filename;
+        bool mipmapped;
+    };
+    const CookEntry textureFiles[] = {
+        { "ball/ball.png", true }, { "balloon/balloon.png", true }, { "chevy/chevy.png", true },
+        { "tigger/tigger.png", true }, { "tree/tree.png", true },
+        { "environment/posx512.jpg", false }, { "environment/negx512.jpg", false }, { "environment/posy512.jpg", false },
+        { "environment/negy512.jpg", false }, { "environment/posz512.jpg", false }, { "environment/negz512.jpg", false } };
+    
+    // filtering and encoding split their rows over the loader's workers, as they do in the game
+    loader.SetWorkerCount(std::min(8, std::max(1, (int)std::thread::hardware_concurrency())));
+    
+    printf("%-26s %10s %6s %10s %12s %12s %12s %10s %10s\n", "texture", "size", "format", "raw (KB)", "cooked (KB)", "encode (ms)", "decode (ms)", "load (ms)", "PSNR (dB)");
+    double rawTotal = 0, cookedTotal = 0, decodeTotal = 0, loadTotal = 0;
+    unsigned int checksum = 0;
+    for(int i = 0; i < (int)(sizeof(textureFiles) / sizeof(textureFiles[0])); i++)
+    {
+        std::string filename = directory + textureFiles[i].filename;
+        SourceFileStamp source;
+        ImageLoad load(filename, textureFiles[i].mipmapped);
         
-        float b = rollAngle / 180.0 * M_PI;
+        // decoding and filtering the image is what a launch without the cooked file pays
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if(!source.Read(filename.c_str()) || !load.Decode() || (load.nComponents != 3 && load.nComponents != 4))
+        {
+            printf("%s: cannot read\n", textureFiles[i].filename);
+            continue;
+        }
+        if(load.mipmapped) load.GenerateMips();
+        double decodeMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
         
-        mat4 rollM = mat4(
-                          cos(b)+pow(u.x,2)*(1-cos(b)), u.x*u.y*(1-cos(b))-u.z*sin(b), u.x*u.z*(1-cos(b))+u.y*sin(b), 0.0,
-                          u.y*u.x*(1-cos(b))+u.z*sin(b), cos(b)+pow(u.y,2)*(1-cos(b)), u.y*u.z*(1-cos(b))-u.x*sin(b), 0.0,
-                          u.z*u.x*(1-cos(b))-u.y*sin(b), u.z*u.y*(1-cos(b))+u.x*sin(b), cos(b)+pow(u.z,2)*(1-cos(b)), 0.0,
-                          0.0, 0.0, 0.0, 1.0);
+        int nComponents = load.nComponents;
+        unsigned int format = nComponents == 4 ? bc3Texture : bc1Texture;
+        size_t rawBytes = 0, cookedBytes = 0;
+        for(size_t l = 0; l < load.levels.size(); l++)
+        {
+            rawBytes += MipCache::GetLevelBytes(rawTexture, nComponents, load.levels[l].width, load.levels[l].height);
+            cookedBytes += MipCache::GetLevelBytes(format, nComponents, load.levels[l].width, load.levels[l].height);
+        }
         
-        mat4 invRollM = mat4();
+        start = std::chrono::steady_clock::now();
+        std::vector<unsigned char> blocks(cookedBytes);
+        std::vector<ImageLevel> blockLevels;
+        unsigned char* out = blocks.data();
+        for(size_t l = 0; l < load.levels.size(); l++)
+        {
+            const ImageLevel& level = load.levels[l];
+            CompressLevel(level, nComponents, out);
+            ImageLevel blockLevel = { out, level.width, level.height };
+            blockLevels.push_back(blockLevel);
+            out += MipCache::GetLevelBytes(format, nComponents, level.width, level.height);
+        }
+        double encodeMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
         
-        double m[16];
-        double invOut[16];
-        for (int i=0; i<4; i++) {
-            for (int j=0; j<4; j++) {
-                m[i+j*4] = rollM.m[i][j];
-            }
+        std::string cookedPath = MipCache::GetCookedPath(filename.c_str());
+        if(!MipCache::Write(cookedPath, source, blockLevels, nComponents, format))
+        {
+            printf("%s: cannot write %s\n", textureFiles[i].filename, cookedPath.c_str());
+            continue;
         }
         
-        if(gluInvertMatrix(m, invOut)) {
-            for (int i=0; i<4; i++) {
-                for (int j=0; j<4; j++) {
-                    invRollM.m[i][j] = invOut[i+j*4];
-                }
-            }
+        // what a launch with it pays: checking the stamp and paging in what the upload reads
+        start = std::chrono::steady_clock::now();
+        SourceFileStamp stamp;
+        stamp.Read(filename.c_str());
+        ImageLoad cooked(filename, textureFiles[i].mipmapped);
+        if(cooked.ReadCache(cookedPath, stamp))
+            for(size_t l = 0; l < cooked.levels.size(); l++)
+                for(size_t b = 0; b < MipCache::GetLevelBytes(format, nComponents, cooked.levels[l].width, cooked.levels[l].height); b += 4096)
+                    checksum += cooked.levels[l].data[b];
+        double loadMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        
+        // error of the full size level over every channel the format keeps
+        std::vector<unsigned char> decompressed((size_t)load.width * load.height * nComponents);
+        DecompressLevel(blockLevels[0].data, load.width, load.height, nComponents, decompressed.data());
+        double squareSum = 0;
+        for(size_t b = 0; b < decompressed.size(); b++)
+        {
+            double d = (double)decompressed[b] - load.data[b];
+            squareSum += d * d;
         }
+        double meanSquare = squareSum / decompressed.size();
+        double psnr = meanSquare > 0 ? 10 * log10(255.0 * 255.0 / meanSquare) : 99;
+        
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", load.width, load.height);
+        printf("%-26s %10s %6s %10.1f %12.1f %12.1f %12.1f %10.2f %10.2f\n", textureFiles[i].filename, size, format == bc3Texture ? "BC3" : "BC1",
+               rawBytes / 1024.0, cookedBytes / 1024.0, encodeMilliseconds, decodeMilliseconds, loadMilliseconds, psnr);
+        rawTotal += rawBytes / 1024.0;
+        cookedTotal += cookedBytes / 1024.0;
+        decodeTotal += decodeMilliseconds;
+        loadTotal += loadMilliseconds;
+    }
+    printf("%-26s %10s %6s %10.1f %12.1f %12s %12.1f %10.2f\n", "total", "", "", rawTotal, cookedTotal, "", decodeTotal, loadTotal);
+    PrintChecksum(checksum);
+    return 0;
+}
+
+// --bench-load: time to first frame and until every asset is resident, loading synchronously
+// and with 1, 2, 4 and 8 workers
+int BenchmarkAssetLoading()
+{
+    const int workerCounts[] = {-1, 0, 1, 2, 4, 8};
+    
+    printf("%-8s %14s %14s %14s\n", "workers", "init (ms)", "first (ms)", "resident (ms)");
+    for(int i = 0; i < (int)(sizeof(workerCounts) / sizeof(workerCounts[0])); i++)
+    {
+        // the first pass only warms the file system and the mesh caches
+        loader.SetWorkerCount(std::max(workerCounts[i], 0));
         
-        mat4 M = S * R * rollM * T;
-        mat4 InvM = InvT * invRollM * InvR * InvS;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        Scene* benchScene = new Scene();
+        benchScene->Initialize();
+        double initialized = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
         
-        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        mat4 VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
+        double firstFrame = -1, resident = -1;
+        while(resident < 0)
+        {
+            loader.ProcessUploads(uploadBudgetMilliseconds);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            benchScene->Draw();
+            glFinish();
+            
+            double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if(firstFrame < 0) firstFrame = elapsed;
+            if(loader.IsIdle()) resident = elapsed;
+        }
+        delete benchScene;
         
-        s->UploadM(M);
-        s->UploadInvM(InvM);
-        s->UploadMVP(MVP);
-        s->UploadVP(VP);
+        if(workerCounts[i] < 0) continue;
+        printf("%-8d %14.1f %14.1f %14.1f\n", workerCounts[i], initialized, firstFrame, resident);
     }
+    return 0;
+}
+
+// the matrix rebuild every object did on each draw before Transform, kept as the --bench-transforms baseline
+void LegacyObjectMatrices(vec3 position, vec3 scaling, float orientation, mat4& M, mat4& InvM, mat4& MVP, mat4& VP)
+{
+    mat4 T = mat4(
+                  1.0,            0.0,            0.0,            0.0,
+                  0.0,            1.0,            0.0,            0.0,
+                  0.0,            0.0,            1.0,            0.0,
+                  position.x,        position.y,        position.z,        1.0);
+    
+    mat4 InvT = mat4(
+                     1.0,            0.0,            0.0,            0.0,
+                     0.0,            1.0,            0.0,            0.0,
+                     0.0,            0.0,            1.0,            0.0,
+                     -position.x,    -position.y,    -position.z,    1.0);
+    
+    mat4 S = mat4(
+                  scaling.x,        0.0,            0.0,            0.0,
+                  0.0,            scaling.y,        0.0,            0.0,
+                  0.0,            0.0,            scaling.z,        0.0,
+                  0.0,            0.0,            0.0,            1.0);
+    
+    mat4 InvS = mat4(
+                     1.0/scaling.x,    0.0,            0.0,            0.0,
+                     0.0,            1.0/scaling.y,    0.0,            0.0,
+                     0.0,            0.0,            1.0/scaling.z,    0.0,
+                     0.0,            0.0,            0.0,            1.0);
+    
+    float alpha = orientation / 180.0 * M_PI;
+    
+    mat4 R = mat4(
+                  cos(alpha),        0.0,            sin(alpha),        0.0,
+                  0.0,            1.0,            0.0,            0.0,
+                  -sin(alpha),    0.0,            cos(alpha),        0.0,
+                  0.0,            0.0,            0.0,            1.0);
+    
+    mat4 InvR = mat4(
+                     cos(alpha),        0.0,            -sin(alpha),    0.0,
+                     0.0,            1.0,            0.0,            0.0,
+                     sin(alpha),        0.0,            cos(alpha),        0.0,
+                     0.0,            0.0,            0.0,            1.0);
+    
+    M = S * R * T;
+    InvM = InvT * InvR * InvS;
+    
+    MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
+    VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
+}
+
+// --bench-transforms [objects]: CPU time per frame spent on object matrices for a field of trees,
+// rebuilding them on every draw versus caching them in Transform; one object in twenty moves each frame
+int BenchmarkTransforms(int requestedObjects)
+{
+    const int objectCounts[] = {100, 250, 500, 1000};
+    const int nFrames = 200;
+    const int nPasses = 2; // shadow pass and main pass
     
-    vec3& GetPosition() { return position; }
-    
-    void Roll(float dt, Object* o, int index) {
-        if (index == 7) {
-            position = o->GetPosition() + vec3(1, -0.3, -0.6);
-        }else if (index == 8) {
-            position = o->GetPosition() + vec3(-1.25, -0.3, -0.6);
-        }else if (index == 9) {
-            position = o->GetPosition() + vec3(1, -0.3, 0.6);
-        }else {
-            position = o->GetPosition() + vec3(-1.25, -0.3, 0.6);
+    float checksum = 0;
+    printf("%-8s %18s %18s %8s\n", "objects", "legacy (ms/frame)", "cached (ms/frame)", "speedup");
+    for(int c = 0; c < (int)(sizeof(objectCounts) / sizeof(objectCounts[0])); c++)
+    {
+        int nObjects = requestedObjects > 0 ? requestedObjects : objectCounts[c];
+        std::vector<vec3> positions(nObjects);
+        std::vector<float> orientations(nObjects);
+        for(int i = 0; i < nObjects; i++)
+        {
+            positions[i] = vec3((i % 32) * 2.0f, -0.5f, (i / 32) * 2.0f);
+            orientations[i] = (i * 37) % 360;
         }
-        float radians = orientation * (M_PI/180);
-        u = (vec3(position.x - 20 * cos(radians), position.y, position.z - 20 * sin(radians))
-                      - position).normalize();
-        if (keyboardState['i']) {
-            o->SetAheadOrientation(orientation);
-            rollAngle = rollAngle + 100*dt;
+        vec3 scaling = vec3(0.06, 0.06, 0.06);
+        mat4 M, InvM, MVP, VP;
+        
+        std::vector<vec3> legacyPositions = positions;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(int f = 0; f < nFrames; f++)
+        {
+            for(int i = f % 20; i < nObjects; i += 20) legacyPositions[i].x += 0.01f;
+            for(int pass = 0; pass < nPasses; pass++)
+                for(int i = 0; i < nObjects; i++)
+                {
+                    LegacyObjectMatrices(legacyPositions[i], scaling, orientations[i], M, InvM, MVP, VP);
+                    checksum += M.m[3][0] + InvM.m[3][0] + MVP.m[3][3] + VP.m[3][3];
+                }
         }
-        if (keyboardState['k']) {
-            o->SetAheadOrientation(orientation);
-            rollAngle = rollAngle - 100*dt;
+        double legacy = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nFrames;
+        
+        std::vector<Transform> transforms(nObjects);
+        start = std::chrono::steady_clock::now();
+        for(int f = 0; f < nFrames; f++)
+        {
+            for(int i = f % 20; i < nObjects; i += 20) positions[i].x += 0.01f;
+            VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
+            for(int pass = 0; pass < nPasses; pass++)
+                for(int i = 0; i < nObjects; i++)
+                {
+                    Pose pose(positions[i], scaling, orientations[i]);
+                    transforms[i].Set(pose, pose);
+                    checksum += transforms[i].GetModelMatrix().m[3][0] + transforms[i].GetInverseModelMatrix().m[3][0] +
+                                transforms[i].GetModelViewProjectionMatrix(VP, f).m[3][3];
+                }
         }
-        if (keyboardState['j']) {
-            orientation = orientation - dt*50;
+        double cached = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nFrames;
+        
+        printf("%-8d %18.3f %18.3f %7.1fx\n", nObjects, legacy, cached, legacy / cached);
+        if(requestedObjects > 0) break;
+    }
+    PrintChecksum(checksum);
+    return 0;
+}
+
+// the scalar mat4 and vec4 products, kept as the --bench-math baseline
+mat4 ScalarMultiply(const mat4& a, const mat4& b)
+{
+    mat4 result;
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            result.m[i][j] = 0;
+            for (int k = 0; k < 4; k++) result.m[i][j] += a.m[i][k] * b.m[k][j];
         }
-        if (keyboardState['l']) {
-            orientation = orientation + dt*50;
+    }
+    return result;
+}
+
+vec4 ScalarTransform(const vec4& p, const mat4& mat)
+{
+    vec4 result;
+    for (int j = 0; j < 4; j++)
+    {
+        result.v[j] = 0;
+        for (int i = 0; i < 4; i++) result.v[j] += p.v[i] * mat.m[i][j];
+    }
+    return result;
+}
+
+// the roll inverse objects used to compute through gluInvertMatrix
+mat4 GeneralInverse(const mat4& a)
+{
+    mat4 inv;
+    double m[16];
+    double invOut[16];
+    for (int i=0; i<4; i++) {
+        for (int j=0; j<4; j++) {
+            m[i+j*4] = a.m[i][j];
         }
     }
     
-};
+    if(gluInvertMatrix(m, invOut)) {
+        for (int i=0; i<4; i++) {
+            for (int j=0; j<4; j++) {
+                inv.m[i][j] = invOut[i+j*4];
+            }
+        }
+    }
+    return inv;
+}
 
-class Scene
+// --bench-math: nanoseconds per operation for the scalar and SIMD matrix product and point transform,
+// and for the general inverse against the closed forms for affine and rigid transforms
+int BenchmarkMath()
 {
-    MeshShader *meshShader;
-    MeshShader *spotlightShader;
-    ReflectiveShader *reflectiveShader;
-    InfiniteQuadShader *infiniteShader;
-    ShadowShader *shadowShader;
-    TextureCube *environmentMap;
-    EnvironmentShader *envShader;
-    MarbleShader *marbleShader;
+    const int nMatrices = 1024;
+    const int nPoints = 1 << 16;
+    const int repetitions = 200;
     
-    std::vector<Texture*> textures;
-    std::vector<Material*> materials;
-    std::vector<Geometry*> geometries;
-    std::vector<Mesh*> meshes;
-    std::vector<Object*> objects;
+    // rigids are the same poses without their scaling
+    std::vector<mat4> matrices(nMatrices), rigids(nMatrices), results(nMatrices);
+    for(int i = 0; i < nMatrices; i++)
+    {
+        Transform transform, rigid;
+        Pose pose(vec3(i * 0.5f, 1, -i * 0.25f), vec3(0.5f + i % 3, 1, 2), i * 7.0f, i * 3.0f, vec3(0, 0, 1));
+        transform.Set(pose, pose);
+        matrices[i] = transform.GetModelMatrix();
+        pose.scaling = vec3(1, 1, 1);
+        rigid.Set(pose, pose);
+        rigids[i] = rigid.GetModelMatrix();
+    }
+    mat4 VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
+    
+    std::vector<vec4> points(nPoints), transformed(nPoints);
+    for(int i = 0; i < nPoints; i++) points[i] = vec4(i % 17, i % 5, i % 11, 1);
+    
+    // sums every matrix or point the last timed loop left behind
+    double checksum = 0;
+    auto sumMatrices = [&] { for(int i = 0; i < nMatrices; i++) for(int j = 0; j < 16; j++) checksum += (&results[i].m[0][0])[j]; };
+    auto sumPoints = [&] { for(int i = 0; i < nPoints; i++) for(int j = 0; j < 4; j++) checksum += transformed[i].v[j]; };
+    double scalarTime, simdTime;
+    std::chrono::steady_clock::time_point start;
+    
+    printf("%-22s %14s %14s %8s\n", "operation", "scalar (ns)", "simd (ns)", "speedup");
+    
+    start = std::chrono::steady_clock::now();
+    for(int r = 0; r < repetitions; r++)
+        for(int i = 0; i < nMatrices; i++) results[i] = ScalarMultiply(matrices[i], VP);
+    scalarTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / repetitions / nMatrices;
+    sumMatrices();
+    start = std::chrono::steady_clock::now();
+    for(int r = 0; r < repetitions; r++) MultiplyMatrices(matrices.data(), results.data(), nMatrices, VP);
+    simdTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / repetitions / nMatrices;
+    sumMatrices();
+    printf("%-22s %14.2f %14.2f %7.1fx\n", "mat4 * mat4", scalarTime, simdTime, scalarTime / simdTime);
+    
+    start = std::chrono::steady_clock::now();
+    for(int r = 0; r < repetitions / 10; r++)
+        for(int i = 0; i < nPoints; i++) transformed[i] = ScalarTransform(points[i], VP);
+    scalarTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (repetitions / 10) / nPoints;
+    sumPoints();
+    start = std::chrono::steady_clock::now();
+    for(int r = 0; r < repetitions / 10; r++) TransformPoints(points.data(), transformed.data(), nPoints, VP);
+    simdTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (repetitions / 10) / nPoints;
+    sumPoints();
+    printf("%-22s %14.2f %14.2f %7.1fx\n", "vec4 * mat4 (batch)", scalarTime, simdTime, scalarTime / simdTime);
+    
+    // the inverses are scalar code, each closed form is compared against the general one on the
+    // matrices it applies to
+    printf("%-22s %14s %14s %8s\n", "", "general (ns)", "closed (ns)", "speedup");
+    const char* inverseNames[] = {"inverse (affine)", "inverse (rigid)"};
+    mat4 (*inverses[])(const mat4&) = {AffineInverse, RigidInverse};
+    const std::vector<mat4>* inputs[] = {&matrices, &rigids};
+    float maxError = 0;
+    for(int k = 0; k < 2; k++)
+    {
+        const std::vector<mat4>& input = *inputs[k];
+        start = std::chrono::steady_clock::now();
+        for(int r = 0; r < repetitions; r++)
+            for(int i = 0; i < nMatrices; i++) results[i] = GeneralInverse(input[i]);
+        scalarTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / repetitions / nMatrices;
+        sumMatrices();
+        start = std::chrono::steady_clock::now();
+        for(int r = 0; r < repetitions; r++)
+            for(int i = 0; i < nMatrices; i++) results[i] = inverses[k](input[i]);
+        simdTime = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / repetitions / nMatrices;
+        sumMatrices();
+        printf("%-22s %14.2f %14.2f %7.1fx\n", inverseNames[k], scalarTime, simdTime, scalarTime / simdTime);
+        
+        // largest difference from the general inverse, as a sanity check of the closed form
+        for(int i = 0; i < nMatrices; i++)
+        {
+            mat4 general = GeneralInverse(input[i]), closed = inverses[k](input[i]);
+            for(int j = 0; j < 16; j++) maxError = std::max(maxError, fabsf((&general.m[0][0])[j] - (&closed.m[0][0])[j]));
+        }
+    }
+    printf("max inverse difference %g\n", maxError);
     
-    Environment *environment;
+    PrintChecksum(checksum);
+    return 0;
+}
+
+// --bench-instancing: frame time and CPU time spent issuing draws for the scene with 100 to 10000
+// extra trees, drawing every object on its own versus drawing shared meshes as instances
+int BenchmarkInstancing()
+{
+    const int treeCounts[] = {100, 1000, 5000, 10000};
+    const int nFrames = 20;
     
-public:
-    Scene()
+    printf("%-8s %22s %8s %22s %8s\n", "trees", "separate frame/cpu (ms)", "draws", "instanced frame/cpu (ms)", "draws");
+    for(int c = 0; c < (int)(sizeof(treeCounts) / sizeof(treeCounts[0])); c++)
     {
-        meshShader = 0;
-        spotlightShader = 0;
-        reflectiveShader = 0;
-        infiniteShader = 0;
-        shadowShader = 0;
-        environmentMap = 0;
-        envShader = 0;
-        marbleShader = 0;
+        double frameTime[2], cpuTime[2];
+        int drawCalls[2];
+        for(int instanced = 0; instanced < 2; instanced++)
+        {
+            stressTrees = treeCounts[c];
+            instancingEnabled = instanced != 0;
+            
+            Scene* benchScene = new Scene();
+            benchScene->Initialize();
+            loader.Finish();
+            benchScene->Draw();
+            glFinish();
+            
+            cpuTime[instanced] = 0;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for(int f = 0; f < nFrames; f++)
+            {
+                frameStats.Reset();
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                std::chrono::steady_clock::time_point drawStart = std::chrono::steady_clock::now();
+                benchScene->Draw();
+                cpuTime[instanced] += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - drawStart).count() / nFrames;
+                glFinish();
+            }
+            frameTime[instanced] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nFrames;
+            drawCalls[instanced] = frameStats.drawCalls;
+            delete benchScene;
+        }
+        printf("%-8d %13.2f / %6.2f %8d %13.2f / %6.2f %8d\n", treeCounts[c], frameTime[0], cpuTime[0], drawCalls[0],
+               frameTime[1], cpuTime[1], drawCalls[1]);
     }
     
-    void Initialize()
+    stressTrees = 0;
+    instancingEnabled = true;
+    return 0;
+}
+
+// query cost of the spatial grid against object count, with points scattered at the density of
+// --stress-trees; the linear scan is what Scene::Move used to do for every interaction
+int BenchmarkSpatialGrid()
+{
+    const int objectCounts[] = {1000, 10000, 100000, 1000000};
+    const int nQueries = 10000;
+    
+    long checksum = 0;
+    printf("%-9s %14s %14s %14s %14s %14s\n", "objects", "scan r=10 (us)", "range 0.5 (us)", "range 10 (us)", "nearest (us)", "move (ns)");
+    for(int c = 0; c < (int)(sizeof(objectCounts) / sizeof(objectCounts[0])); c++)
     {
-        meshShader = new MeshShader();
-        spotlightShader = new MeshShader();
-        reflectiveShader = new ReflectiveShader();
-        infiniteShader = new InfiniteQuadShader();
-        shadowShader = new ShadowShader();
-        marbleShader = new MarbleShader();
-        
-        environmentMap = new TextureCube("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/environment/posx512.jpg",
-                        "/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/environment/negx512.jpg",
-                        "/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/environment/posy512.jpg",
-                        "/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/environment/negy512.jpg",
-                        "/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/environment/posz512.jpg",
-                        "/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/environment/negz512.jpg");
+        int n = objectCounts[c];
+        float extent = 2.0f * sqrtf((float)n);
+        unsigned int seed = 12345;
+        std::vector<float> xs(n), zs(n);
+        for(int i = 0; i < n; i++)
+        {
+            seed = seed * 1664525u + 1013904223u; xs[i] = ((seed >> 8) / 16777216.0f * 2 - 1) * extent;
+            seed = seed * 1664525u + 1013904223u; zs[i] = ((seed >> 8) / 16777216.0f * 2 - 1) * extent;
+        }
         
-        envShader = new EnvironmentShader();
+        SpatialGrid grid;
+        for(int i = 0; i < n; i++) grid.Insert(i, xs[i], zs[i]);
         
-        vec3 diffuse_ka = vec3(0.1, 0.1, 0.1);
-        vec3 diffuse_kd = vec3(0.9, 0.9, 0.9);
-        vec3 diffuse_ks = vec3(0.0, 0.0, 0.0);
-        float diffuse_shininess = 0;
-
+        std::vector<float> qx(nQueries), qz(nQueries);
+        for(int q = 0; q < nQueries; q++)
+        {
+            seed = seed * 1664525u + 1013904223u; qx[q] = ((seed >> 8) / 16777216.0f * 2 - 1) * extent;
+            seed = seed * 1664525u + 1013904223u; qz[q] = ((seed >> 8) / 16777216.0f * 2 - 1) * extent;
+        }
         
-        vec3 specular_ka = vec3(0.1, 0.1, 0.1);
-        vec3 specular_kd = vec3(0.6, 0.6, 0.6);
-        vec3 specular_ks = vec3(0.3, 0.3, 0.3);
-        float specular_shininess = 50;
-
+        // the scan is slow enough on large counts that fewer queries are timed
+        int nScans = std::max(10, nQueries / std::max(1, n / 1000));
+        long scanHits = 0, gridHits = 0;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(int q = 0; q < nScans; q++)
+            for(int i = 0; i < n; i++)
+            {
+                float dx = xs[i] - qx[q], dz = zs[i] - qz[q];
+                if(dx * dx + dz * dz <= 100.0f) scanHits++;
+            }
+        double scan = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / nScans;
         
-        textures.push_back(new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/tigger/tigger.png"));
-        materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, textures[0], environmentMap));
-        geometries.push_back(new PolygonalMesh("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/tigger/tigger.obj"));
-        meshes.push_back(new Mesh(geometries[0], materials[0]));
-        Object* object = new AvatarObject(meshes[0], vec3(0.0, -1.0, 0.0), vec3(0.05, 0.05, 0.05), -60.0);
-        objects.push_back(object);
+        std::vector<int> result;
+        double range[2];
+        const float radii[2] = {0.5f, 10.0f};
+        for(int r = 0; r < 2; r++)
+        {
+            start = std::chrono::steady_clock::now();
+            for(int q = 0; q < nQueries; q++)
+            {
+                result.clear();
+                grid.QueryRange(qx[q], qz[q], radii[r], result);
+                if(r == 1 && q < nScans) gridHits += result.size();
+            }
+            range[r] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / nQueries;
+        }
         
-        textures.push_back(new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/tree/tree.png"));
-        materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, textures[1], environmentMap));
-        geometries.push_back(new PolygonalMesh("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/tree/tree.obj"));
-        meshes.push_back(new Mesh(geometries[1], materials[1]));
-        Object* object2 = new BackgroundObject(meshes[1], vec3(-2, -0.5, 0.5), vec3(0.06, 0.06, 0.06), -60.0);
-        objects.push_back(object2);
+        start = std::chrono::steady_clock::now();
+        for(int q = 0; q < nQueries; q++) checksum += grid.QueryNearest(qx[q], qz[q], 100.0f);
+        double nearest = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / nQueries;
         
-        textures.push_back(new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/tree/tree.png"));
-        materials.push_back(new Material(meshShader, specular_ka, specular_kd, specular_ks, specular_shininess, textures[2], environmentMap));
-        geometries.push_back(new PolygonalMesh("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/tree/tree.obj"));
-        meshes.push_back(new Mesh(geometries[2], materials[2]));
-        Object* object3 = new BackgroundObject(meshes[2], vec3(-1, -0.8, 4), vec3(0.03, 0.03, 0.03), 120.0);
-        objects.push_back(object3);
+        // every object takes a small step, about one in twenty crosses into another cell
+        start = std::chrono::steady_clock::now();
+        for(int i = 0; i < n; i++) grid.Move(i, xs[i] + 0.1f, zs[i]);
+        double move = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / n;
         
-        textures.push_back(new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/balloon/balloon.png"));
-        materials.push_back(new Material(meshShader, specular_ka, specular_kd, specular_ks, specular_shininess, textures[3], environmentMap));
-        geometries.push_back(new PolygonalMesh("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/balloon/balloon.obj"));
-        meshes.push_back(new Mesh(geometries[3], materials[3]));
-        Object* object4 = new BackgroundObject(meshes[3], vec3(-3, 2, 7), vec3(0.1, 0.1, 0.1), 0);
-        objects.push_back(object4);
+        printf("%-9d %14.2f %14.3f %14.3f %14.3f %14.1f%s\n", n, scan, range[0], range[1], nearest, move,
+               scanHits == gridHits ? "" : "  (range results differ from the scan)");
+    }
+    PrintChecksum(checksum);
+    return 0;
+}
 
-        textures.push_back(new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/ball/ball.png"));
-        materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, textures[4], environmentMap));
-        geometries.push_back(new PolygonalMesh("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/ball/ball.obj"));
-        meshes.push_back(new Mesh(geometries[4], materials[4]));
-        Object* object5 = new RoundObject(meshes[4], vec3(0, -0.6, 1.3), vec3(0.2, 0.2, 0.2), 90);
-        objects.push_back(object5);
-        
-        textures.push_back(new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/ball/ball.png"));
-        materials.push_back(new Material(marbleShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, textures[5], environmentMap));
-        geometries.push_back(new PolygonalMesh("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/ball/ball.obj"));
-        meshes.push_back(new Mesh(geometries[5], materials[5]));
-        Object* object6 = new RoundObject(meshes[5], vec3(-3, -0.8, 2.5), vec3(0.15, 0.15, 0.15), 90);
-        objects.push_back(object6);
-        
-        
-        vec3 carpos = vec3(2, -0.3, 3);
-        textures.push_back(new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/chevy/chevy.png"));
-        materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, textures[6], environmentMap));
-        geometries.push_back(new PolygonalMesh("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/chevy/chassis.obj"));
-        meshes.push_back(new Mesh(geometries[6], materials[6]));
-        Object* object7 = new CarObject(meshes[6], carpos, vec3(0.09, 0.09, 0.09), 90);
-        objects.push_back(object7);
+// peak resident set size of the process in KB
+long PeakMemoryKilobytes()
+{
+#if !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#else
+    return 0;
+#endif
+}
 
-        for (int i=0; i<4; i++) {
-            textures.push_back(new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/chevy/chevy.png"));
-            materials.push_back(new Material(meshShader, diffuse_ka, diffuse_kd, diffuse_ks, diffuse_shininess, textures[7+i], environmentMap));
-            geometries.push_back(new PolygonalMesh("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/chevy/wheel.obj"));
-            meshes.push_back(new Mesh(geometries[7+i], materials[7+i]));
+// resident set size of the process in KB right now, which unlike the peak can go down again
+long ResidentMemoryKilobytes()
+{
+#if defined(__APPLE__)
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if(task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info, &count) != KERN_SUCCESS) return 0;
+    return (long)(info.resident_size / 1024);
+#elif !defined(WIN32) && !defined(_WIN32) && !defined(__WIN32__)
+    FILE* file = fopen("/proc/self/statm", "r");
+    if(!file) return 0;
+    long pages = 0, residentPages = 0;
+    if(fscanf(file, "%ld %ld", &pages, &residentPages) != 2) residentPages = 0;
+    fclose(file);
+    return residentPages * (sysconf(_SC_PAGESIZE) / 1024);
+#else
+    return 0;
+#endif
+}
+
+// the value below which the given percentage of sorted values fall, 0 if there are none
+double Percentile(const std::vector<double>& sorted, double percentage)
+{
+    if(sorted.empty()) return 0;
+    return sorted[std::min((int)sorted.size() - 1, (int)(percentage / 100 * sorted.size()))];
+}
+
+// sorts the frame times and prints their median, 90th and 99th percentile and maximum
+void PrintFrameTimePercentiles(std::vector<double>& frameTimes)
+{
+    if(frameTimes.empty()) return;
+    std::sort(frameTimes.begin(), frameTimes.end());
+    const double percentiles[] = {50, 90, 99, 100};
+    printf("frame time:");
+    for(int i = 0; i < 4; i++) printf(" p%g %.2f ms", percentiles[i], Percentile(frameTimes, percentiles[i]));
+    printf("\n");
+}
+
+// the avatar walks straight ahead through the streamed world at 2 m per frame while every frame is
+// drawn; peak memory is sampled after each kilometer, so growth along the walk shows up
+int BenchmarkWalk(double kilometers)
+{
+    const float stepLength = 2.0f;
+    const int stepsPerKilometer = (int)(1000 / stepLength);
+    int nFrames = (int)(kilometers * 1000 / stepLength);
+    
+    Scene* benchScene = new Scene();
+    benchScene->Initialize();
+    loader.Finish();
+    
+    std::vector<double> frameTimes;
+    frameTimes.reserve(nFrames);
+    keyboardState['w'] = true;
+    printf("%-6s %14s %8s %12s\n", "km", "peak memory", "tiles", "ms/frame");
+    double kilometerTime = 0;
+    int kilometerFrames = 0;
+    for(int f = 0; f < nFrames; f++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        loader.ProcessUploads(uploadBudgetMilliseconds);
+        benchScene->Move(stepLength);
+        frameStats.Reset();
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        benchScene->Draw();
+        glFinish();
+        double frameTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        frameTimes.push_back(frameTime);
+        kilometerTime += frameTime;
+        kilometerFrames++;
+        
+        if((f + 1) % stepsPerKilometer == 0 || f + 1 == nFrames)
+        {
+            printf("%-6.1f %11ld KB %8d %12.2f\n", (f + 1) * stepLength / 1000, PeakMemoryKilobytes(),
+                   benchScene->GetStreamer().GetTileCount(), kilometerTime / kilometerFrames);
+            kilometerTime = 0;
+            kilometerFrames = 0;
         }
-        
-        //vec3 pos = carpos + vec3(1*cos(90), -0.3, -0.6*sin(90));
-        
-        Object* object8 = new WheelObject(meshes[7], carpos + vec3(1, -0.3, -0.6), vec3(0.09, 0.09, 0.09), 90);
-        objects.push_back(object8);
-        Object* object9 = new WheelObject(meshes[8], carpos + vec3(-1.25, -0.3, -0.6), vec3(0.09, 0.09, 0.09), 90);
-        objects.push_back(object9);
-        Object* object10 = new WheelObject(meshes[9], carpos + vec3(1, -0.3, 0.6), vec3(0.09, 0.09, 0.09), 90);
-        objects.push_back(object10);
-        Object* object11 = new WheelObject(meshes[10], carpos + vec3(-1.25, -0.3, 0.6), vec3(0.09, 0.09, 0.09), 90);
-        objects.push_back(object11);
-        
-        //environment = new Environment(envShader, environmentMap);
-        
-        textures.push_back(new Texture("/Users/Tongyu/Documents/AIT_Budapest/Graphics/Meshes/Meshes/tree/tree.png"));
-        materials.push_back(new Material(infiniteShader, specular_ka, specular_kd, specular_ks, specular_shininess, textures[11], environmentMap));
-        geometries.push_back(new InfiniteTexturedQuad());
-        meshes.push_back(new Mesh(geometries[11], materials[11]));
-        Object* object12 = new BackgroundObject(meshes[11], vec3(0.0, -1.0, 0.0), vec3(10.0, 1.0, 10.0));
-        objects.push_back(object12);
     }
+    keyboardState['w'] = false;
     
-    ~Scene()
+    TileStreamer& streamer = benchScene->GetStreamer();
+    printf("%d tiles generated, at most %d resident, at most %d pooled props in use\n",
+           streamer.GetTilesGenerated(), streamer.GetPeakTileCount(), streamer.GetPeakSlotsInUse());
+    
+    PrintFrameTimePercentiles(frameTimes);
+    
+    delete benchScene;
+    return 0;
+}
+
+// a Catmull-Rom spline through points on the ground, sampled densely once so it can be followed at
+// constant speed: At takes the distance along the path rather than the spline parameter
+class PathSpline
+{
+    std::vector<vec3> samples;
+    std::vector<float> distances;
+    
+public:
+    PathSpline(const std::vector<vec3>& points)
     {
-        for(int i = 0; i < textures.size(); i++) delete textures[i];
-        for(int i = 0; i < materials.size(); i++) delete materials[i];
-        for(int i = 0; i < geometries.size(); i++) delete geometries[i];
-        for(int i = 0; i < meshes.size(); i++) delete meshes[i];
-        for(int i = 0; i < objects.size(); i++) delete objects[i];
-        
-        if(meshShader) delete meshShader;
-        if(reflectiveShader) delete reflectiveShader;
-        if(infiniteShader) delete infiniteShader;
-        if(shadowShader) delete shadowShader;
-        if(environmentMap) delete environmentMap;
-        if(envShader) delete envShader;
-        if(marbleShader) delete marbleShader;
+        const int samplesPerSegment = 32;
+        int n = (int)points.size();
+        for(int i = 0; i + 1 < n || (i == 0 && n == 1); i++)
+            for(int k = 0; k < samplesPerSegment; k++)
+            {
+                vec3 p0 = points[std::max(i - 1, 0)], p1 = points[i];
+                vec3 p2 = points[std::min(i + 1, n - 1)], p3 = points[std::min(i + 2, n - 1)];
+                float t = (float)k / samplesPerSegment, t2 = t * t, t3 = t2 * t;
+                samples.push_back((p1 * 2 + (p2 - p0) * t + (p0 * 2 - p1 * 5 + p2 * 4 - p3) * t2 + (p1 * 3 - p0 - p2 * 3 + p3) * t3) * 0.5f);
+            }
+        samples.push_back(points.back());
+        distances.push_back(0);
+        for(int i = 1; i < (int)samples.size(); i++) distances.push_back(distances.back() + (samples[i] - samples[i - 1]).length());
     }
     
-    void Draw()
+    float GetLength() { return distances.back(); }
+    
+    // the point the given distance along, and the direction the path heads there
+    vec3 At(float distance, vec3& direction)
     {
-        // last object is the ground
+        distance = std::max(0.0f, std::min(distance, GetLength()));
+        int i = (int)(std::upper_bound(distances.begin(), distances.end(), distance) - distances.begin());
+        i = std::max(1, std::min(i, (int)samples.size() - 1));
+        float span = distances[i] - distances[i - 1];
+        direction = span > 0 ? (samples[i] - samples[i - 1]) * (1 / span) : vec3(0, 0, -1);
+        float t = span > 0 ? (distance - distances[i - 1]) / span : 0;
+        return samples[i - 1] + (samples[i] - samples[i - 1]) * t;
+    }
+};
 
-        for(int i = 0; i < objects.size()-1; i++){
-            objects[i]->DrawShadow(shadowShader);
-        }
-        for(int i = 0; i < objects.size(); i++){
-            objects[i]->Draw();
-            objects[0]->DrawSpotlight();
+// one run of the path benchmark: the avatar follows the points, or turns on the spot if there is only
+// one, so the helicam orbits it; with chase set, the car drives the path four metres ahead of it
+struct BenchmarkPath
+{
+    const char* name;
+    std::vector<vec3> points;
+    bool chase;
+    int trees;
+};
+
+struct BenchmarkPathResult
+{
+    const char* name;
+    double length;
+    double mean, p50, p95, p99, worst;
+    double drawCalls, triangles;
+    long peakMemoryKilobytes, memoryGrowthKilobytes;
+    double assetKilobytes;
+};
+
+// draws each path for the same number of frames in a fresh scene and reports frame time percentiles, the
+// draws and triangles per frame, and the highest resident memory during the path with how far it rose
+// above the memory at the path's start; with a file name, the results are also written as JSON so
+// runs on different builds can be diffed. Nothing waits for vsync, so with --headless this runs on
+// software GL
+int BenchmarkPaths(int nFrames, const char* jsonPath)
+{
+    const float chaseDistance = 4.0f;
+    BenchmarkPath paths[] = {
+        { "orbit", { vec3(0, 0, 0) }, false, 0 },
+        { "long walk", { vec3(0, 0, 0), vec3(20, 0, -60), vec3(-20, 0, -120), vec3(20, 0, -180), vec3(-20, 0, -240), vec3(0, 0, -300) }, false, 0 },
+        { "car chase", { vec3(-6, 0, 3), vec3(2, 0, 3), vec3(10, 0, -4), vec3(4, 0, -14), vec3(-8, 0, -12), vec3(-14, 0, 0), vec3(-4, 0, 10) }, true, 0 },
+        { "dense forest", { vec3(-90, 0, -90), vec3(-30, 0, -60), vec3(0, 0, 0), vec3(40, 0, 30), vec3(90, 0, 90) }, false, 4000 },
+    };
+    const int nPaths = sizeof(paths) / sizeof(paths[0]);
+    std::vector<BenchmarkPathResult> results;
+    
+    printf("%d frames per path\n", nFrames);
+    printf("%-14s %9s %9s %9s %9s %9s %8s %10s %12s %12s\n", "path", "mean", "p50", "p95", "p99", "max", "draws", "triangles", "peak memory", "growth");
+    for(int p = 0; p < nPaths; p++)
+    {
+        // the process's own peak never comes down, so each path samples what is resident instead
+        long startMemoryKilobytes = ResidentMemoryKilobytes();
+        long peakMemoryKilobytes = startMemoryKilobytes;
+        stressTrees = paths[p].trees;
+        Scene* benchScene = new Scene();
+        benchScene->Initialize();
+        loader.Finish();
+        
+        PathSpline spline(paths[p].points);
+        float length = spline.GetLength();
+        std::vector<double> frameTimes;
+        double drawCalls = 0, triangles = 0;
+        for(int f = 0; f < nFrames; f++)
+        {
+            float along = nFrames > 1 ? (float)f / (nFrames - 1) : 0;
+            vec3 direction;
+            float avatarDistance = paths[p].chase ? along * (length - chaseDistance) : along * length;
+            vec3 position = spline.At(avatarDistance, direction);
+            float orientation = atan2f(-direction.z, -direction.x) * 180 / M_PI;
+            if(paths[p].points.size() == 1) orientation = -60 + 720 * along;
+            benchScene->GetAvatar()->Follow(position.x, position.z, orientation);
+            if(paths[p].chase)
+            {
+                vec3 car = spline.At(avatarDistance + chaseDistance, direction);
+                benchScene->GetCar()->Follow(car.x, car.z, 0);
+            }
+            
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            loader.ProcessUploads(uploadBudgetMilliseconds);
+            benchScene->Move(1.0f / 60);
+            frameStats.Reset();
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            benchScene->Draw();
+            glFinish();
+            frameTimes.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            drawCalls += frameStats.drawCalls;
+            triangles += frameStats.triangles;
+            peakMemoryKilobytes = std::max(peakMemoryKilobytes, ResidentMemoryKilobytes());
         }
-        //environment->Draw();
         
+        BenchmarkPathResult result;
+        result.name = paths[p].name;
+        result.length = length;
+        result.mean = 0;
+        for(int f = 0; f < (int)frameTimes.size(); f++) result.mean += frameTimes[f] / frameTimes.size();
+        std::sort(frameTimes.begin(), frameTimes.end());
+        result.p50 = Percentile(frameTimes, 50);
+        result.p95 = Percentile(frameTimes, 95);
+        result.p99 = Percentile(frameTimes, 99);
+        result.worst = Percentile(frameTimes, 100);
+        result.drawCalls = drawCalls / std::max(1, nFrames);
+        result.triangles = triangles / std::max(1, nFrames);
+        result.peakMemoryKilobytes = peakMemoryKilobytes;
+        result.memoryGrowthKilobytes = peakMemoryKilobytes - startMemoryKilobytes;
+        result.assetKilobytes = assets.GetResidentBytes() / 1024.0;
+        results.push_back(result);
+        printf("%-14s %6.2f ms %6.2f ms %6.2f ms %6.2f ms %6.2f ms %8.1f %10.0f %9ld KB %9ld KB\n", result.name, result.mean, result.p50,
+               result.p95, result.p99, result.worst, result.drawCalls, result.triangles, result.peakMemoryKilobytes, result.memoryGrowthKilobytes);
+        
+        delete benchScene;
     }
+    stressTrees = 0;
     
-    void Move(float dt) {
-        for(int i = 0; i < objects.size(); i++){
-            objects[i]->Roll(dt, objects[6], i);
-            objects[i]->Move(dt);
-            objects[i]->PushedBy(dt, objects[0]);
-        }
+    if(!jsonPath) return 0;
+    FILE* file = fopen(jsonPath, "w");
+    if(!file)
+    {
+        printf("Cannot write %s\n", jsonPath);
+        return 1;
     }
-    
-    Object* GetAvatar() {
-        return objects[0];
+    fprintf(file, "{\n  \"renderer\": \"%s\",\n  \"frames\": %d,\n  \"paths\": [\n", (const char*)glGetString(GL_RENDERER), nFrames);
+    for(int p = 0; p < (int)results.size(); p++)
+    {
+        BenchmarkPathResult& r = results[p];
+        fprintf(file, "    {\"name\": \"%s\", \"length_m\": %.1f, \"mean_ms\": %.3f, \"p50_ms\": %.3f, \"p95_ms\": %.3f, \"p99_ms\": %.3f, "
+                "\"max_ms\": %.3f, \"draw_calls\": %.1f, \"triangles\": %.0f, \"peak_memory_kb\": %ld, \"memory_growth_kb\": %ld, \"asset_kb\": %.1f}%s\n",
+                r.name, r.length, r.mean, r.p50, r.p95, r.p99, r.worst, r.drawCalls, r.triangles, r.peakMemoryKilobytes,
+                r.memoryGrowthKilobytes, r.assetKilobytes, p + 1 < (int)results.size() ? "," : "");
     }
-};
-
-Scene scene;
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    printf("Results written to %s\n", jsonPath);
+    return 0;
+}
 
-void onInitialization()
+// 10000 trees scattered around the avatar, of which the helicam sees a handful; every frame is drawn
+// with and without culling, both with separate draws and with instancing
+int BenchmarkCulling()
 {
-    glViewport(0, 0, windowWidth, windowHeight);
+    const int nTrees = 10000;
+    const int nFrames = 20;
     
-    scene.Initialize();
+    printf("%d trees\n", nTrees);
+    printf("%-10s %-8s %22s %8s %8s %8s\n", "draws", "culling", "frame/cpu (ms)", "draws", "visible", "culled");
+    for(int instanced = 0; instanced < 2; instanced++)
+    {
+        for(int culled = 0; culled < 2; culled++)
+        {
+            stressTrees = nTrees;
+            instancingEnabled = instanced != 0;
+            cullingEnabled = culled != 0;
+            
+            Scene* benchScene = new Scene();
+            benchScene->Initialize();
+            loader.Finish();
+            benchScene->Draw();
+            glFinish();
+            
+            double cpuTime = 0;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for(int f = 0; f < nFrames; f++)
+            {
+                frameStats.Reset();
+                glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                std::chrono::steady_clock::time_point drawStart = std::chrono::steady_clock::now();
+                benchScene->Draw();
+                cpuTime += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - drawStart).count() / nFrames;
+                glFinish();
+            }
+            double frameTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nFrames;
+            printf("%-10s %-8s %13.2f / %6.2f %8d %8d %8d\n", instanced ? "instanced" : "separate", culled ? "on" : "off",
+                   frameTime, cpuTime, frameStats.drawCalls, frameStats.visibleObjects, frameStats.culledObjects);
+            delete benchScene;
+        }
+    }
+    
+    stressTrees = 0;
+    instancingEnabled = true;
+    cullingEnabled = true;
+    return 0;
 }
 
-void onExit()
+// --bench-shadows: time of a frame while the shadow map is reused, while the car drives and only the
+// moving casters are redrawn over the cached static layer, and while both layers are redrawn, with 1000
+// extra trees.
+// software GL like llvmpipe rasterizes when the frame is flushed and reports timer queries near zero,
+// there the frame time, taken until glFinish returns, is the GPU time
+int BenchmarkShadows()
 {
-    printf("exit");
+    const int sizes[] = {512, 1024, 2048};
+    const int nFrames = 20;
+    const char* modes[] = {"cached", "moving casters", "all casters"};
+    
+    stressTrees = 1000;
+    Scene* benchScene = new Scene();
+    benchScene->Initialize();
+    loader.Finish();
+    ShadowMap& shadowMap = benchScene->GetShadowMap();
+    
+    // quality is the width of a texel in each cascade, cost is the frame time with
+    // the map cached, with only the moving casters redrawn, and with every caster redrawn
+    printf("%-9s %-6s %-30s %-30s %10s %10s %10s\n", "cascades", "size", "ends (m)", "texels (cm)", modes[0], modes[1], modes[2]);
+    for(int cascades = 1; cascades <= maxShadowCascades; cascades++)
+        for(int s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++)
+        {
+            shadowMap.Configure(cascades, sizes[s]);
+            benchScene->Draw();
+            glFinish();
+            
+            char ends[64] = "", texels[64] = "";
+            for(int c = 0; c < cascades; c++)
+            {
+                snprintf(ends + strlen(ends), sizeof(ends) - strlen(ends), "%s%.2f", c ? " " : "", shadowMap.GetCascadeEnd(c));
+                snprintf(texels + strlen(texels), sizeof(texels) - strlen(texels), "%s%.2f", c ? " " : "", shadowMap.GetTexelSize(c) * 100);
+            }
+            double frameTimes[3];
+            for(int mode = 0; mode < 3; mode++)
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                for(int f = 0; f < nFrames; f++)
+                {
+                    keyboardState['i'] = mode == 1;
+                    if(mode == 1) benchScene->Move(1.0f / 60);
+                    if(mode == 2) shadowMap.Invalidate(true);
+                    frameStats.Reset();
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                    benchScene->Draw();
+                    glFinish();
+                }
+                frameTimes[mode] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / nFrames;
+                keyboardState['i'] = false;
+            }
+            printf("%-9d %-6d %-30s %-30s %10.2f %10.2f %10.2f\n", cascades, sizes[s], ends, texels, frameTimes[0], frameTimes[1], frameTimes[2]);
+        }
+    delete benchScene;
+    
+    stressTrees = 0;
+    return 0;
 }
 
-void onDisplay()
+#if defined(HEADLESS_EGL)
+// a GL context with no window: EGL on Mesa's surfaceless platform, which llvmpipe provides on machines
+// without a GPU or display server, drawing into a framebuffer object the size of the window
+class HeadlessContext
 {
+    EGLDisplay display;
+    EGLContext context;
+    unsigned int framebuffer;
+    unsigned int renderbuffers[2];
     
-    glClearColor(0.3, 0.48, 0.52, 0);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    scene.Draw();
+public:
+    HeadlessContext() : display(EGL_NO_DISPLAY), context(EGL_NO_CONTEXT), framebuffer(0) {}
     
-    glutSwapBuffers();
+    ~HeadlessContext()
+    {
+        if(context == EGL_NO_CONTEXT) return;
+        eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(display, context);
+        eglTerminate(display);
+    }
     
-}
+    bool Create(int width, int height)
+    {
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+            (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if(getPlatformDisplay) display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if(display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        EGLint major, minor;
+        if(display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+        {
+            printf("Headless: no EGL display\n");
+            return false;
+        }
+        eglBindAPI(EGL_OPENGL_API);
+        
+        // the context never draws to a surface, so any config that renders OpenGL will do
+        EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+        EGLConfig config = EGL_NO_CONFIG_KHR;
+        EGLint configs = 0;
+        eglChooseConfig(display, configAttributes, &config, 1, &configs);
+        if(configs == 0) config = EGL_NO_CONFIG_KHR;
+        
+        EGLint contextAttributes[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 4, EGL_CONTEXT_MINOR_VERSION, 1,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+        context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+        if(context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+        {
+            printf("Headless: no OpenGL 4.1 core context (EGL %d.%d)\n", major, minor);
+            return false;
+        }
+        
+        // GLEW built for GLX reports that there is no GLX display, after it has loaded the GL functions
+#if !defined(__APPLE__)
+        glewExperimental = true;
+        glewInit();
+#endif
+        
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glGenRenderbuffers(2, renderbuffers);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        {
+            printf("Headless: incomplete framebuffer\n");
+            return false;
+        }
+        glViewport(0, 0, width, height);
+        return true;
+    }
+};
+#endif
 
-void onKeyboard(unsigned char key, int x, int y)
+// the keys the headless run holds down and for how many frames; the avatar turns, walks out and veers
+// right with the car driving alongside, then the car turns and drives off while the avatar stands
+struct ScriptedInput
 {
-    keyboardState[key] = true;
-}
+    int frames;
+    const char* keys;
+};
 
-void onKeyboardUp(unsigned char key, int x, int y)
-{
-    keyboardState[key] = false;
-}
+const ScriptedInput headlessScript[] = {
+    {90, "a"}, {120, "w"}, {45, "wd"}, {120, "w"}, {90, "wi"}, {60, "ij"}, {120, "i"}, {60, ""}
+};
 
-void onReshape(int winWidth, int winHeight)
+// draws the scene for a fixed number of frames with no window, at a simulated 60 frames per second so
+// every run takes the same steps, holding down the scripted keys unless a recording is replayed; the input
+// goes through the same queue as GLUT's callbacks. Prints the frame time spread, the GL work per frame and where the avatar ended up
+int RunHeadless(int nFrames)
 {
-    camera.SetAspectRatio((float)winWidth / winHeight);
-    glViewport(0, 0, winWidth, winHeight);
-}
-
-void onIdle( ) {
-    double t = glutGet(GLUT_ELAPSED_TIME) * 0.001;
-    static double lastTime = 0.0;
-    double dt = t - lastTime;
-    lastTime = t;
-    
-    camera.Control();
-    camera.MoveHelicam(scene.GetAvatar()->GetPosition(), scene.GetAvatar()->GetOrientation(), dt);
-    //camera.Move(dt);
-    scene.Move(dt);
+    const double frameLength = 1.0 / 60;
+    loader.Finish();
+    ReportStartup();
+    
+    std::vector<double> frameTimes;
+    frameTimes.reserve(nFrames);
+    double simulationTime = 0, totalTime = 0;
+    long long glCalls = 0, drawCalls = 0;
+    bool held[256] = {false};
+    bool scripted = !inputPlayer.IsPlaying();
+    int segment = 0, segmentFrame = 0;
+    const int nSegments = sizeof(headlessScript) / sizeof(headlessScript[0]);
+    for(int f = 0; f < nFrames; f++)
+    {
+        bool wanted[256] = {false};
+        for(const char* key = headlessScript[segment].keys; *key; key++) wanted[(unsigned char)*key] = true;
+        for(int key = 0; key < 256 && scripted; key++)
+            if(wanted[key] != held[key])
+            {
+                InputQueue::Event event = { (unsigned char)key, wanted[key] };
+                inputQueue.Push(event);
+                held[key] = wanted[key];
+            }
+        if(++segmentFrame == headlessScript[segment].frames)
+        {
+            segment = (segment + 1) % nSegments;
+            segmentFrame = 0;
+        }
+        
+        double time = (f + 1) * frameLength;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point simulated;
+        {
+            ProfileScope frameScope("frame");
+            simulation.AdvanceTo(time);
+            simulated = std::chrono::steady_clock::now();
+            {
+                ProfileScope scope("uploads");
+                loader.ProcessUploads(uploadBudgetMilliseconds);
+            }
+            frameStats.Reset();
+            glClearColor(0.3, 0.48, 0.52, 0);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            {
+                ProfileScope scope("draw");
+                scene.Draw(time);
+            }
+            {
+                ProfileScope scope("capture", true);
+                capture.Capture();
+            }
+            ProfileScope scope("finish");
+            glFinish();
+        }
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+        profiler.EndFrame();
+        
+        double frameTime = std::chrono::duration<double, std::milli>(end - start).count();
+        frameTimes.push_back(frameTime);
+        totalTime += frameTime;
+        simulationTime += std::chrono::duration<double, std::milli>(simulated - start).count();
+        glCalls += frameStats.glCalls;
+        drawCalls += frameStats.drawCalls;
+    }
     
-    glutPostRedisplay();
+    int frames = std::max(1, nFrames);
+    printf("%d frames headless: %.2f ms per frame, %.2f ms of it simulating\n", nFrames, totalTime / frames, simulationTime / frames);
+    PrintFrameTimePercentiles(frameTimes);
+    printf("%.1f GL calls, %.1f draw calls per frame\n", (double)glCalls / frames, (double)drawCalls / frames);
+    vec3 avatar = scene.GetAvatar()->GetTransform().GetPosition();
+    capture.Finish();
+    inputRecorder.Close();
+    profiler.Finish();
+    printf("Avatar at %.3f %.3f %.3f, GL error %x\n", avatar.x, avatar.y, avatar.z, glGetError());
+    return 0;
 }
 
 int main(int argc, char * argv[])
 {
-    glutInit(&argc, argv);
+    if(argc > 1 && strcmp(argv[1], "--bench-obj") == 0)
+        return BenchmarkObjLoading(argc > 2 ? argv[2] : meshDirectory);
+    if(argc > 1 && strcmp(argv[1], "--bench-math") == 0)
+        return BenchmarkMath();
+    if(argc > 1 && strcmp(argv[1], "--bench-transforms") == 0)
+        return BenchmarkTransforms(argc > 2 ? atoi(argv[2]) : 0);
+    if(argc > 1 && strcmp(argv[1], "--bench-grid") == 0)
+        return BenchmarkSpatialGrid();
+    if(argc > 1 && strcmp(argv[1], "--cook-textures") == 0)
+        return CookTextures(argc > 2 ? argv[2] : meshDirectory);
+    
+    bool benchLoad = false;
+    bool benchInstancing = false;
+    bool benchCulling = false;
+    bool benchShadows = false;
+    double benchWalk = 0;
+    int benchPaths = 0;
+    const char* benchJson = NULL;
+    bool headless = false;
+    int headlessFrames = 600;
+    const char* capturePath = NULL;
+    const char* recordPath = NULL;
+    const char* replayPath = NULL;
+    const char* profilePath = NULL;
+    int loaderThreads = std::min(8, std::max(1, (int)std::thread::hardware_concurrency()));
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--loader-threads") == 0 && i + 1 < argc) loaderThreads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--bench-load") == 0) benchLoad = true;
+        else if(strcmp(argv[i], "--bench-instancing") == 0) benchInstancing = true;
+        else if(strcmp(argv[i], "--no-instancing") == 0) instancingEnabled = false;
+        else if(strcmp(argv[i], "--stress-trees") == 0 && i + 1 < argc) stressTrees = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--bench-culling") == 0) benchCulling = true;
+        else if(strcmp(argv[i], "--no-culling") == 0) cullingEnabled = false;
+        else if(strcmp(argv[i], "--bench-shadows") == 0) benchShadows = true;
+        else if(strcmp(argv[i], "--shadow-cascades") == 0 && i + 1 < argc) shadowCascadeCount = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--shadow-size") == 0 && i + 1 < argc)
+        {
+            if(atoi(argv[i + 1]) > 0) shadowMapSize = atoi(argv[i + 1]);
+            else printf("--shadow-size needs a positive number of texels, using %d\n", shadowMapSize);
+            i++;
+        }
+        else if(strcmp(argv[i], "--no-streaming") == 0) streamingEnabled = false;
+        else if(strcmp(argv[i], "--no-mipmaps") == 0) mipmapsEnabled = false;
+        else if(strcmp(argv[i], "--anisotropy") == 0 && i + 1 < argc) maxAnisotropy = (float)atof(argv[++i]);
+        else if(strcmp(argv[i], "--no-cooked-textures") == 0) cookedTexturesEnabled = false;
+        else if(strcmp(argv[i], "--simulation-thread") == 0) simulationThreadEnabled = true;
+        else if(strcmp(argv[i], "--no-simulation-thread") == 0) simulationThreadEnabled = false;
+        else if(strcmp(argv[i], "--bench-paths") == 0)
+            benchPaths = i + 1 < argc && atoi(argv[i + 1]) > 0 ? atoi(argv[++i]) : 600;
+        else if(strcmp(argv[i], "--bench-json") == 0 && i + 1 < argc) benchJson = argv[++i];
+        else if(strcmp(argv[i], "--bench-walk") == 0)
+            benchWalk = i + 1 < argc && atof(argv[i + 1]) > 0 ? atof(argv[++i]) : 10;
+        else if(strcmp(argv[i], "--capture") == 0 && i + 1 < argc) capturePath = argv[++i];
+        else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) recordPath = argv[++i];
+        else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc) replayPath = argv[++i];
+        else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc) profilePath = argv[++i];
+        else if(strcmp(argv[i], "--headless") == 0)
+        {
+            headless = true;
+            if(i + 1 < argc && atoi(argv[i + 1]) > 0) headlessFrames = atoi(argv[++i]);
+        }
+    }
+    
+    // headless, the benchmarks draw into the offscreen framebuffer instead of the window
+#if defined(HEADLESS_EGL)
+    HeadlessContext headlessContext;
+    if(headless && !headlessContext.Create(windowWidth, windowHeight))
+        return 1;
+#else
+    if(headless)
+    {
+        printf("--headless needs a build with HEADLESS_EGL defined, linked against libEGL\n");
+        return 1;
+    }
+#endif
+    
+    if(!headless)
+    {
+        glutInit(&argc, argv);
 #if !defined(__APPLE__)
-    glutInitContextVersion(majorVersion, minorVersion);
+        glutInitContextVersion(majorVersion, minorVersion);
 #endif
-    glutInitWindowSize(windowWidth, windowHeight);
-    glutInitWindowPosition(50, 50);
+        glutInitWindowSize(windowWidth, windowHeight);
+        glutInitWindowPosition(50, 50);
 #if defined(__APPLE__)
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_3_2_CORE_PROFILE);
+        glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH | GLUT_3_2_CORE_PROFILE);
 #else
-    glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
+        glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE | GLUT_DEPTH);
 #endif
-    glutCreateWindow("3D Mesh Rendering");
-    
+        glutCreateWindow("3D Mesh Rendering");
+        
 #if !defined(__APPLE__)
-    glewExperimental = true;
-    glewInit();
+        glewExperimental = true;
+        glewInit();
 #endif
+    }
     printf("GL Vendor    : %s\n", glGetString(GL_VENDOR));
     printf("GL Renderer  : %s\n", glGetString(GL_RENDERER));
     printf("GL Version (string)  : %s\n", glGetString(GL_VERSION));
@@ -2759,8 +8895,46 @@ int main(int argc, char * argv[])
     glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
     printf("GL Version (integer) : %d.%d\n", majorVersion, minorVersion);
     printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+    blockCompressionSupported = HasExtension("GL_EXT_texture_compression_s3tc") && !IsSoftwareRenderer();
+    printf("S3TC textures: %s\n", blockCompressionSupported ? "uploaded compressed" : "decompressed on load");
+    
+    if(benchLoad)
+        return BenchmarkAssetLoading();
+    if(benchInstancing)
+        return BenchmarkInstancing();
+    if(benchCulling)
+        return BenchmarkCulling();
+    if(benchShadows)
+        return BenchmarkShadows();
+    if(benchWalk > 0)
+        return BenchmarkWalk(benchWalk);
+    if(benchPaths > 0)
+        return BenchmarkPaths(benchPaths, benchJson);
+    
+    if(recordPath && !inputRecorder.Open(recordPath, simulation.GetStepsPerSecond()))
+    {
+        printf("Cannot record to %s\n", recordPath);
+        return 1;
+    }
+    if(replayPath && !inputPlayer.Open(replayPath, simulation.GetStepsPerSecond()))
+    {
+        printf("Cannot replay %s\n", replayPath);
+        return 1;
+    }
+    waitForTiles = recordPath || replayPath;
+    if(profilePath && !profiler.Start(profilePath))
+    {
+        printf("Cannot write %s.json and %s.csv\n", profilePath, profilePath);
+        return 1;
+    }
     
+    loader.SetWorkerCount(loaderThreads);
     onInitialization();
+    if(capturePath && !capture.Start(capturePath, windowWidth, windowHeight, 60))
+        return 1;
+    if(headless)
+        return RunHeadless(headlessFrames);
+    if(simulationThreadEnabled) simulation.Start();
     
     glutDisplayFunc(onDisplay);
     glutIdleFunc(onIdle);
@@ -2768,7 +8942,15 @@ int main(int argc, char * argv[])
     glutKeyboardUpFunc(onKeyboardUp);
     glutReshapeFunc(onReshape);
     
+    // neither GLUT returns from its main loop when the window closes, so the capture, recording and
+    // profile are finished from the close callback, or at exit when the program quits another way
+#if defined(__APPLE__)
+    glutWMCloseFunc(onExit);
+#else
+    glutCloseFunc(onExit);
+#endif
+    atexit(onExit);
+    
     glutMainLoop();
-    onExit();
     return 1;
 }